@@ -0,0 +1,313 @@
+// Micro-benchmarks for the hot paths of the library. Build and run them with:
+//
+//   ./run.sh bench
+//
+// Every benchmark reports the time, the allocations and the bytes allocated per operation.
+// Allocations are counted by a flag_allocator installed with SetFlagAllocator.
+
+#include "flag.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MIN_NS 200000000.0  // Run every benchmark for at least this long.
+#define BENCH_MAX_FLAGS 256       // Largest flag count measured.
+#define BENCH_SUBCOMMANDS 32      // Subcommands registered by the subcommand benchmarks.
+
+// Allocation counters, updated by counting_alloc.
+static size_t num_allocs;
+static size_t alloc_bytes;
+
+static void* counting_alloc(size_t size, size_t alignment, void* data) {
+  (void)data;
+  num_allocs++;
+  alloc_bytes += size;
+  if (alignment <= _Alignof(max_align_t)) {
+    return malloc(size);
+  }
+  return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+
+static void counting_free(void* ptr, void* data) {
+  (void)data;
+  free(ptr);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Run fn with growing iteration counts until one run takes BENCH_MIN_NS, then report the
+// cost of one iteration of that run.
+static void run_bench(const char* name, void (*fn)(void* state, long iters), void* state) {
+  long iters = 1;
+  for (;;) {
+    size_t allocs = num_allocs;
+    size_t bytes = alloc_bytes;
+    double start = now_ns();
+    fn(state, iters);
+    double elapsed = now_ns() - start;
+
+    if (elapsed >= BENCH_MIN_NS || iters >= (1L << 40)) {
+      fprintf(stderr, "%-32s %12ld %12.1f ns/op %8.2f allocs/op %10.1f B/op\n", name, iters,
+              elapsed / (double)iters, (double)(num_allocs - allocs) / (double)iters,
+              (double)(alloc_bytes - bytes) / (double)iters);
+      return;
+    }
+
+    // Aim 20% past the target, growing at most 100x at a time like Go's testing package.
+    double next = elapsed > 0 ? BENCH_MIN_NS * 1.2 / (elapsed / (double)iters) : iters * 100.0;
+    if (next > iters * 100.0) {
+      next = iters * 100.0;
+    }
+    iters = next > iters ? (long)next : iters + 1;
+  }
+}
+
+// Keeps the compiler from dropping the reads being measured.
+static volatile size_t sink;
+
+static void noop_handler(FlagArgs args) {
+  (void)args;
+}
+
+static void capture_handler(FlagArgs args);
+
+// A context with num_flags global flags of one type, and the argv that sets all of them.
+typedef struct parse_state {
+  flag_ctx* ctx;
+  int argc;
+  char** argv;
+} parse_state;
+
+static int int_values[BENCH_MAX_FLAGS];
+static char* string_values[BENCH_MAX_FLAGS];
+static char names[BENCH_MAX_FLAGS][16];    // flagN
+static char dashed[BENCH_MAX_FLAGS][18];   // -flagN
+static char numbers[BENCH_MAX_FLAGS][16];  // Values for the int flags.
+static char* argv_buf[2 * BENCH_MAX_FLAGS + 8];
+
+static void init_names(void) {
+  for (int i = 0; i < BENCH_MAX_FLAGS; i++) {
+    snprintf(names[i], sizeof(names[i]), "flag%d", i);
+    snprintf(dashed[i], sizeof(dashed[i]), "-flag%d", i);
+    snprintf(numbers[i], sizeof(numbers[i]), "%d", i * 7919);
+  }
+}
+
+static void make_globals(parse_state* s, int num_flags, bool strings) {
+  s->ctx = CreateFlagContext();
+  s->argv = argv_buf;
+  s->argc = 0;
+  s->argv[s->argc++] = "bench";
+  for (int i = 0; i < num_flags; i++) {
+    if (strings) {
+      AddFlag(s->ctx, .name = names[i], .value = &string_values[i], .type = FLAG_STRING, "s");
+    } else {
+      AddFlag(s->ctx, .name = names[i], .value = &int_values[i], .type = FLAG_INT, "n");
+    }
+    s->argv[s->argc++] = dashed[i];
+    s->argv[s->argc++] = strings ? names[i] : numbers[i];
+  }
+}
+
+static void bench_parse(void* state, long iters) {
+  parse_state* s = state;
+  for (long i = 0; i < iters; i++) {
+    flag_status status = ParseFlagsEx(s->ctx, s->argc, s->argv, NULL, NULL);
+    sink += (size_t)status;
+  }
+}
+
+// 4 int flags followed by num_paths positional arguments, as xargs would pass them.
+static void make_positionals(parse_state* s, int num_paths) {
+  make_globals(s, 4, false);
+  for (int i = 0; i < num_paths; i++) {
+    s->argv[s->argc++] = names[i];
+  }
+}
+
+// 8 int flags with a range and 8 string flags with a pattern, all set by argv.
+static void make_checked(parse_state* s) {
+  s->ctx = CreateFlagContext();
+  s->argv = argv_buf;
+  s->argc = 0;
+  s->argv[s->argc++] = "bench";
+  for (int i = 0; i < 8; i++) {
+    AddFlag(s->ctx, .name = names[i], .value = &int_values[i], .type = FLAG_INT, .desc = "n",
+            .range = &(flag_range){0, 1e9});
+    s->argv[s->argc++] = dashed[i];
+    s->argv[s->argc++] = numbers[i];
+  }
+  for (int i = 8; i < 16; i++) {
+    AddFlag(s->ctx, .name = names[i], .value = &string_values[i], .type = FLAG_STRING,
+            .desc = "s", .pattern = "[a-z]+[0-9]*");
+    s->argv[s->argc++] = dashed[i];
+    s->argv[s->argc++] = names[i];
+  }
+}
+
+// BENCH_SUBCOMMANDS subcommands with 16 flags each. argv selects the subcommand at
+// position target and sets all of its flags.
+static void make_subcommands(parse_state* s, int target) {
+  static char subcmd_names[BENCH_SUBCOMMANDS][16];
+  static int subcmd_values[BENCH_SUBCOMMANDS][16];
+
+  s->ctx = CreateFlagContext();
+  s->argv = argv_buf;
+  s->argc = 0;
+  s->argv[s->argc++] = "bench";
+  for (int i = 0; i < 4; i++) {
+    AddFlag(s->ctx, .name = names[i], .value = &int_values[i], .type = FLAG_INT, "n");
+    s->argv[s->argc++] = dashed[i];
+    s->argv[s->argc++] = "42";
+  }
+
+  for (int i = 0; i < BENCH_SUBCOMMANDS; i++) {
+    snprintf(subcmd_names[i], sizeof(subcmd_names[i]), "cmd%d", i);
+    subcommand* subcmd = AddSubCmd(s->ctx, .name = subcmd_names[i], .desc = "subcommand",
+                                   .handler = i == target ? capture_handler : noop_handler);
+    for (int j = 0; j < 16; j++) {
+      AddSubCmdFlag(subcmd, .name = names[j + 16], .value = &subcmd_values[i][j],
+                    .type = FLAG_INT, "n");
+    }
+  }
+
+  s->argv[s->argc++] = subcmd_names[target];
+  for (int j = 0; j < 16; j++) {
+    s->argv[s->argc++] = dashed[j + 16];
+    s->argv[s->argc++] = numbers[j];
+  }
+}
+
+// Lookups of the flags registered by make_globals.
+static void bench_flag_value_ctx(void* state, long iters) {
+  parse_state* s = state;
+  for (long i = 0; i < iters; i++) {
+    sink += *(int*)FlagValueCtx(s->ctx, names[i & 15]);
+  }
+}
+
+// Arguments of the selected subcommand, captured by its handler.
+static FlagArgs subcmd_args;
+
+static void capture_handler(FlagArgs args) {
+  subcmd_args = args;
+}
+
+static void bench_flag_value(void* state, long iters) {
+  (void)state;
+  for (long i = 0; i < iters; i++) {
+    sink += *(int*)FlagValue(subcmd_args.flags, subcmd_args.num_flags, names[16 + (i & 15)]);
+  }
+}
+
+static void bench_flag_value_args(void* state, long iters) {
+  (void)state;
+  for (long i = 0; i < iters; i++) {
+    sink += *(int*)FlagValueArgs(&subcmd_args, names[16 + (i & 15)]);
+  }
+}
+
+static flag* handles[16];
+
+static void bench_typed_getter(void* state, long iters) {
+  (void)state;
+  for (long i = 0; i < iters; i++) {
+    sink += (size_t)FlagInt(handles[i & 15]);
+  }
+}
+
+static void bench_context(void* state, long iters) {
+  (void)state;
+  for (long i = 0; i < iters; i++) {
+    flag_ctx* ctx = CreateFlagContext();
+    for (int j = 0; j < MAX_GLOBAL_FLAGS; j++) {
+      AddFlag(ctx, .name = names[j], .value = &int_values[j], .type = FLAG_INT, "n");
+    }
+    DestroyFlagContext(ctx);
+  }
+}
+
+static void bench_help(void* state, long iters) {
+  parse_state* s = state;
+  for (long i = 0; i < iters; i++) {
+    PrintHelp(s->ctx, s->argv);
+  }
+  fflush(stdout);
+}
+
+int main(void) {
+  char name[64];
+  parse_state s;
+  init_names();
+  SetFlagAllocator(&(flag_allocator){.alloc = counting_alloc, .free = counting_free});
+
+  // Flag counts below, at and past the initial capacity of the global flags.
+  const int counts[] = {4, MAX_GLOBAL_FLAGS, 64, BENCH_MAX_FLAGS};
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    make_globals(&s, counts[i], false);
+    snprintf(name, sizeof(name), "ParseFlags/int/%d", counts[i]);
+    run_bench(name, bench_parse, &s);
+    DestroyFlagContext(s.ctx);
+
+    make_globals(&s, counts[i], true);
+    snprintf(name, sizeof(name), "ParseFlags/string/%d", counts[i]);
+    run_bench(name, bench_parse, &s);
+    DestroyFlagContext(s.ctx);
+  }
+
+  make_positionals(&s, BENCH_MAX_FLAGS);
+  snprintf(name, sizeof(name), "ParseFlags/positional/%d", BENCH_MAX_FLAGS);
+  run_bench(name, bench_parse, &s);
+  DestroyFlagContext(s.ctx);
+
+  make_checked(&s);
+  run_bench("ParseFlags/checked/16", bench_parse, &s);
+  DestroyFlagContext(s.ctx);
+
+  const int targets[] = {0, BENCH_SUBCOMMANDS - 1};
+  for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+    make_subcommands(&s, targets[i]);
+    snprintf(name, sizeof(name), "ParseFlags/subcmd/%d", targets[i]);
+    run_bench(name, bench_parse, &s);
+    if (i == 1) {
+      subcommand* subcmd;
+      ParseFlagsEx(s.ctx, s.argc, s.argv, &subcmd, NULL);
+      InvokeSubCmd(subcmd, s.ctx);
+      run_bench("FlagValue", bench_flag_value, &s);
+      run_bench("FlagValueArgs", bench_flag_value_args, &s);
+    }
+    DestroyFlagContext(s.ctx);
+  }
+
+  make_globals(&s, MAX_GLOBAL_FLAGS, false);
+  ParseFlagsEx(s.ctx, s.argc, s.argv, NULL, NULL);
+  run_bench("FlagValueCtx", bench_flag_value_ctx, &s);
+  DestroyFlagContext(s.ctx);
+
+  s.ctx = CreateFlagContext();
+  for (int i = 0; i < 16; i++) {
+    handles[i] = AddFlag(s.ctx, .name = names[i], .value = &int_values[i], .type = FLAG_INT, "n");
+  }
+  run_bench("FlagInt", bench_typed_getter, &s);
+  DestroyFlagContext(s.ctx);
+
+  run_bench("CreateFlagContext+Destroy", bench_context, NULL);
+
+  // Help goes to stdout, which is pointed at /dev/null while it is measured.
+  make_subcommands(&s, 0);
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  run_bench("PrintHelp", bench_help, &s);
+  dup2(saved, STDOUT_FILENO);
+  close(null_fd);
+  close(saved);
+  DestroyFlagContext(s.ctx);
+  return EXIT_SUCCESS;
+}
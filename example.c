@@ -16,50 +16,53 @@ static float float32_flag = 0.0;
 static double float64_flag = 0.0;
 static const char* string_flag = "";
 
+// Handles returned by AddFlag/AddSubCmdFlag, read in the handlers with the typed getters.
+static flag *float64_handle, *count_handle, *verbose_handle, *name_handle;
+
 bool validate_int(const void* value) {
   int* int_value = (int*)value;
   return (*int_value >= 0 && *int_value <= 10);
 }
 
 void handler(FlagArgs args) {
-  int count = *(int*)FlagValue(args.flags, args.num_flags, "count");
-  bool verbose = *(bool*)FlagValue(args.flags, args.num_flags, "verbose");
+  int count = FlagInt(count_handle);
+  bool verbose = FlagBool(verbose_handle);
 
   printf("count=%d verbose=%d\n", count, verbose);
 
   // ctx will provide you with access to global flags
-  double float64 = *(double*)FlagValueCtx(args.ctx, "float64");
+  double float64 = FlagDouble(float64_handle);
   printf("float64 value in callback: %lf\n", float64);
 }
 
 void handle_greet(FlagArgs args) {
-  const char* name = *(const char**)FlagValue(args.flags, args.num_flags, "name");
+  // Flags can also be looked up by name.
+  const char* name = *(const char**)FlagValueArgs(&args, "name");
   printf("Hello, %s!\n", name);
 }
 
 void registerSubcommands(flag_ctx* ctx) {
-  int count = 0;
-  bool verbose = true;
+  static int count = 0;
+  static bool verbose = true;
   subcommand *cmd1, *cmd2;
 
   cmd1 = AddSubCmd(ctx, .name = "print", .desc = "print hello", .handler = handler, .capacity = 2);
-  AddSubCmdFlag(cmd1, .name = "verbose", .value = &verbose, .type = FLAG_BOOL,
-                .desc = "Verbose output", );
+  verbose_handle = AddSubCmdFlag(cmd1, .name = "verbose", .value = &verbose, .type = FLAG_BOOL,
+                                 .desc = "Verbose output", );
 
   // Add flags to subcommand
-  flag* fcount;
-  fcount = AddSubCmdFlag(cmd1, .name = "count", .value = &count, .type = FLAG_INT,
-                         .desc = "The number of times to print hello", );
+  count_handle = AddSubCmdFlag(cmd1, .name = "count", .value = &count, .type = FLAG_INT,
+                               .desc = "The number of times to print hello", );
 
-  SetValidator(fcount, validate_int, "count must be between 0 and 10");
+  SetValidator(count_handle, validate_int, "count must be between 0 and 10");
 
   // Second subcommand
   cmd2 = AddSubCmd(ctx, .name = "greet", .desc = "Greets the user", .handler = handle_greet,
                    .capacity = 1);
 
-  char* name = "Guest";
-  AddSubCmdFlag(cmd2, .name = "name", .value = &name, .type = FLAG_STRING,
-                .desc = "The name of the user to greet", );
+  static char* name = "Guest";
+  name_handle = AddSubCmdFlag(cmd2, .name = "name", .value = &name, .type = FLAG_STRING,
+                              .desc = "The name of the user to greet", );
 }
 
 int main(int argc, char* argv[]) {
@@ -78,11 +81,15 @@ int main(int argc, char* argv[]) {
   AddFlag(ctx, .name = "uint64", .value = &uint64_flag, .type = FLAG_UINT64, "A uint64_t flag");
   AddFlag(ctx, .name = "uintptr", .value = &uintptr_flag, .type = FLAG_UINTPTR, "A uintptr_t flag");
   AddFlag(ctx, .name = "float32", .value = &float32_flag, .type = FLAG_FLOAT, "A float32 flag");
-  AddFlag(ctx, .name = "float64", .value = &float64_flag, .type = FLAG_DOUBLE, "A float64 flag");
+  float64_handle =
+    AddFlag(ctx, .name = "float64", .value = &float64_flag, .type = FLAG_DOUBLE, "A float64 flag");
   AddFlag(ctx, .name = "string", .value = &string_flag, .type = FLAG_STRING, "A string flag");
 
   registerSubcommands(ctx);
 
+  // Answer "./flag __completion bash" and the completions requested by the script.
+  EnableFlagCompletion(ctx);
+
   // Parse flags
   subcommand* cmd = ParseFlags(ctx, argc, argv);
 
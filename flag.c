@@ -1,5 +1,34 @@
+// The schema headers only define macros, so they come first and may set FLAG_SCHEMA_SEED.
+#ifdef FLAG_SCHEMA
+#include FLAG_SCHEMA
+#endif
+
+#ifdef FLAG_SCHEMA_INDEX
+#include FLAG_SCHEMA_INDEX
+#endif
+
 #include "flag.h"
 
+#include <fcntl.h>
+#include <float.h>
+#include <locale.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef FLAG_NO_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
+
+extern char** environ;
+
 // Flag validator contains a callback function to validate a flag
 // and an error message to print if validation fails
 typedef struct flag_validator {
@@ -7,705 +36,5304 @@ typedef struct flag_validator {
   const char* error_message;             // error message to print if validation fails
 } flag_validator;
 
-// Create a struct to hold flag information
+// Bounds of an integer flag: those of its type, or the .range given when it was added.
+// Each bound is stored as a magnitude and a sign, so that every integer type fits.
+typedef struct flag_int_range {
+  uintmax_t max;       // Largest value accepted, or its magnitude if max_negative.
+  uintmax_t min;       // Smallest value accepted, or its magnitude if min_negative.
+  bool max_negative;   // The largest value is below 0.
+  bool min_negative;   // The smallest value is below 0.
+  uint8_t size;        // Width of the type.
+  bool is_signed;      // The type is signed.
+  const char* reason;  // Error for a value outside the bounds.
+} flag_int_range;
+
+// Set of the strings a flag accepts, see flag_params.choices. Open addressing on the name
+// hash, like flag_index.
+typedef struct flag_choices {
+  const char** slots;  // Accepted strings. NULL marks an empty slot.
+  uint32_t* hashes;    // flag_hash of each slot.
+  size_t mask;         // Number of slots - 1.
+} flag_choices;
+
+// Nodes of a pattern, so that the states of a match fit in one 64-bit word with the
+// accepting state.
+#define FLAG_PATTERN_MAX 63
+
+// A pattern compiled by pattern_compile. Node i matches one character of a class, once,
+// optionally or any number of times. A match runs all nodes at once, as a set of states:
+// bit i is active while node i may match the next character.
+typedef struct flag_pattern {
+  uint64_t start;                   // States active before the first character.
+  uint64_t accept;                  // State left after the last node.
+  uint64_t next[FLAG_PATTERN_MAX];  // States active after node i matched a character.
+  uint64_t chars[256];              // Nodes whose class holds each character.
+} flag_pattern;
+
+// Declarative checks of a flag (.range, .choices, .pattern) and the validators stacked
+// with AddValidator. Only the bounds are read while converting; the rest runs once per
+// parse, after all flags are read.
+typedef struct flag_checks {
+  bool ranged;                 // ints or min and max bound the value.
+  flag_int_range ints;         // Bounds of an integer flag or list.
+  double min;                  // Bounds of a float or double flag or list.
+  double max;
+  const char* range_reason;    // Error for a value outside the bounds.
+  const flag_choices* choices;  // Accepted strings, or NULL.
+  const flag_pattern* pattern;  // Pattern the strings must match, or NULL.
+  const char* choices_reason;  // Errors for a string outside the choices or pattern.
+  const char* pattern_reason;
+  flag_validator* validators;  // Validators added with AddValidator, in that order.
+  size_t num_validators;
+  size_t validator_capacity;
+} flag_checks;
+
+// Hot flag record. Holds only what lookups and parsing read, so that the flag arrays
+// scanned while parsing stay a few cache lines long.
 typedef struct flag {
-  char name[MAX_NAME];                // flag name. Also used for flag lookup
-  void* value;                        // Value stored in the flag.
-  flag_type type;                     // Flag Type enum.
-  char description[MAX_DESCRIPTION];  // Flag description.
-  bool required;                      // This flag must be provided
-  flag_validator flag_validator;      // Optional validator for this flag.
+  uint32_t hash;                  // Hash of name. Compared before the name in lookups.
+  uint32_t name_len;              // strlen(name).
+  flag_type type;                 // Flag Type enum.
+  bool copy;                      // FLAG_STRING: store an arena copy instead of the argv pointer.
+  bool lazy;                      // Convert the value on first access instead of while parsing.
+  bool reload;                    // Changed by ReloadFlagConfig, so accessed atomically.
+  const char* name;               // flag name. Also used for flag lookup
+  void* value;                    // Value stored in the flag.
+  const char* pending;            // Lazy flags: raw value waiting to be converted, or NULL.
+  flag_validator flag_validator;  // Optional validator for this flag.
+  flag_checks* checks;            // Declarative checks and stacked validators, or NULL.
 } flag;
 
+// Cold flag data, only read by help output and post-parse checks.
+// Stored in an array parallel to the flag list it describes.
+typedef struct flag_info {
+  const char* env;  // Environment variable bound to the flag, or NULL.
+  const char* description;  // Flag description.
+  bool required;            // This flag must be provided
+} flag_info;
+
+// Open-addressing index over a flag list, keyed by the name hash.
+// Built lazily on the first lookup and rebuilt whenever flags are added to the list.
+typedef struct flag_index {
+  uint16_t* slots;  // 1-based positions into the flag list. 0 marks an empty slot.
+  size_t mask;      // Number of slots - 1. The table size is always a power of 2.
+  unsigned bits;    // log2 of the table size.
+  bool perfect;     // No two names share a slot, so a lookup probes exactly one slot.
+  size_t count;     // Number of flags indexed when the table was last built.
+} flag_index;
+
+#define FLAG_SET_MAX_FLAGS UINT16_MAX  // Flags a set can hold, the most slots can point at.
+
+// Block of a context arena. Each block is at least twice the size of the previous one.
+typedef struct flag_arena_block {
+  struct flag_arena_block* prev;  // Previously filled block.
+  size_t size;                    // Usable bytes in data.
+  size_t used;                    // Bytes already handed out.
+  max_align_t data[];             // Allocation space.
+} flag_arena_block;
+
+// Bump allocator owning every flag, subcommand and string of a context.
+// Nothing is freed individually; DestroyFlagContext releases all blocks at once.
+typedef struct flag_arena {
+  flag_arena_block* head;  // Block new allocations are carved from.
+} flag_arena;
+
+// Bitsets over the flags of a set, one bit per position in the list.
+#define FLAG_WORD_BITS 64
+#define FLAG_WORDS(n) (((n) + FLAG_WORD_BITS - 1) / FLAG_WORD_BITS)
+
+static inline void bit_set(uint64_t* bits, size_t i) {
+  bits[i / FLAG_WORD_BITS] |= (uint64_t)1 << (i % FLAG_WORD_BITS);
+}
+
+static inline bool bit_test(const uint64_t* bits, size_t i) {
+  return (bits[i / FLAG_WORD_BITS] >> (i % FLAG_WORD_BITS)) & 1;
+}
+
+// Values of .reload flags are read and written with one atomic access of their size, so a
+// reader sees either the value before a reload or the one after it.
+static inline bool flag_atomic_size(size_t size) {
+  return size == 1 || size == 2 || size == 4 || size == 8;
+}
+
+static inline void flag_atomic_load(void* dst, const void* src, size_t size) {
+  switch (size) {
+    case 1: {
+      uint8_t v = __atomic_load_n((const uint8_t*)src, __ATOMIC_ACQUIRE);
+      memcpy(dst, &v, size);
+    } break;
+    case 2: {
+      uint16_t v = __atomic_load_n((const uint16_t*)src, __ATOMIC_ACQUIRE);
+      memcpy(dst, &v, size);
+    } break;
+    case 4: {
+      uint32_t v = __atomic_load_n((const uint32_t*)src, __ATOMIC_ACQUIRE);
+      memcpy(dst, &v, size);
+    } break;
+    case 8: {
+      uint64_t v = __atomic_load_n((const uint64_t*)src, __ATOMIC_ACQUIRE);
+      memcpy(dst, &v, size);
+    } break;
+    default:
+      memcpy(dst, src, size);
+  }
+}
+
+// Release pairs with the acquire of flag_atomic_load, so that a reader of a new string
+// pointer also sees the bytes it points to.
+static inline void flag_atomic_store(void* dst, const void* src, size_t size) {
+  switch (size) {
+    case 1: {
+      uint8_t v;
+      memcpy(&v, src, size);
+      __atomic_store_n((uint8_t*)dst, v, __ATOMIC_RELEASE);
+    } break;
+    case 2: {
+      uint16_t v;
+      memcpy(&v, src, size);
+      __atomic_store_n((uint16_t*)dst, v, __ATOMIC_RELEASE);
+    } break;
+    case 4: {
+      uint32_t v;
+      memcpy(&v, src, size);
+      __atomic_store_n((uint32_t*)dst, v, __ATOMIC_RELEASE);
+    } break;
+    case 8: {
+      uint64_t v;
+      memcpy(&v, src, size);
+      __atomic_store_n((uint64_t*)dst, v, __ATOMIC_RELEASE);
+    } break;
+    default:
+      memcpy(dst, src, size);
+  }
+}
+
+// A constraint between flags of one set, see AddFlagGroup.
+typedef struct flag_group {
+  struct flag_group* next;  // Next group of the set.
+  flag_group_kind kind;
+  size_t first;        // Position of the first flag, which triggers FLAG_GROUP_REQUIRES.
+  uint64_t* mask;      // Flags of the group. The first one is left out for REQUIRES.
+  size_t words;        // Length of mask.
+  const char* reason;  // Error message for FLAG_GROUP_ONE_OF.
+} flag_group;
+
+// Flags owned by the global context or by a subcommand.
+// Records never move once added, so the pointers returned by AddFlag stay valid. Each time
+// the list grows, the records for the new capacity are allocated as one run so that the
+// hot records of a set stay packed together.
+typedef struct flag_set {
+  flag** list;        // Flag records, in registration order.
+  flag_info* info;    // Help metadata, indexed like list.
+  size_t count;       // Number of flags in the set.
+  size_t capacity;    // Allocated length of list and info.
+  flag* run;          // Records for positions [run_start, capacity).
+  size_t run_start;   // Position of run[0].
+  flag_index index;   // Hash index over list.
+  flag_arena* arena;  // Arena of the owning context.
+
+  // Bitsets over list. They are kept apart from info, which is read-only for the static
+  // schema, so that the checks at the end of a parse work a word at a time.
+  uint64_t* required;    // Flags that must be given.
+  uint64_t* configured;  // Flags set by a config file or the environment, which satisfies
+                         // required.
+  uint64_t* given;       // Flags given on the command line by the last ParseFlagsEx.
+  struct flag_group* groups;  // Constraints between flags of the set, see AddFlagGroup.
+
+  unsigned char* defaults;     // Values of list[0, num_defaults) before the first parse.
+  uint32_t* default_offsets;  // Offset of the default of each saved flag in defaults,
+                              // aligned for its type like offsets.
+  size_t num_defaults;        // Number of flags whose default is saved.
+  size_t defaults_size;       // Bytes used in defaults.
+
+  uint32_t* offsets;  // Offset of each flag's value in a flag_result. Set when frozen.
+  bool frozen;        // No more flags may be added.
+
+  flag** sorted;        // list[0, sorted_count) ordered by name, for prefix searches.
+  size_t sorted_count;  // Number of flags in sorted.
+} flag_set;
+
+// Trie node over the names of the subcommands at one level. The children of a node are
+// chained through sibling, starting at child, so each node is a few bytes whatever the
+// alphabet. Node 0 is the root and stands for the empty prefix.
+typedef struct flag_trie_node {
+  uint32_t child;    // First node one character further, or 0.
+  uint32_t sibling;  // Next child of the same parent, or 0.
+  uint32_t count;    // Subcommands whose names pass through this node.
+  uint32_t last;     // Position of the last of them in the level.
+  int32_t exact;     // Position of the subcommand whose name ends here, or -1.
+  char label;        // Character leading to this node.
+} flag_trie_node;
+
+// The subcommands one level below a context or subcommand, with their dispatch index.
+typedef struct flag_subcmds {
+  struct subcommand** list;  // Subcommands in registration order.
+  size_t count;              // Number of subcommands in list.
+  size_t capacity;           // Allocated length of list.
+
+  flag_trie_node* trie;  // Index of list[0, indexed), see subcmds_index.
+  size_t indexed;        // Number of subcommands in trie.
+
+  struct subcommand** sorted;  // list[0, sorted_count) ordered by name, for prefix searches.
+  size_t sorted_count;         // Number of subcommands in sorted.
+} flag_subcmds;
+
 // Subcommand struct.
 typedef struct subcommand {
-  char name[MAX_NAME];                // name of the subcommand.
-  char description[MAX_DESCRIPTION];  // usage description.
+  const char* name;         // name of the subcommand.
+  const char* path;         // Names from the top level down to this one, space separated.
+  const char* description;  // usage description.
+  struct subcommand* parent;  // Subcommand this one is nested in, or NULL.
+  size_t depth;               // Number of subcommands above this one.
+  flag_subcmds children;      // Subcommands nested in this one.
+  struct flag_ctx* ctx;       // Context the subcommand belongs to.
 
   // optional callback. Called automatically with flags, num_flags and global flag context.
   // when done parsing it's flags.
   void (*callback)(FlagArgs args);
-  struct flag* flags;  // flags for this subcommand.
-  int num_flags;       // number of flags for this subcommand.
-  int flag_capacity;   // Maximum flags
+  flag_set flags;  // flags for this subcommand.
+#ifdef FLAG_STATS
+  flag_stats* stats;  // Counters of the owning context.
+#endif
 } subcommand;
 
+// Positional arguments of a parse. While they sit next to each other in argv, items is a
+// slice of argv and capacity is 0. Otherwise items is an array from the values arena.
+typedef struct flag_positionals {
+  char** items;     // The positional arguments, in order.
+  size_t count;     // Number of items.
+  size_t capacity;  // Allocated length of items, or 0 for a slice of argv.
+} flag_positionals;
+
 // Create a flag context to store global flags
 typedef struct flag_ctx {
-  flag flags[MAX_GLOBAL_FLAGS];  // flags in global context.
-  size_t num_flags;              // Number of global flags stored.
+  flag_set flags;  // flags in global context.
+
+  subcommand** subcommands;    // All subcommands, nested ones included, parents first.
+  size_t num_subcommands;      // number of subcommands
+  size_t subcommand_capacity;  // Allocated length of subcommands.
+  flag_subcmds children;       // The top-level subcommands.
+  bool subcmd_prefixes;        // Dispatch on unambiguous prefixes, see AllowSubCmdPrefixes.
+  size_t subcmd_words;         // Bitset words for the flags of the largest subcommand.
+
+  flag_arena arena;   // Backing memory for everything above.
+  flag_arena values;  // Copies of .copy string values. Emptied by every parse.
+  flag_positionals positionals;  // Positional arguments of the last parse.
+
+  struct flag_mapping* mappings;   // Config files referenced by string flags.
+  struct flag_mapping* responses;  // Response files read by the last parse.
 
-  subcommand* subcommands[MAX_SUBCOMMANDS];  // array of pointers to subcommands
-  size_t num_subcommands;                    // number of subcommands
+  bool frozen;                     // Set by FreezeFlagContext.
+  size_t result_size;              // Bytes of flag values in a flag_result.
+  unsigned char* result_defaults;  // Default values laid out like a flag_result.
+  char* help;                 // Text printed by PrintHelp after the program name, or NULL.
+  size_t help_len;            // Length of help.
+  size_t* help_sections;      // Offsets of the sections of the subcommands in help, and the end.
+  size_t help_flags;          // Flags and subcommands registered when help was rendered.
+  unsigned defaults_version;  // Bumped whenever a config file or the environment is loaded.
+  unsigned help_version;      // defaults_version when help was rendered.
+  bool completion;            // Set by EnableFlagCompletion.
+
+  const char* cache_path;       // Parse cache set by SetFlagCache, or NULL.
+  uint32_t cache_version;       // Version passed to SetFlagCache.
+  bool cache_pending;           // The next ParseFlagsEx may be answered from the cache.
+  bool sources_pending;         // A cache hit skipped the sources, see cache_settle.
+  struct flag_source* sources;  // Loads deferred until the cache is checked.
+  struct flag_watcher* watcher;  // Thread started by WatchFlagConfig, or NULL.
+  char** reload_strings;         // Strings published by reloads, open addressing, or NULL.
+  size_t reload_strings_count;   // Strings in reload_strings.
+  size_t reload_strings_mask;    // Slots in reload_strings, minus one.
+  char reload_value[MAX_DESCRIPTION];  // Value rejected by the last failed reload.
+
+#ifdef FLAG_STATS
+  flag_stats stats;  // Instrumentation counters.
+#endif
 } flag_ctx;
 
-extern void inline realdbgprintf(const char* SourceFilename, int SourceLineno,
-                                 const char* CFormatString, ...);
+// Identity of a file as seen by stat, which changes whenever the file is written.
+typedef struct flag_file_id {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint64_t ctime_ns;
+} flag_file_id;
 
-static const char* flagAsString(flag_type type);
+// A mapped config or response file. String flags may point into it, so config files are
+// only unmapped by DestroyFlagContext, and response files by the next parse.
+typedef struct flag_mapping {
+  struct flag_mapping* next;
+  void* addr;        // NULL for an empty file.
+  size_t len;
+  const char* path;  // File that was mapped.
+  flag_file_id id;   // The file when it was mapped.
+  char* tail;        // Copy of an unterminated last line, or NULL. Freed with the mapping.
+  size_t tail_len;
 
-// Initialize a flag context and add global help flag.
-flag_ctx* CreateFlagContext(void) {
-  flag_ctx* ctx = (flag_ctx*)malloc(sizeof(flag_ctx));
-  f_assert(ctx != NULL, "[ERROR]: Unable to allocated memory for flag_ctx");
+  // Config files only, see ReloadFlagConfig.
+  flag_file_id failed;  // The file as it was when a reload last rejected it, or zero.
+} flag_mapping;
 
-  ctx->num_flags = 0;
-  ctx->num_subcommands = 0;
+// Config file or environment load deferred by SetFlagCache until ParseFlagsEx.
+typedef struct flag_source {
+  struct flag_source* next;
+  const char* path;  // Config file to load, or NULL for the environment.
+} flag_source;
 
-  memset(ctx->flags, 0, sizeof(flag) * MAX_GLOBAL_FLAGS);
-  memset(ctx->subcommands, 0, sizeof(subcommand*) * MAX_SUBCOMMANDS);
+// Slot of the temporary index that LoadFlagEnv builds over flags bound to a variable.
+typedef struct env_slot {
+  uint32_t hash;   // flag_hash of the variable name.
+  uint32_t len;    // Length of the variable name.
+  flag_set* set;   // Set holding the flag. NULL marks an empty slot.
+  size_t pos;      // Position of the flag in set.
+} env_slot;
 
-  // Add help flag
-  AddFlag(ctx, .name = "help", .desc = "Print help message", .type = FLAG_BOOL);
-  return ctx;
-}
+// Response file being tokenized.
+typedef struct flag_response {
+  char* p;           // Start of the untokenized rest of the file.
+  char* end;         // End of the mapping.
+  const char* path;  // Path of the file, for errors.
+  int line;          // Line of p.
+} flag_response;
 
-void DestroyFlagContext(flag_ctx* ctx) {
-  if (ctx) {
-    for (size_t i = 0; i < ctx->num_subcommands; i++) {
-      free(ctx->subcommands[i]->flags);
-      free(ctx->subcommands[i]);
-    }
-    free(ctx);
-    ctx = NULL;
-  }
-}
+// Where a token came from.
+typedef struct flag_origin {
+  int index;         // argv position of the token, or of the @file argument that led to it.
+  const char* file;  // Response file holding the token, or NULL for argv.
+  int line;          // Line in file, or 0.
+} flag_origin;
 
-// Add a flag to the flag context
-flag* _flag_add(flag_ctx* ctx, flag_params* params) {
-  // check for enough capacity
-  f_assert(MAX_GLOBAL_FLAGS > ctx->num_flags,
-           "[ERROR]: Not enough capacity in global flags to add flag: %s\n", params->name);
+// Cursor over the tokens of a command line: argv, with every @file argument replaced by
+// the tokens of that file. Files are mapped when the cursor reaches them and tokenized in
+// place, so the parse loops read the expanded command line without it ever being copied.
+typedef struct flag_tokens {
+  int argc;                                  // Number of arguments in argv.
+  char** argv;                               // Arguments being parsed.
+  int next;                                  // Next argv position to read.
+  flag_response files[FLAG_RESPONSE_DEPTH];  // Open response files, innermost last.
+  int depth;                                 // Number of open response files.
+  int file_index;                            // argv position of the outermost open @file.
+  flag_arena* values;                        // Holds tokens that must be copied.
+  struct flag_mapping** mappings;            // Receives the mapped response files.
+  char* peeked;                              // Token read ahead, or NULL.
+  flag_origin peeked_at;                     // Where peeked came from.
+  flag_origin at;                            // Where the last consumed token came from.
+} flag_tokens;
 
-  // copy name
-  strncpy(ctx->flags[ctx->num_flags].name, params->name, MAX_NAME - 1);
-  // null terminate name
-  ctx->flags[ctx->num_flags].name[MAX_NAME - 1] = '\0';
+// Per-thread parse output for a frozen context. Flag values live in data at the offsets
+// assigned by FreezeFlagContext. Allocated in whole cache lines so that results used by
+// different threads never share one.
+struct flag_result {
+  const flag_ctx* ctx;             // The context this result was created for.
+  subcommand* subcmd;              // Subcommand selected by the last parse, or NULL.
+  flag_arena values;               // Copies of .copy string values. Emptied by every parse.
+  struct flag_mapping* responses;  // Response files read by the last parse.
+  flag_positionals positionals;    // Positional arguments of the last parse.
+  max_align_t data[];
+};
 
-  ctx->flags[ctx->num_flags].value = params->value;
-  ctx->flags[ctx->num_flags].type = params->type;
+#ifdef FLAG_SCHEMA
+#ifndef FLAG_SCHEMA_INDEX
+#error "FLAG_SCHEMA also needs -DFLAG_SCHEMA_INDEX with the header generated by flaggen"
+#endif
 
-  strncpy(ctx->flags[ctx->num_flags].description, params->desc, MAX_DESCRIPTION - 1);
-  ctx->flags[ctx->num_flags].description[MAX_DESCRIPTION - 1] = '\0';
+// Position of every schema flag. Position 0 is the implicit help flag.
+#define FLAG_SCHEMA_ID(n, var, t, d, r) FLAG_SCHEMA_ID_##var,
+enum { FLAG_SCHEMA_HELP_ID, FLAG_SCHEMA_TABLE(FLAG_SCHEMA_ID) FLAG_SCHEMA_COUNT };
 
-  ctx->flags[ctx->num_flags].required = params->req;
-  ctx->flags[ctx->num_flags].flag_validator = (flag_validator){0};
-  return &ctx->flags[ctx->num_flags++];
-}
+_Static_assert(FLAG_SCHEMA_INDEX_COUNT == FLAG_SCHEMA_COUNT,
+               "FLAG_SCHEMA_INDEX is out of date. Re-run flaggen.");
 
-void SetValidator(flag* flag, bool (*validator)(const void* value), const char* err_msg) {
-  flag->flag_validator = (flag_validator){.validator = validator, .error_message = err_msg};
-}
+#define FLAG_SCHEMA_CHECK(n, var, t, d, r)                                                         \
+  _Static_assert(sizeof(n) <= 64 && sizeof(n) <= MAX_NAME,                                         \
+                 "Flag name too long for FLAG_SCHEMA: " n);
+FLAG_SCHEMA_TABLE(FLAG_SCHEMA_CHECK)
 
-subcommand* _flag_add_subcommand(flag_ctx* ctx, subcmd_params* params) {
+#define FLAG_SCHEMA_RECORD(n, var, t, d, r)                                                        \
+  {.hash = FLAG_HASH_LITERAL(n), .name_len = sizeof(n) - 1, .type = t, .name = n, .value = &var},
+#define FLAG_SCHEMA_INFO(n, var, t, d, r) {.description = d, .required = r},
 
-  f_assert(MAX_SUBCOMMANDS > ctx->num_subcommands,
-           "[ERROR]: Not enough capacity in subcommands to add subcommand: %s\n", params->name);
+static const flag flag_schema_flags[FLAG_SCHEMA_COUNT] = {
+  {.hash = FLAG_HASH_LITERAL("help"), .name_len = 4, .type = FLAG_BOOL, .name = "help"},
+  FLAG_SCHEMA_TABLE(FLAG_SCHEMA_RECORD)};
 
-  f_assert(params->handler != NULL, "No handler provided for subcommand: %s\n", params->name);
+static const flag_info flag_schema_info[FLAG_SCHEMA_COUNT] = {
+  {.description = "Print help message"}, FLAG_SCHEMA_TABLE(FLAG_SCHEMA_INFO)};
 
-  subcommand* subcmd = (subcommand*)malloc(sizeof(subcommand));
-  f_assert(subcmd, "[ERROR]: Unable to allocate memory for subcommand");
+#define FLAG_SCHEMA_LIST(n, var, t, d, r) (flag*)&flag_schema_flags[FLAG_SCHEMA_ID_##var],
 
-  strncpy(subcmd->name, params->name, MAX_NAME - 1);
-  subcmd->name[MAX_NAME - 1] = '\0';
+static flag* const flag_schema_list[FLAG_SCHEMA_COUNT] = {
+  (flag*)&flag_schema_flags[FLAG_SCHEMA_HELP_ID], FLAG_SCHEMA_TABLE(FLAG_SCHEMA_LIST)};
 
-  strncpy(subcmd->description, params->desc, MAX_DESCRIPTION - 1);
-  subcmd->description[MAX_DESCRIPTION - 1] = '\0';
+static const uint16_t flag_schema_slots[1 << FLAG_SCHEMA_INDEX_BITS] = FLAG_SCHEMA_INDEX_SLOTS;
+#endif
 
-  subcmd->callback = params->handler;
-  subcmd->flags = (flag*)malloc(params->capacity * sizeof(flag));
-  f_assert(subcmd->flags, "[ERROR]: Unable to allocate memory for subcommand flags");
+extern void inline realdbgprintf(const char* SourceFilename, int SourceLineno,
+                                 const char* CFormatString, ...);
 
-  subcmd->num_flags = 0;
-  subcmd->flag_capacity = params->capacity;
-  ctx->subcommands[ctx->num_subcommands] = subcmd;
-  ctx->num_subcommands++;
-  return subcmd;
+static const char* flagAsString(flag_type type);
+static bool flag_type_known(flag_type type);
+static bool flag_is_list(flag_type type);
+static flag_type_ops flag_types[FLAG_MAX_TYPES];  // Filled in with the conversion functions.
+static const flag_int_range int_ranges[FLAG_UINTPTR + 1];  // Bounds of the integer types.
+static void* flag_value(flag* f);
+static void unmap_files(flag_mapping** list);
+static void cache_defer(flag_ctx* ctx, const char* path);
+static uint64_t cache_key(const flag_ctx* ctx, int argc, char* argv[]);
+static bool cache_load(flag_ctx* ctx, uint64_t key, subcommand** selected);
+static flag_status cache_apply_sources(flag_ctx* ctx, flag_error* err);
+static flag_status cache_settle(flag_ctx* ctx, flag_error* err);
+static void cache_save(const flag_ctx* ctx, uint64_t key, const subcommand* selected);
+static void stop_watcher(flag_ctx* ctx);
+
+// C locale used by the libc fallback of the float parser. Created once by the first
+// CreateFlagContext, or left (locale_t)0 if newlocale fails, in which case the fallback
+// parses in the locale of the calling thread.
+static locale_t c_locale;
+
+static void c_locale_init(void) {
+  c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
 }
 
-flag* _subcommand_add_flag(subcommand* subcmd, flag_params* params) {
-  f_assert(subcmd->num_flags < subcmd->flag_capacity,
-           "[ERROR]: Not enough capacity new subcommand(%s) flag: %s\n", subcmd->name,
-           params->name);
+#ifndef FLAG_NO_THREADS
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+#endif
+
+#ifdef FLAG_STATS
+// Counters of the context being set up or parsed on this thread, or NULL. Frozen parses
+// leave it NULL, so concurrent parses never share counters.
+static _Thread_local flag_stats* active_stats;
+
+static uint64_t stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-  strncpy(subcmd->flags[subcmd->num_flags].name, params->name, MAX_NAME - 1);
-  subcmd->flags[subcmd->num_flags].name[MAX_NAME - 1] = '\0';
+// Count into stats until STATS_LEAVE in the same block.
+#define STATS_ENTER(stats)                                                                         \
+  flag_stats* stats_saved = active_stats;                                                          \
+  active_stats = (stats)
+#define STATS_LEAVE() (active_stats = stats_saved)
+#define STATS_ADD(field, n) (active_stats ? (void)(active_stats->field += (n)) : (void)0)
 
-  subcmd->flags[subcmd->num_flags].value = params->value;
-  subcmd->flags[subcmd->num_flags].type = params->type;
+// Start a timer, and add the time since it started (or was last lapped) to field.
+#define STATS_CLOCK(var) uint64_t var = stats_clock()
+#define STATS_LAP(field, var)                                                                      \
+  do {                                                                                             \
+    uint64_t stats_now = stats_clock();                                                            \
+    STATS_ADD(field, stats_now - (var));                                                           \
+    (var) = stats_now;                                                                             \
+  } while (0)
+#else
+#define STATS_ENTER(stats) ((void)0)
+#define STATS_LEAVE() ((void)0)
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_CLOCK(var) ((void)0)
+#define STATS_LAP(field, var) ((void)0)
+#endif
 
-  strncpy(subcmd->flags[subcmd->num_flags].description, params->desc, MAX_DESCRIPTION - 1);
-  subcmd->flags[subcmd->num_flags].description[MAX_DESCRIPTION - 1] = '\0';
+// malloc, or aligned_alloc for alignments that malloc does not guarantee.
+static void* default_alloc(size_t size, size_t alignment, void* data) {
+  (void)data;
+  if (alignment <= _Alignof(max_align_t)) {
+    return malloc(size);
+  }
+  return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
 
-  subcmd->flags[subcmd->num_flags].required = params->req;
-  subcmd->flags[subcmd->num_flags].flag_validator = (flag_validator){0};
-  return &subcmd->flags[subcmd->num_flags++];
+static void default_free(void* ptr, void* data) {
+  (void)data;
+  free(ptr);
 }
 
-// Function to check if a string is a valid integer
-bool is_valid_integer(const char* str) {
-  if (str == NULL || str[0] == '\0') {
-    return false;
+static flag_allocator allocator = {.alloc = default_alloc, .free = default_free};
+
+void SetFlagAllocator(const flag_allocator* a) {
+  allocator = a ? *a : (flag_allocator){.alloc = default_alloc, .free = default_free};
+}
+
+// Every allocation of the library goes through flag_alloc and flag_free.
+static void* flag_alloc(size_t size, size_t alignment) {
+  STATS_ADD(allocs, 1);
+  STATS_ADD(alloc_bytes, size);
+  return allocator.alloc(size, alignment, allocator.data);
+}
+
+static void flag_free(void* ptr) {
+  if (ptr != NULL) {
+    allocator.free(ptr, allocator.data);
   }
+}
 
-  // Check for optional sign
-  if (str[0] == '-' || str[0] == '+') {
-    str++;
+// Polynomial hash of a flag or subcommand name. Matches FLAG_HASH_LITERAL in flag.h.
+// Stores strlen(name) in *len as a by-product.
+static uint32_t flag_hash(const char* name, size_t* len) {
+  const char* start = name;
+  uint32_t hash = 0;
+  uint32_t pow = FLAG_HASH_MULT;
+  while (*name) {
+    hash += (unsigned char)*name++ * pow;
+    pow *= FLAG_HASH_MULT;
   }
+  *len = (size_t)(name - start);
+  return hash;
+}
 
-  // Check for empty string after removing sign
-  if (str[0] == '\0') {
+// Returns true if f is named name, whose hash and length are already known.
+static inline bool flag_matches(const flag* f, uint32_t hash, size_t len, const char* name) {
+  if (f->hash != hash || f->name_len != len) {
     return false;
   }
+  STATS_ADD(compares, 1);
+  return memcmp(f->name, name, len) == 0;
+}
 
-  // Check if the remaining characters are digits
-  for (int i = 0; str[i] != '\0'; i++) {
-    if (!isdigit((unsigned char)str[i])) {
-      return false;
+// Allocate size bytes aligned for any type from the arena.
+static void* arena_alloc(flag_arena* arena, size_t size) {
+  size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+  flag_arena_block* block = arena->head;
+  if (block == NULL || block->size - block->used < size) {
+    size_t block_size = block ? block->size * 2 : FLAG_ARENA_BLOCK_SIZE;
+    while (block_size < size) {
+      block_size *= 2;
     }
+
+    block = (flag_arena_block*)flag_alloc(sizeof(flag_arena_block) + block_size,
+                                          _Alignof(flag_arena_block));
+    f_assert(block != NULL, "[ERROR]: Unable to allocate %zu bytes for flag arena", block_size);
+    block->prev = arena->head;
+    block->size = block_size;
+    block->used = 0;
+    arena->head = block;
   }
 
-  return true;
+  void* ptr = (unsigned char*)block->data + block->used;
+  block->used += size;
+  return ptr;
 }
 
-// Print an error message and exit
-void flag_fatalf(const char* format, ...) {
-  va_list args;
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
-  exit(EXIT_FAILURE);
+// Copy at most max_len bytes of str into the arena.
+static char* arena_strndup(flag_arena* arena, const char* str, size_t max_len) {
+  size_t len = strnlen(str, max_len);
+  STATS_ADD(strdups, 1);
+  STATS_ADD(strdup_bytes, len + 1);
+  char* copy = (char*)arena_alloc(arena, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
 }
 
-void validate_integer(flag* flags, const char** argv, int i, int j) {
-  if (!is_valid_integer(argv[i])) {
-    fprintf(stderr, "Error: Invalid integer value for flag %s\n", flags[j].name);
-    exit(EXIT_FAILURE);
+static void arena_free(flag_arena* arena) {
+  flag_arena_block* block = arena->head;
+  while (block != NULL) {
+    flag_arena_block* prev = block->prev;
+    flag_free(block);
+    block = prev;
   }
+  arena->head = NULL;
 }
 
-// Function to find a command by name
-static subcommand* find_subcommand(subcommand** subcmds, int num_commands, const char* name) {
-  for (int i = 0; i < num_commands; i++) {
-    if (strcmp(subcmds[i]->name, name) == 0) {
-      return subcmds[i];
-    }
+// Empty the arena for reuse. All blocks but the largest (most recent) are released.
+static void arena_reset(flag_arena* arena) {
+  flag_arena_block* head = arena->head;
+  if (head == NULL) {
+    return;
   }
-  return NULL;
+  arena->head = head->prev;
+  arena_free(arena);
+  head->prev = NULL;
+  head->used = 0;
+  arena->head = head;
 }
 
-void* FlagValue(flag* flags, int num_flags, const char* name) {
-  for (int i = 0; i < num_flags; i++) {
-    if (strcmp(flags[i].name, name) == 0) {
-      return flags[i].value;
+// (Re)build the index over every flag in set.
+static void index_build(flag_set* set) {
+  flag_index* index = &set->index;
+
+  // Keep the load factor at or below 1/2 so probe sequences stay short.
+  unsigned bits = 3;
+  while (((size_t)1 << bits) < set->count * 2) {
+    bits++;
+  }
+  size_t size = (size_t)1 << bits;
+
+  if (index->slots == NULL || index->bits != bits) {
+    index->slots = (uint16_t*)arena_alloc(set->arena, size * sizeof(uint16_t));
+    index->mask = size - 1;
+    index->bits = bits;
+  }
+
+  memset(index->slots, 0, size * sizeof(uint16_t));
+  for (size_t i = 0; i < set->count; i++) {
+    size_t slot = FLAG_HASH_SLOT(set->list[i]->hash, FLAG_SCHEMA_SEED, bits);
+    while (index->slots[slot] != 0) {
+      slot = (slot + 1) & index->mask;
     }
+    index->slots[slot] = (uint16_t)(i + 1);
   }
-  return NULL;
+  index->count = set->count;
 }
 
-void* FlagValueCtx(flag_ctx* ctx, const char* name) {
-  for (size_t i = 0; i < ctx->num_flags; i++) {
-    if (strcmp(ctx->flags[i].name, name) == 0) {
-      return ctx->flags[i].value;
+// Position of the flag called name in set, or -1 if there is none. The index must be up
+// to date; this never writes to set, so frozen sets can be searched from any thread.
+static long index_lookup(const flag_set* set, const char* name) {
+  const flag_index* index = &set->index;
+  if (set->count == 0) {
+    return -1;
+  }
+
+  STATS_ADD(lookups, 1);
+  size_t len;
+  uint32_t hash = flag_hash(name, &len);
+  size_t slot = FLAG_HASH_SLOT(hash, FLAG_SCHEMA_SEED, index->bits);
+  while (index->slots[slot] != 0) {
+    long pos = index->slots[slot] - 1;
+    if (flag_matches(set->list[pos], hash, len, name)) {
+      return pos;
+    }
+    if (index->perfect) {
+      break;
     }
+    slot = (slot + 1) & index->mask;
   }
-  return NULL;
+  return -1;
 }
 
-// Invoke the subcommand callback.
-void InvokeSubCmd(subcommand* subcmd, flag_ctx* ctx) {
-  f_assert(subcmd != NULL, "subcommand can not be NULL");
-
-  // Once we are done. We call the subcommand callback.
-  FlagArgs args = {
-    .flags = subcmd->flags,
-    .num_flags = subcmd->num_flags,
-    .ctx = ctx,
-  };
-  subcmd->callback(args);
+// Bring the index of set up to date with its flags.
+static void set_index(flag_set* set) {
+  if (set->count > 0 && set->index.count != set->count) {
+    index_build(set);
+  }
 }
 
-static void parse_subcommand_flag(flag* flag, char* arg) {
-  errno = 0;  // Reset errno before conversion.
+// Position of the flag called name in set, or -1 if there is none. Rebuilds a stale index.
+static long set_lookup(flag_set* set, const char* name) {
+  set_index(set);
+  return index_lookup(set, name);
+}
 
-  switch (flag->type) {
-    case FLAG_BOOL: {
-      // If no value is specified, consider it as true
-      if ((strcasecmp(arg, "true") == 0)) {
-        *((bool*)flag->value) = true;
-      } else if (strcasecmp(arg, "false") == 0) {
-        *((bool*)flag->value) = false;
-      } else {
-        // assume it is a flag
-        *((bool*)flag->value) = true;
-      }
-    } break;
-    case FLAG_INT: {
-      long long_value = strtol(arg, NULL, 10);
-      if (errno == ERANGE) {
-        flag_fatalf("Error: Integer overflow for flag %s\n", flag->name);
-      }
+// Find a flag by name through the index. Returns NULL if no flag matches.
+static flag* set_find(flag_set* set, const char* name) {
+  long pos = set_lookup(set, name);
+  return pos < 0 ? NULL : set->list[pos];
+}
 
-      *((int*)flag->value) = (int)long_value;
-    } break;
-    case FLAG_SIZE_T: {
-      unsigned long long_size_t_value = strtoul(arg, NULL, 10);
-      if (errno == ERANGE) {
-        flag_fatalf("Error: Size_t overflow for flag %s\n", flag->name);
-      }
-      *((size_t*)flag->value) = (size_t)long_size_t_value;
-    } break;
-    case FLAG_INT8: {
-      intmax_t int_value = strtoimax(arg, NULL, 10);
-      if (errno == ERANGE || int_value < INT8_MIN || int_value > INT8_MAX) {
-        flag_fatalf("Error: Int8 overflow or underflow for flag %s\n", flag->name);
-      }
-      *((int8_t*)flag->value) = (int8_t)int_value;
-    } break;
-    case FLAG_INT16: {
-      intmax_t int_value = strtoimax(arg, NULL, 10);
-      if (errno == ERANGE || int_value < INT16_MIN || int_value > INT16_MAX) {
-        flag_fatalf("Error: Int16 overflow or underflow for flag %s\n", flag->name);
-      }
-      *((int16_t*)flag->value) = (int16_t)int_value;
-    } break;
-    case FLAG_INT32: {
-      intmax_t int_value = strtoimax(arg, NULL, 10);
-      if (errno == ERANGE || int_value < INT32_MIN || int_value > INT32_MAX) {
-        flag_fatalf("Error: Int32 overflow or underflow for flag %s\n", flag->name);
-      }
-      *((int32_t*)flag->value) = (int32_t)int_value;
-    } break;
-    case FLAG_INT64: {
-      intmax_t int_value = strtoimax(arg, NULL, 10);
-      if (errno == ERANGE || int_value < INT64_MIN || int_value > INT64_MAX) {
-        flag_fatalf("Error: Int64 overflow or underflow for flag %s\n", flag->name);
-      }
-      *((int64_t*)flag->value) = (int64_t)int_value;
-    } break;
-    case FLAG_UINT8: {
-      uintmax_t uint_value = strtoumax(arg, NULL, 10);
-      if (errno == ERANGE || uint_value > UINT8_MAX) {
-        flag_fatalf("Error: Uint8 overflow for flag %s\n", flag->name);
-      }
-      *((uint8_t*)flag->value) = (uint8_t)uint_value;
-    } break;
-    case FLAG_UINT16: {
-      uintmax_t uint_value = strtoumax(arg, NULL, 10);
-      if (errno == ERANGE || uint_value > UINT16_MAX) {
-        flag_fatalf("Error: Uint16 overflow for flag %s\n", flag->name);
-      }
-      *((uint16_t*)flag->value) = (uint16_t)uint_value;
-    } break;
-    case FLAG_UINT32: {
-      uintmax_t uint_value = strtoumax(arg, NULL, 10);
-      if (errno == ERANGE || uint_value > UINT32_MAX) {
-        flag_fatalf("Error: Uint32 overflow for flag %s\n", flag->name);
-      }
-      *((uint32_t*)flag->value) = (uint32_t)uint_value;
-    } break;
-    case FLAG_UINT: {
-      uintmax_t uint_value = strtoumax(arg, NULL, 10);
-      if (errno == ERANGE || uint_value > UINT_MAX) {
-        flag_fatalf("Error: Uint overflow for flag %s\n", flag->name);
-      }
-      *((unsigned int*)flag->value) = (unsigned int)uint_value;
-    } break;
-    case FLAG_UINT64: {
-      uintmax_t uint_value = strtoumax(arg, NULL, 10);
-      if (errno == ERANGE || uint_value > UINT64_MAX) {
-        flag_fatalf("Error: Uint64 overflow for flag %s\n", flag->name);
-      }
-      *((uint64_t*)flag->value) = (uint64_t)uint_value;
-    } break;
-    case FLAG_UINTPTR: {
-      uintmax_t uint_value = strtoumax(arg, NULL, 10);
-      if (errno == ERANGE || uint_value > UINTPTR_MAX) {
-        flag_fatalf("Error: Uint64 overflow for flag %s\n", flag->name);
-      }
-      *((uintptr_t*)flag->value) = (uintptr_t)uint_value;
-    } break;
-    case FLAG_FLOAT: {
-      float float_value = strtof(arg, NULL);
-      if (errno == ERANGE) {
-        flag_fatalf("Error: float overflow for flag %s\n", flag->name);
-      }
-      *((float*)flag->value) = float_value;
-    } break;
-    case FLAG_DOUBLE: {
-      double double_value = strtod(arg, NULL);
-      if (errno == ERANGE) {
-        flag_fatalf("Error: double overflow for flag %s\n", flag->name);
-      }
-      *((double*)flag->value) = double_value;
-    } break;
-    case FLAG_STRING: {
-      *((char**)flag->value) = strdup(arg);
-    } break;
+// Allocate a bitset for capacity flags from arena, holding the bits of the first
+// old_capacity flags of old and zeros after them.
+static uint64_t* bits_alloc(flag_arena* arena, size_t capacity, const uint64_t* old,
+                            size_t old_capacity) {
+  uint64_t* bits = (uint64_t*)arena_alloc(arena, FLAG_WORDS(capacity) * sizeof(uint64_t));
+  memset(bits, 0, FLAG_WORDS(capacity) * sizeof(uint64_t));
+  if (old_capacity > 0) {
+    memcpy(bits, old, FLAG_WORDS(old_capacity) * sizeof(uint64_t));
   }
+  return bits;
 }
 
-static void parse_flag_helper(flag* flags, int num_flags, int* iptr, int argc, char** argv) {
-  int i = *iptr;
-  // Handle both single-dash and double-dash flag notation
-  const char* flag_name = (argv[i][1] == '-') ? &argv[i][2] : &argv[i][1];
-
-  for (int j = 0; j < num_flags; j++) {
-    if (strcmp(flag_name, flags[j].name) == 0) {
-      i++;
-      errno = 0;  // Reset errno before calling atoi/atoll/atof/strtod etc.
-      switch (flags[j].type) {
-        case FLAG_BOOL: {
-          // If no value is specified, consider it as true
-          if (i >= argc || (strcasecmp(argv[i], "true") == 0)) {
-            *((bool*)flags[j].value) = true;
-          } else if (strcasecmp(argv[i], "false") == 0) {
-            *((bool*)flags[j].value) = false;
-          } else {
-            flag_fatalf("Error: Invalid boolean value for flag %s\n", flags[j].name);
-          }
-        } break;
-        case FLAG_INT: {
-          validate_integer(flags, (const char**)argv, i, j);
-          long long_value = strtol(argv[i], NULL, 10);
-          if (errno == ERANGE) {
-            flag_fatalf("Error: Integer overflow for flag %s\n", flags[j].name);
-          }
-
-          *((int*)flags[j].value) = (int)long_value;
-        } break;
-        case FLAG_SIZE_T: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          unsigned long long_size_t_value = strtoul(argv[i], NULL, 10);
-          if (errno == ERANGE) {
-            flag_fatalf("Error: Size_t overflow for flag %s\n", flags[j].name);
-          }
-          *((size_t*)flags[j].value) = (size_t)long_size_t_value;
-        } break;
-        case FLAG_INT8: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          intmax_t int_value = strtoimax(argv[i], NULL, 10);
-          if (errno == ERANGE || int_value < INT8_MIN || int_value > INT8_MAX) {
-            flag_fatalf("Error: Int8 overflow or underflow for flag %s\n", flags[j].name);
-          }
-          *((int8_t*)flags[j].value) = (int8_t)int_value;
-        } break;
-        case FLAG_INT16: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          intmax_t int_value = strtoimax(argv[i], NULL, 10);
-          if (errno == ERANGE || int_value < INT16_MIN || int_value > INT16_MAX) {
-            flag_fatalf("Error: Int16 overflow or underflow for flag %s\n", flags[j].name);
-          }
-          *((int16_t*)flags[j].value) = (int16_t)int_value;
-        } break;
-        case FLAG_INT32: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          intmax_t int_value = strtoimax(argv[i], NULL, 10);
-          if (errno == ERANGE || int_value < INT32_MIN || int_value > INT32_MAX) {
-            flag_fatalf("Error: Int32 overflow or underflow for flag %s\n", flags[j].name);
-          }
-          *((int32_t*)flags[j].value) = (int32_t)int_value;
-        } break;
-        case FLAG_INT64: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          intmax_t int_value = strtoimax(argv[i], NULL, 10);
-          if (errno == ERANGE || int_value < INT64_MIN || int_value > INT64_MAX) {
-            flag_fatalf("Error: Int64 overflow or underflow for flag %s\n", flags[j].name);
-          }
-          *((int64_t*)flags[j].value) = (int64_t)int_value;
-        } break;
-        case FLAG_UINT8: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          uintmax_t uint_value = strtoumax(argv[i], NULL, 10);
-          if (errno == ERANGE || uint_value > UINT8_MAX) {
-            flag_fatalf("Error: Uint8 overflow for flag %s\n", flags[j].name);
-          }
-          *((uint8_t*)flags[j].value) = (uint8_t)uint_value;
-        } break;
-        case FLAG_UINT16: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          uintmax_t uint_value = strtoumax(argv[i], NULL, 10);
-          if (errno == ERANGE || uint_value > UINT16_MAX) {
-            flag_fatalf("Error: Uint16 overflow for flag %s\n", flags[j].name);
-          }
-          *((uint16_t*)flags[j].value) = (uint16_t)uint_value;
-        } break;
-        case FLAG_UINT32: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          uintmax_t uint_value = strtoumax(argv[i], NULL, 10);
-          if (errno == ERANGE || uint_value > UINT32_MAX) {
-            flag_fatalf("Error: Uint32 overflow for flag %s\n", flags[j].name);
-          }
-          *((uint32_t*)flags[j].value) = (uint32_t)uint_value;
-        } break;
-        case FLAG_UINT: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          uintmax_t uint_value = strtoumax(argv[i], NULL, 10);
-          if (errno == ERANGE || uint_value > UINT_MAX) {
-            flag_fatalf("Error: Uint overflow for flag %s\n", flags[j].name);
-          }
-          *((unsigned int*)flags[j].value) = (unsigned int)uint_value;
-        } break;
-        case FLAG_UINT64: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          uintmax_t uint_value = strtoumax(argv[i], NULL, 10);
-          if (errno == ERANGE || uint_value > UINT64_MAX) {
-            flag_fatalf("Error: Uint64 overflow for flag %s\n", flags[j].name);
-          }
-          *((uint64_t*)flags[j].value) = (uint64_t)uint_value;
-        } break;
-        case FLAG_UINTPTR: {
-          validate_integer(flags, (const char**)argv, i, j);
-
-          uintmax_t uint_value = strtoumax(argv[i], NULL, 10);
-          if (errno == ERANGE || uint_value > UINTPTR_MAX) {
-            flag_fatalf("Error: uintptr_t overflow for flag %s\n", flags[j].name);
-          }
-          *((uintptr_t*)flags[j].value) = (uintptr_t)uint_value;
-        } break;
-        case FLAG_FLOAT: {
-          float float_value = strtof(argv[i], NULL);
-          if (errno == ERANGE) {
-            flag_fatalf("Error: float overflow for flag %s\n", flags[j].name);
-          }
-          *((float*)flags[j].value) = float_value;
-        } break;
-        case FLAG_DOUBLE: {
-          double double_value = strtod(argv[i], NULL);
-          if (errno == ERANGE) {
-            flag_fatalf("Error: double overflow for flag %s\n", flags[j].name);
-          }
-          *((double*)flags[j].value) = double_value;
-        } break;
-        case FLAG_STRING: {
-          *((char**)flags[j].value) = strdup(argv[i]);
-        } break;
-      }
-
-      // If a validator is specified, call it
-      if (flags[j].flag_validator.validator != NULL) {
-        if (!flags[j].flag_validator.validator(flags[j].value)) {
-          if (flags[j].flag_validator.error_message != NULL) {
-            fprintf(stderr, "Error: %s\n", flags[j].flag_validator.error_message);
-          } else {
-            fprintf(stderr, "Error: Invalid value for flag %s\n", flags[j].name);
-          }
-          exit(EXIT_FAILURE);
-        }
+static void set_init(flag_set* set, flag_arena* arena, size_t capacity) {
+  *set = (flag_set){.arena = arena};
+  set->capacity = capacity > 0 ? capacity : FLAG_SET_MIN_CAPACITY;
+  set->list = (flag**)arena_alloc(arena, set->capacity * sizeof(flag*));
+  set->info = (flag_info*)arena_alloc(arena, set->capacity * sizeof(flag_info));
+  set->run = (flag*)arena_alloc(arena, set->capacity * sizeof(flag));
+  set->required = bits_alloc(arena, set->capacity, NULL, 0);
+  set->configured = bits_alloc(arena, set->capacity, NULL, 0);
+  set->given = bits_alloc(arena, set->capacity, NULL, 0);
+}
+
+// Double the capacity of set. Existing records stay where they are.
+static void set_grow(flag_set* set) {
+  size_t capacity = set->capacity * 2;
+
+  flag** list = (flag**)arena_alloc(set->arena, capacity * sizeof(flag*));
+  flag_info* info = (flag_info*)arena_alloc(set->arena, capacity * sizeof(flag_info));
+  memcpy(list, set->list, set->count * sizeof(flag*));
+  memcpy(info, set->info, set->count * sizeof(flag_info));
+
+  set->run = (flag*)arena_alloc(set->arena, (capacity - set->capacity) * sizeof(flag));
+  set->run_start = set->capacity;
+  set->list = list;
+  set->info = info;
+  set->required = bits_alloc(set->arena, capacity, set->required, set->capacity);
+  set->configured = bits_alloc(set->arena, capacity, set->configured, set->capacity);
+  set->given = bits_alloc(set->arena, capacity, set->given, set->capacity);
+  set->capacity = capacity;
+}
+
+// Add the characters of a class escape (\d, \w, \s and their negations), or the escaped
+// character itself, to the 256-bit set cls.
+static void pattern_escape(char c, uint64_t cls[4]) {
+  uint64_t set[4] = {0};
+  char lower = (char)(c | 0x20);
+  if (lower == 'd' || lower == 'w' || lower == 's') {
+    for (unsigned ch = 0; ch < 256; ch++) {
+      bool in = lower == 'd'   ? isdigit((int)ch)
+                : lower == 'w' ? isalnum((int)ch) || ch == '_'
+                               : isspace((int)ch);
+      if (in != (c != lower)) {
+        set[ch / 64] |= (uint64_t)1 << (ch % 64);
       }
     }
+  } else {
+    set[(unsigned char)c / 64] |= (uint64_t)1 << ((unsigned char)c % 64);
+  }
+  for (int i = 0; i < 4; i++) {
+    cls[i] |= set[i];
   }
 }
 
-// Parse command line arguments and set flag values
-subcommand* ParseFlags(flag_ctx* ctx, int argc, char* argv[]) {
-  if (argc < 2) {
-    return NULL;  // no subcommands or arguments
+// Read the class or character at *p into cls and advance *p past it. Returns an error, or NULL.
+static const char* pattern_atom(const char** p, uint64_t cls[4]) {
+  const char* s = *p;
+  memset(cls, 0, 4 * sizeof(uint64_t));
+  if (*s == '.') {
+    memset(cls, 0xFF, 4 * sizeof(uint64_t));
+    *p = s + 1;
+    return NULL;
+  }
+  if (*s == '\\') {
+    if (s[1] == '\0') {
+      return "trailing backslash";
+    }
+    pattern_escape(s[1], cls);
+    *p = s + 2;
+    return NULL;
+  }
+  if (strchr("()|", *s) != NULL) {
+    return "groups and alternation are not supported";
+  }
+  if (strchr("*+?{", *s) != NULL) {
+    return "nothing to repeat";
+  }
+  if (*s != '[') {
+    pattern_escape(*s, cls);
+    *p = s + 1;
+    return NULL;
   }
 
-  // Loop over all arguments in 2 passes.
-  // first pass  -> global flags.
-  // second pass -> subcommands.
-  int subcmdIndex = -1;
-  subcommand* subcmd = NULL;
-
-  for (int i = 1; i < argc; i++) {
-    if (argv[i][0] == '-') {
-      const char* flag_name = (argv[i][1] == '-') ? &argv[i][2] : &argv[i][1];
-
-      // handle help request.
-      if (strcmp(flag_name, "help") == 0) {
-        PrintHelp(ctx, argv);
-        DestroyFlagContext(ctx);
-        exit(EXIT_SUCCESS);
+  // [abc], [a-z0-9_], [^...]. A ] right after the opening bracket is a member.
+  s++;
+  bool negate = *s == '^';
+  s += negate;
+  for (const char* first = s; *s != ']' || s == first; s++) {
+    if (*s == '\0') {
+      return "missing ]";
+    }
+    if (*s == '\\' && s[1] != '\0') {
+      pattern_escape(*++s, cls);
+      continue;
+    }
+    unsigned lo = (unsigned char)*s;
+    unsigned hi = lo;
+    if (s[1] == '-' && s[2] != ']' && s[2] != '\0') {
+      hi = (unsigned char)s[2];
+      s += 2;
+      if (hi < lo) {
+        return "bad range in []";
       }
+    }
+    for (unsigned ch = lo; ch <= hi; ch++) {
+      cls[ch / 64] |= (uint64_t)1 << (ch % 64);
+    }
+  }
+  if (negate) {
+    for (int i = 0; i < 4; i++) {
+      cls[i] = ~cls[i];
+    }
+  }
+  *p = s + 1;
+  return NULL;
+}
 
-      parse_flag_helper(ctx->flags, ctx->num_flags, &i, argc, argv);
-    } else {
-      // if we have no subcommands, continue to next argument.
-      if (ctx->num_subcommands == 0) {
-        continue;
+// Read an optional quantifier at *p: ?, *, +, {m}, {m,} or {m,n}. An unbounded maximum
+// is stored as -1. Returns an error, or NULL.
+static const char* pattern_quantifier(const char** p, int* min, int* max) {
+  const char* s = *p;
+  *min = *max = 1;
+  switch (*s) {
+    case '?':
+      *min = 0;
+      break;
+    case '*':
+      *min = 0;
+      *max = -1;
+      break;
+    case '+':
+      *max = -1;
+      break;
+    case '{': {
+      char* end;
+      *min = (int)strtol(s + 1, &end, 10);
+      *max = *min;
+      if (end == s + 1 || *min > FLAG_PATTERN_MAX) {
+        return "bad repetition";
       }
-
-      // Find subcommand matching current argument.
-      subcmd = find_subcommand(ctx->subcommands, ctx->num_subcommands, &argv[i][0]);
-      if (subcmd) {
-        subcmdIndex = i;
-        break;  // stop processing global flags.
+      if (*end == ',') {
+        const char* digits = end + 1;
+        *max = digits[0] == '}' ? -1 : (int)strtol(digits, &end, 10);
+        if (*max != -1 && (end == digits || *max < *min || *max > FLAG_PATTERN_MAX)) {
+          return "bad repetition";
+        }
+        end += *max == -1;
+      }
+      if (*end != '}') {
+        return "bad repetition";
       }
+      s = end;
+      break;
     }
+    default:
+      return NULL;
   }
+  *p = s + 1;
+  return NULL;
+}
 
-  // Handle subcommand if it was found.
-  if (!subcmd) {
-    return NULL;
-  }
+// Compile src into pattern. The syntax is a subset of regular expressions without groups
+// or alternation: characters, ., [classes], \d \w \s and their negations, other escaped
+// characters, and the quantifiers ? * + {m} {m,} {m,n}. The pattern must match the whole
+// value, so ^ at the start and $ at the end are accepted and ignored. Returns an error,
+// or NULL.
+static const char* pattern_compile(const char* src, flag_pattern* pattern) {
+  enum { ONCE, OPTIONAL, STAR } kinds[FLAG_PATTERN_MAX];
+  size_t n = 0;
+  *pattern = (flag_pattern){0};
 
-  // Create an array of processed flags. So we can validate required flags
-  flag proccessed_flags[subcmd->num_flags];
-  // zero the array of flag structs
-  memset(proccessed_flags, 0, sizeof(flag) * subcmd->num_flags);
+  const char* p = src + (*src == '^');
+  size_t len = strlen(p);
+  const char* end = p + len;
+  if (len > 0 && end[-1] == '$' && (len == 1 || end[-2] != '\\')) {
+    end--;
+  }
 
-  ++subcmdIndex;  // start after subcommand and continue up to argc
-  while (subcmdIndex < argc) {
-    char* arg = argv[subcmdIndex][0] == '-' ? &argv[subcmdIndex][1] : &argv[subcmdIndex][0];
-    flag* flag = NULL;
+  while (p < end) {
+    uint64_t cls[4];
+    int min, max;
+    const char* error = pattern_atom(&p, cls);
+    if (error == NULL) {
+      error = pattern_quantifier(&p, &min, &max);
+    }
+    if (error != NULL) {
+      return error;
+    }
 
-    // find flag index matching next flag.
-    for (int j = 0; j < subcmd->num_flags; j++) {
-      if (strcmp(subcmd->flags[j].name, arg) == 0) {
-        flag = &subcmd->flags[j];
-        proccessed_flags[j] = *flag;
-        break;
+    // x{m,n} becomes m nodes matching x once, then n - m optional ones, or one that
+    // repeats when n is unbounded.
+    size_t count = (size_t)min + (max < 0 ? 1 : (size_t)(max - min));
+    if (n + count > FLAG_PATTERN_MAX) {
+      return "too long";
+    }
+    for (size_t i = 0; i < count; i++, n++) {
+      kinds[n] = (int)i < min ? ONCE : max < 0 ? STAR : OPTIONAL;
+      for (unsigned ch = 0; ch < 256; ch++) {
+        if ((cls[ch / 64] >> (ch % 64)) & 1) {
+          pattern->chars[ch] |= (uint64_t)1 << n;
+        }
       }
     }
+  }
 
-    ++subcmdIndex;  // increment i to process next argument(value).
-
-    if (flag != NULL) {
-      if (arg == NULL) {
-        fprintf(stderr, "Error: No value specified for flag %s\n", flag->name);
-        PrintHelp(ctx, argv);
-        DestroyFlagContext(ctx);
-        exit(EXIT_SUCCESS);
-      }
+  // closure is node i with every node after it that may match nothing.
+  uint64_t closure = (uint64_t)1 << n;
+  pattern->accept = closure;
+  for (size_t i = n; i-- > 0;) {
+    uint64_t after = closure;
+    closure = ((uint64_t)1 << i) | (kinds[i] == ONCE ? 0 : after);
+    pattern->next[i] = kinds[i] == STAR ? closure : after;
+  }
+  pattern->start = closure;
+  return NULL;
+}
 
-      parse_subcommand_flag(flag, argv[subcmdIndex]);
-    }
+// Build the set of the NULL-terminated choices in arena.
+static const flag_choices* choices_build(flag_arena* arena, const char* const* choices) {
+  size_t count = 0;
+  while (choices[count] != NULL) {
+    count++;
   }
 
-  // Post processing validation
-  for (int i = 0; i < subcmd->num_flags; i++) {
-    flag procFlag = proccessed_flags[i];
-    flag actualFlag = subcmd->flags[i];
+  size_t slots = 8;
+  while (slots < count * 2) {
+    slots *= 2;
+  }
+  flag_choices* set = (flag_choices*)arena_alloc(arena, sizeof(flag_choices));
+  *set = (flag_choices){
+    .slots = (const char**)arena_alloc(arena, slots * sizeof(char*)),
+    .hashes = (uint32_t*)arena_alloc(arena, slots * sizeof(uint32_t)),
+    .mask = slots - 1,
+  };
+  memset(set->slots, 0, slots * sizeof(char*));
 
-    if (actualFlag.required && procFlag.value == NULL) {
-      fprintf(stderr, "\n[ERROR]: Flag %s is required\n\n", actualFlag.name);
-      PrintHelp(ctx, argv);
-      DestroyFlagContext(ctx);
-      exit(EXIT_FAILURE);
+  for (size_t i = 0; i < count; i++) {
+    size_t len;
+    uint32_t hash = flag_hash(choices[i], &len);
+    size_t slot = hash & set->mask;
+    while (set->slots[slot] != NULL && strcmp(set->slots[slot], choices[i]) != 0) {
+      slot = (slot + 1) & set->mask;
     }
+    set->slots[slot] = arena_strndup(arena, choices[i], len);
+    set->hashes[slot] = hash;
   }
+  return set;
+}
 
-  return subcmd;
+// Format fmt with one string argument into a string allocated from arena.
+static const char* arena_sprintf(flag_arena* arena, const char* fmt, const char* arg) {
+  int len = snprintf(NULL, 0, fmt, arg);
+  char* s = (char*)arena_alloc(arena, (size_t)len + 1);
+  snprintf(s, (size_t)len + 1, fmt, arg);
+  return s;
 }
 
-static int maxNameLength(flag* flags, int n) {
-  int max = 0;
-  for (int i = 0; i < n; i++) {
-    int len = strlen(flags[i].name);
-    if (len > max) {
-      max = len;
-    }
+// Checks of f, allocated from the arena of set on first use.
+static flag_checks* flag_checks_of(flag_set* set, flag* f) {
+  if (f->checks == NULL) {
+    f->checks = (flag_checks*)arena_alloc(set->arena, sizeof(flag_checks));
+    *f->checks = (flag_checks){0};
   }
-  return max;
+  return f->checks;
 }
 
-static int maxTypeLength(flag* flags, int n) {
-  int max = 0;
-  for (int i = 0; i < n; i++) {
-    int len = strlen(flagAsString(flags[i].type));
-    if (len > max) {
-      max = len;
-    }
+// Magnitude of x as an integer, rounded up or down and at most limit.
+static uintmax_t bound_magnitude(double x, uintmax_t limit, bool up) {
+  double magnitude = x < 0 ? -x : x;
+  if (magnitude >= (double)limit) {
+    return limit;
   }
-  return max;
+  uintmax_t m = (uintmax_t)magnitude;
+  return m + (up && (double)m < magnitude);
 }
 
-// Print help message for available flags
-void PrintHelp(flag_ctx* ctx, char** argv) {
-  int max_name_len_global = maxNameLength(ctx->flags, ctx->num_flags);
+// Turn the .range of f into the bounds checked while converting it.
+static void set_add_range(flag_set* set, flag* f, const flag_range* range) {
+  bool integer = f->type == FLAG_INT_LIST || (f->type >= FLAG_INT && f->type <= FLAG_UINTPTR);
+  bool real = f->type == FLAG_FLOAT || f->type == FLAG_DOUBLE || f->type == FLAG_DOUBLE_LIST;
+  f_assert(integer || real, "[ERROR]: Only number flags take a range: %s\n", f->name);
+  f_assert(range->min <= range->max, "[ERROR]: Empty range for flag: %s\n", f->name);
 
-  // Print help message for available flags with aligned text
-  printf("%s\n", argv[0]);
-  printf("Global flags:\n");
-  for (size_t i = 0; i < ctx->num_flags; i++) {
-    printf("  -%-*s --%s(%s) <%s>: %s\n\n", max_name_len_global, ctx->flags[i].name,
-           ctx->flags[i].name, ctx->flags[i].required ? "Required" : "Optional",
-           flagAsString(ctx->flags[i].type), ctx->flags[i].description);
+  char reason[96];
+  snprintf(reason, sizeof(reason), "must be between %.15g and %.15g", range->min, range->max);
+  flag_checks* c = flag_checks_of(set, f);
+  c->ranged = true;
+  c->min = range->min;
+  c->max = range->max;
+  c->range_reason = arena_strndup(set->arena, reason, strlen(reason));
+  if (!integer) {
+    return;
   }
 
+  // Both bounds must lie within the type, and round inwards to integers.
+  const flag_int_range* type = &int_ranges[f->type == FLAG_INT_LIST ? FLAG_INT : f->type];
+  f_assert(range->min >= (type->is_signed ? -(double)type->min : 0) &&
+             range->max <= (double)type->max,
+           "[ERROR]: Range of flag %s does not fit its type\n", f->name);
+  c->ints = *type;
+  c->ints.reason = c->range_reason;
+  c->ints.min_negative = range->min < 0;
+  c->ints.min = bound_magnitude(range->min, c->ints.min_negative ? type->min : type->max,
+                                !c->ints.min_negative);
+  c->ints.min_negative &= c->ints.min > 0;
+  c->ints.max_negative = range->max < 0;
+  c->ints.max = bound_magnitude(range->max, c->ints.max_negative ? type->min : type->max,
+                                c->ints.max_negative);
+
+  bool empty = c->ints.min_negative ? c->ints.max_negative && c->ints.min < c->ints.max
+                                    : c->ints.max_negative || c->ints.min > c->ints.max;
+  f_assert(!empty, "[ERROR]: Range of flag %s holds no integer\n", f->name);
+}
 
-  int max_name_len_subcmd = 0;
-  int max_type_len_subcmd = 0;
+// Compile the declarative checks of params for f, just added to set.
+static void set_add_checks(flag_set* set, flag* f, const flag_params* params) {
+  if (params->range != NULL) {
+    set_add_range(set, f, params->range);
+  }
+  if (params->choices == NULL && params->pattern == NULL) {
+    return;
+  }
 
-  for (size_t i = 0; i < ctx->num_subcommands; i++) {
-    int name_len = maxNameLength(ctx->subcommands[i]->flags, ctx->subcommands[i]->num_flags);
-    int type_len = maxTypeLength(ctx->subcommands[i]->flags, ctx->subcommands[i]->num_flags);
+  f_assert(f->type == FLAG_STRING || f->type == FLAG_STRING_LIST,
+           "[ERROR]: Only string flags take choices or a pattern: %s\n", f->name);
+  flag_checks* c = flag_checks_of(set, f);
+  if (params->choices != NULL) {
+    f_assert(params->choices[0] != NULL, "[ERROR]: No choices for flag: %s\n", f->name);
+    c->choices = choices_build(set->arena, params->choices);
 
-    if (name_len > max_name_len_subcmd) {
-      max_name_len_subcmd = name_len;
+    // "must be one of a, b, c"
+    size_t len = strlen("must be one of ");
+    for (size_t i = 0; params->choices[i] != NULL; i++) {
+      len += strlen(", ") + strlen(params->choices[i]);
     }
-
-    if (type_len > max_type_len_subcmd) {
-      max_type_len_subcmd = type_len;
+    char* reason = (char*)arena_alloc(set->arena, len + 1);
+    int n = snprintf(reason, len + 1, "must be one of ");
+    for (size_t i = 0; params->choices[i] != NULL; i++) {
+      n += snprintf(reason + n, len + 1 - (size_t)n, "%s%s", i > 0 ? ", " : "",
+                    params->choices[i]);
     }
+    c->choices_reason = reason;
+  }
+  if (params->pattern != NULL) {
+    flag_pattern* pattern = (flag_pattern*)arena_alloc(set->arena, sizeof(flag_pattern));
+    const char* error = pattern_compile(params->pattern, pattern);
+    f_assert(error == NULL, "[ERROR]: Invalid pattern for flag %s: %s\n", f->name, error);
+    c->pattern = pattern;
+    c->pattern_reason = arena_sprintf(set->arena, "does not match %s", params->pattern);
   }
+}
 
-  // print subcommands and their flags
-  printf("Subcommands:\n");
-  for (size_t i = 0; i < ctx->num_subcommands; i++) {
-    printf("  %s: %s\n", ctx->subcommands[i]->name, ctx->subcommands[i]->description);
+static void set_add_validator(flag_set* set, flag* f, validator val, const char* err_msg) {
+  f_assert(!set->frozen, "[ERROR]: Flag context is frozen. Cannot add a validator\n");
+  f_assert(val != NULL, "[ERROR]: NULL validator for flag: %s\n", f->name);
+  size_t pos = 0;
+  while (pos < set->count && set->list[pos] != f) {
+    pos++;
+  }
+  f_assert(pos < set->count, "[ERROR]: Flag %s belongs to another set\n", f->name);
 
-    for (int j = 0; j < ctx->subcommands[i]->num_flags; j++) {
-      printf("    -%-*s --%s(%s) <%s>: %s\n", max_name_len_subcmd,
-             ctx->subcommands[i]->flags[j].name, ctx->subcommands[i]->flags[j].name,
-             ctx->subcommands[i]->flags[j].required ? "Required" : "Optional",
-             flagAsString(ctx->subcommands[i]->flags[j].type),
-             ctx->subcommands[i]->flags[j].description);
+  flag_checks* c = flag_checks_of(set, f);
+  if (c->num_validators == c->validator_capacity) {
+    size_t capacity = c->validator_capacity > 0 ? c->validator_capacity * 2 : 2;
+    flag_validator* list =
+      (flag_validator*)arena_alloc(set->arena, capacity * sizeof(flag_validator));
+    if (c->num_validators > 0) {
+      memcpy(list, c->validators, c->num_validators * sizeof(flag_validator));
     }
-    printf("\n");
+    c->validators = list;
+    c->validator_capacity = capacity;
   }
-  printf("\n");
+  c->validators[c->num_validators++] = (flag_validator){.validator = val, .error_message = err_msg};
 }
 
-// Convert flag type to a string for printing
-const char* flagAsString(flag_type type) {
-  switch (type) {
-    case FLAG_BOOL:
-      return "bool";
-    case FLAG_INT:
-      return "int";
-    case FLAG_SIZE_T:
-      return "size_t";
-    case FLAG_INT8:
-      return "int8_t";
-    case FLAG_INT16:
-      return "int16_t";
-    case FLAG_INT32:
-      return "int32_t";
-    case FLAG_INT64:
-      return "int64_t";
-    case FLAG_UINT:
-      return "unsigned int";
-    case FLAG_UINT8:
-      return "uint8_t";
-    case FLAG_UINT16:
-      return "uint16_t";
-    case FLAG_UINT32:
-      return "uint32_t";
-    case FLAG_UINT64:
-      return "uint64_t";
-    case FLAG_UINTPTR:
-      return "uintptr_t";
-    case FLAG_FLOAT:
-      return "float";
-    case FLAG_DOUBLE:
-      return "double";
-    case FLAG_STRING:
-      return "char *";
-    default:
-      return "unknown";
+// Add a flag described by params to set. Name and description are copied into the arena,
+// truncated to MAX_NAME and MAX_DESCRIPTION.
+static flag* set_add(flag_set* set, const flag_params* params) {
+  f_assert(!set->frozen, "[ERROR]: Flag context is frozen. Cannot add flag: %s\n", params->name);
+  f_assert(flag_type_known(params->type), "[ERROR]: Unknown type for flag: %s\n", params->name);
+  f_assert(!params->copy || params->type == FLAG_STRING || params->type == FLAG_STRING_LIST,
+           "[ERROR]: Only string flags can be copied: %s\n", params->name);
+  f_assert(!params->lazy || (!params->copy && !flag_is_list(params->type) &&
+                             flag_types[params->type].implied_value == NULL),
+           "[ERROR]: Flags that are copied, lists or take an implied value cannot be lazy: %s\n",
+           params->name);
+  f_assert(!params->reload || (!params->lazy && !params->copy && !flag_is_list(params->type) &&
+                               params->type < FLAG_TYPE_CUSTOM &&
+                               flag_atomic_size(flag_types[params->type].size)),
+           "[ERROR]: Lazy, copied, list and custom flags cannot be reloaded: %s\n", params->name);
+
+  // The index cannot tell more flags apart, so this is checked in release builds too.
+  if (set->count == FLAG_SET_MAX_FLAGS) {
+    fprintf(stderr, "[ERROR]: Too many flags, at most %u per context or subcommand: %s\n",
+            (unsigned)FLAG_SET_MAX_FLAGS, params->name);
+    exit(EXIT_FAILURE);
+  }
+  if (set->count == set->capacity) {
+    set_grow(set);
   }
+
+  const char* name = arena_strndup(set->arena, params->name, MAX_NAME - 1);
+  const char* desc = arena_strndup(set->arena, params->desc ? params->desc : "",
+                                   MAX_DESCRIPTION - 1);
+
+  size_t name_len;
+  flag* f = &set->run[set->count - set->run_start];
+  *f = (flag){
+    .hash = flag_hash(name, &name_len),
+    .type = params->type,
+    .copy = params->copy,
+    .lazy = params->lazy,
+    .reload = params->reload,
+    .name = name,
+    .value = params->value,
+  };
+  f->name_len = (uint32_t)name_len;
+
+  set->info[set->count] = (flag_info){
+    .description = desc,
+    .required = params->req,
+    .env = params->env ? arena_strndup(set->arena, params->env, MAX_NAME - 1) : NULL,
+  };
+  if (params->req) {
+    bit_set(set->required, set->count);
+  }
+  set->list[set->count++] = f;
+  set_add_checks(set, f, params);
+  return f;
+}
+
+// Initialize a flag context and add global help flag.
+flag_ctx* CreateFlagContext(void) {
+  flag_ctx* ctx = (flag_ctx*)flag_alloc(sizeof(flag_ctx), _Alignof(flag_ctx));
+  f_assert(ctx != NULL, "[ERROR]: Unable to allocated memory for flag_ctx");
+
+#ifdef FLAG_STATS
+  ctx->stats = (flag_stats){.allocs = 1, .alloc_bytes = sizeof(flag_ctx)};
+#endif
+  STATS_ENTER(&ctx->stats);
+
+#ifndef FLAG_NO_THREADS
+  pthread_once(&c_locale_once, c_locale_init);
+#else
+  if (c_locale == (locale_t)0) {
+    c_locale_init();
+  }
+#endif
+
+  ctx->arena = (flag_arena){0};
+  ctx->values = (flag_arena){0};
+  ctx->positionals = (flag_positionals){0};
+  ctx->mappings = NULL;
+  ctx->responses = NULL;
+  ctx->help = NULL;
+  ctx->help_len = 0;
+  ctx->help_sections = NULL;
+  ctx->help_flags = 0;
+  ctx->defaults_version = 0;
+  ctx->help_version = 0;
+  ctx->completion = false;
+  ctx->cache_path = NULL;
+  ctx->cache_version = 0;
+  ctx->cache_pending = false;
+  ctx->sources_pending = false;
+  ctx->sources = NULL;
+  ctx->watcher = NULL;
+  ctx->reload_strings = NULL;
+  ctx->reload_strings_count = 0;
+  ctx->reload_strings_mask = 0;
+  ctx->children = (flag_subcmds){0};
+  ctx->subcmd_prefixes = false;
+  ctx->subcmd_words = 0;
+  ctx->frozen = false;
+  ctx->result_size = 0;
+  ctx->result_defaults = NULL;
+  ctx->num_subcommands = 0;
+  ctx->subcommand_capacity = MAX_SUBCOMMANDS > 0 ? MAX_SUBCOMMANDS : 1;
+  ctx->subcommands =
+    (subcommand**)arena_alloc(&ctx->arena, ctx->subcommand_capacity * sizeof(subcommand*));
+
+#ifdef FLAG_SCHEMA
+  // Global flags and their index are constants generated from FLAG_SCHEMA_TABLE.
+  // The records are never written to, only the variables they point at.
+  ctx->flags = (flag_set){
+    .list = (flag**)flag_schema_list,
+    .info = (flag_info*)flag_schema_info,
+    .count = FLAG_SCHEMA_COUNT,
+    .capacity = FLAG_SCHEMA_COUNT,
+    .index =
+      {
+        .slots = (uint16_t*)flag_schema_slots,
+        .mask = (1 << FLAG_SCHEMA_INDEX_BITS) - 1,
+        .bits = FLAG_SCHEMA_INDEX_BITS,
+        .perfect = true,
+        .count = FLAG_SCHEMA_COUNT,
+      },
+    .arena = &ctx->arena,
+    .required = bits_alloc(&ctx->arena, FLAG_SCHEMA_COUNT, NULL, 0),
+    .configured = bits_alloc(&ctx->arena, FLAG_SCHEMA_COUNT, NULL, 0),
+    .given = bits_alloc(&ctx->arena, FLAG_SCHEMA_COUNT, NULL, 0),
+  };
+  for (size_t i = 0; i < FLAG_SCHEMA_COUNT; i++) {
+    if (flag_schema_info[i].required) {
+      bit_set(ctx->flags.required, i);
+    }
+  }
+
+#ifndef NDEBUG
+  // Catch a generated index that no longer matches the table (renamed flags, new seed).
+  for (size_t i = 0; i < FLAG_SCHEMA_COUNT; i++) {
+    f_assert(set_lookup(&ctx->flags, ctx->flags.list[i]->name) == (long)i,
+             "[ERROR]: FLAG_SCHEMA_INDEX is out of date. Re-run flaggen.");
+  }
+#endif
+#else
+  set_init(&ctx->flags, &ctx->arena, MAX_GLOBAL_FLAGS);
+
+  // Add help flag
+  AddFlag(ctx, .name = "help", .desc = "Print help message", .type = FLAG_BOOL);
+#endif
+  STATS_LEAVE();
+  return ctx;
+}
+
+void DestroyFlagContext(flag_ctx* ctx) {
+  if (ctx) {
+    stop_watcher(ctx);
+    unmap_files(&ctx->mappings);
+    flag_free(ctx->reload_strings);
+    unmap_files(&ctx->responses);
+    flag_free(ctx->help);
+    flag_free(ctx->help_sections);
+    arena_free(&ctx->values);
+    arena_free(&ctx->arena);
+    flag_free(ctx);
+    ctx = NULL;
+  }
+}
+
+#ifndef FLAG_SCHEMA
+// Add a flag to the flag context
+flag* _flag_add(flag_ctx* ctx, flag_params* params) {
+  STATS_ENTER(&ctx->stats);
+  STATS_CLOCK(start);
+  flag* f = set_add(&ctx->flags, params);
+  STATS_LAP(register_ns, start);
+  STATS_LEAVE();
+  return f;
+}
+#endif
+
+void SetValidator(flag* flag, bool (*validator)(const void* value), const char* err_msg) {
+  flag->flag_validator = (flag_validator){.validator = validator, .error_message = err_msg};
+}
+
+#ifndef FLAG_SCHEMA
+void AddValidator(flag_ctx* ctx, flag* f, validator val, const char* err_msg) {
+  set_add_validator(&ctx->flags, f, val, err_msg);
+}
+#endif
+
+void AddSubCmdValidator(subcommand* subcmd, flag* f, validator val, const char* err_msg) {
+  set_add_validator(&subcmd->flags, f, val, err_msg);
+}
+
+// Append subcmd to level, doubling the list in arena when it is full.
+static void subcmds_add(flag_subcmds* level, subcommand* subcmd, flag_arena* arena) {
+  if (level->count == level->capacity) {
+    size_t capacity = level->capacity > 0 ? level->capacity * 2 : 4;
+    subcommand** list = (subcommand**)arena_alloc(arena, capacity * sizeof(subcommand*));
+    if (level->count > 0) {
+      memcpy(list, level->list, level->count * sizeof(subcommand*));
+    }
+    level->list = list;
+    level->capacity = capacity;
+  }
+  level->list[level->count++] = subcmd;
+}
+
+// Build the trie over the names of level, unless it is current. Lookups run on const
+// contexts, so this happens before every parse like set_index.
+static void subcmds_index(flag_subcmds* level, flag_arena* arena) {
+  if (level->indexed == level->count) {
+    return;
+  }
+
+  // A name adds at most one node per character.
+  size_t capacity = 1;
+  for (size_t i = 0; i < level->count; i++) {
+    capacity += strlen(level->list[i]->name);
+  }
+  flag_trie_node* trie = (flag_trie_node*)arena_alloc(arena, capacity * sizeof(flag_trie_node));
+  trie[0] = (flag_trie_node){.exact = -1};
+  uint32_t used = 1;
+
+  for (size_t i = 0; i < level->count; i++) {
+    uint32_t node = 0;
+    for (const char* p = level->list[i]->name;; p++) {
+      trie[node].count++;
+      trie[node].last = (uint32_t)i;
+      if (*p == '\0') {
+        break;
+      }
+
+      uint32_t next = trie[node].child;
+      while (next != 0 && trie[next].label != *p) {
+        next = trie[next].sibling;
+      }
+      if (next == 0) {
+        next = used++;
+        trie[next] = (flag_trie_node){.sibling = trie[node].child, .exact = -1, .label = *p};
+        trie[node].child = next;
+      }
+      node = next;
+    }
+
+    // Dispatch used to take the first match, so an earlier duplicate name wins.
+    if (trie[node].exact < 0) {
+      trie[node].exact = (int32_t)i;
+    }
+  }
+
+  level->trie = trie;
+  level->indexed = level->count;
+}
+
+// Index the subcommands of every level of ctx, and size the seen bitsets of parse_tokens.
+static void index_subcommands(flag_ctx* ctx) {
+  subcmds_index(&ctx->children, &ctx->arena);
+  ctx->subcmd_words = 0;
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    subcmds_index(&ctx->subcommands[i]->children, &ctx->arena);
+    size_t words = FLAG_WORDS(ctx->subcommands[i]->flags.count);
+    ctx->subcmd_words = words > ctx->subcmd_words ? words : ctx->subcmd_words;
+  }
+}
+
+// Find the subcommand of level called name, in one step per character of name. With
+// prefixes, a name that starts exactly one subcommand name also selects it.
+static subcommand* find_subcommand(const flag_subcmds* level, const char* name, bool prefixes) {
+  if (level->indexed == 0 || name[0] == '\0') {
+    return NULL;
+  }
+
+  const flag_trie_node* trie = level->trie;
+  uint32_t node = 0;
+  for (const char* p = name; *p != '\0'; p++) {
+    node = trie[node].child;
+    while (node != 0 && trie[node].label != *p) {
+      node = trie[node].sibling;
+    }
+    if (node == 0) {
+      return NULL;
+    }
+  }
+
+  if (trie[node].exact >= 0) {
+    return level->list[trie[node].exact];
+  }
+  return prefixes && trie[node].count == 1 ? level->list[trie[node].last] : NULL;
+}
+
+// Register a subcommand of ctx below parent, or at the top level when parent is NULL.
+static subcommand* add_subcommand(flag_ctx* ctx, subcommand* parent, subcmd_params* params) {
+  f_assert(params->handler != NULL, "No handler provided for subcommand: %s\n", params->name);
+  f_assert(!ctx->frozen, "[ERROR]: Flag context is frozen. Cannot add subcommand: %s\n",
+           params->name);
+  f_assert(parent == NULL || parent->depth + 1 < FLAG_MAX_SUBCMD_DEPTH,
+           "[ERROR]: Subcommand %s is nested deeper than FLAG_MAX_SUBCMD_DEPTH\n", params->name);
+  STATS_ENTER(&ctx->stats);
+  STATS_CLOCK(start);
+
+  if (ctx->num_subcommands == ctx->subcommand_capacity) {
+    size_t capacity = ctx->subcommand_capacity * 2;
+    subcommand** subcommands =
+      (subcommand**)arena_alloc(&ctx->arena, capacity * sizeof(subcommand*));
+    memcpy(subcommands, ctx->subcommands, ctx->num_subcommands * sizeof(subcommand*));
+    ctx->subcommands = subcommands;
+    ctx->subcommand_capacity = capacity;
+  }
+
+  subcommand* subcmd = (subcommand*)arena_alloc(&ctx->arena, sizeof(subcommand));
+  subcmd->name = arena_strndup(&ctx->arena, params->name, MAX_NAME - 1);
+  subcmd->description =
+    arena_strndup(&ctx->arena, params->desc ? params->desc : "", MAX_DESCRIPTION - 1);
+  subcmd->callback = params->handler;
+  subcmd->parent = parent;
+  subcmd->depth = parent ? parent->depth + 1 : 0;
+  subcmd->children = (flag_subcmds){0};
+  subcmd->ctx = ctx;
+  set_init(&subcmd->flags, &ctx->arena, params->capacity);
+#ifdef FLAG_STATS
+  subcmd->stats = &ctx->stats;
+#endif
+
+  if (parent == NULL) {
+    subcmd->path = subcmd->name;
+  } else {
+    size_t len = strlen(parent->path) + 1 + strlen(subcmd->name);
+    char* path = (char*)arena_alloc(&ctx->arena, len + 1);
+    snprintf(path, len + 1, "%s %s", parent->path, subcmd->name);
+    subcmd->path = path;
+  }
+
+  subcmds_add(parent ? &parent->children : &ctx->children, subcmd, &ctx->arena);
+  ctx->subcommands[ctx->num_subcommands++] = subcmd;
+  STATS_LAP(register_ns, start);
+  STATS_LEAVE();
+  return subcmd;
+}
+
+subcommand* _flag_add_subcommand(flag_ctx* ctx, subcmd_params* params) {
+  return add_subcommand(ctx, NULL, params);
+}
+
+subcommand* _subcommand_add_subcommand(subcommand* parent, subcmd_params* params) {
+  return add_subcommand(parent->ctx, parent, params);
+}
+
+void AllowSubCmdPrefixes(flag_ctx* ctx, bool allow) {
+  ctx->subcmd_prefixes = allow;
+}
+
+flag* _subcommand_add_flag(subcommand* subcmd, flag_params* params) {
+  STATS_ENTER(subcmd->stats);
+  STATS_CLOCK(start);
+  flag* f = set_add(&subcmd->flags, params);
+  STATS_LAP(register_ns, start);
+  STATS_LEAVE();
+  return f;
+}
+
+// Position of the lowest bit set in word, which must not be 0.
+static size_t bit_first(uint64_t word) {
+  size_t i = 0;
+  for (; (word & 1) == 0; word >>= 1) {
+    i++;
+  }
+  return i;
+}
+
+static void set_add_group(flag_set* set, flag_group_kind kind, flag** flags) {
+  f_assert(!set->frozen, "[ERROR]: Flag context is frozen. Cannot add a flag group\n");
+  f_assert(flags[0] != NULL && flags[1] != NULL, "[ERROR]: A flag group needs two flags\n");
+
+  flag_group* group = (flag_group*)arena_alloc(set->arena, sizeof(flag_group));
+  *group = (flag_group){
+    .kind = kind,
+    .words = FLAG_WORDS(set->count),
+    .mask = bits_alloc(set->arena, set->count, NULL, 0),
+  };
+
+  size_t len = strlen("One of  is required");
+  for (size_t i = 0; flags[i] != NULL; i++) {
+    size_t pos = 0;
+    while (pos < set->count && set->list[pos] != flags[i]) {
+      pos++;
+    }
+    f_assert(pos < set->count, "[ERROR]: Flag %s of the group belongs to another set\n",
+             flags[i]->name);
+    if (i == 0) {
+      group->first = pos;
+    }
+    if (i > 0 || kind != FLAG_GROUP_REQUIRES) {
+      bit_set(group->mask, pos);
+    }
+    len += strlen(", -") + flags[i]->name_len;
+  }
+
+  // "One of -a, -b, -c is required"
+  if (kind == FLAG_GROUP_ONE_OF) {
+    char* reason = (char*)arena_alloc(set->arena, len + 1);
+    int n = snprintf(reason, len + 1, "One of ");
+    for (size_t i = 0; flags[i] != NULL; i++) {
+      n += snprintf(reason + n, len + 1 - (size_t)n, "%s-%s", i > 0 ? ", " : "", flags[i]->name);
+    }
+    snprintf(reason + n, len + 1 - (size_t)n, " is required");
+    group->reason = reason;
+  }
+
+  // Groups are checked in the order they were added.
+  flag_group** tail = &set->groups;
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
+  }
+  *tail = group;
+}
+
+void _flag_add_group(flag_ctx* ctx, flag_group_kind kind, flag** flags) {
+  set_add_group(&ctx->flags, kind, flags);
+}
+
+void _subcommand_add_group(subcommand* subcmd, flag_group_kind kind, flag** flags) {
+  set_add_group(&subcmd->flags, kind, flags);
+}
+
+// The flags list carries no index of its own, so compare the precomputed hashes
+// and only fall back to memcmp on a hash match. FlagValueArgs has the index.
+void* FlagValue(flag** flags, int num_flags, const char* name) {
+  size_t len;
+  uint32_t hash = flag_hash(name, &len);
+  for (int i = 0; i < num_flags; i++) {
+    if (flag_matches(flags[i], hash, len, name)) {
+      return flag_value(flags[i]);
+    }
+  }
+  return NULL;
+}
+
+char** FlagPositionals(const flag_ctx* ctx, size_t* count) {
+  *count = ctx->positionals.count;
+  return ctx->positionals.items;
+}
+
+void* FlagValueCtx(flag_ctx* ctx, const char* name) {
+  flag* f = set_find(&ctx->flags, name);
+  return f ? flag_value(f) : NULL;
+}
+
+void* FlagValueArgs(const FlagArgs* args, const char* name) {
+  if (args->subcmd == NULL) {
+    return FlagValue(args->flags, args->num_flags, name);
+  }
+  flag* f = set_find(&args->subcmd->flags, name);
+  return f ? flag_value(f) : NULL;
+}
+
+#define FLAG_DEFINE_GETTER(fn, ctype, t)                                                           \
+  ctype fn(flag* f) {                                                                              \
+    f_assert(f->type == t, "[ERROR]: " #fn " called on %s flag %s\n", flagAsString(f->type),     \
+             f->name);                                                                             \
+    if (f->reload) {                                                                               \
+      ctype value;                                                                                 \
+      flag_atomic_load(&value, f->value, sizeof(value));                                           \
+      return value;                                                                                \
+    }                                                                                              \
+    return *(ctype*)flag_value(f);                                                                 \
+  }
+
+FLAG_GETTERS(FLAG_DEFINE_GETTER)
+#undef FLAG_DEFINE_GETTER
+
+// Invoke the subcommand callback.
+void InvokeSubCmd(subcommand* subcmd, flag_ctx* ctx) {
+  f_assert(subcmd != NULL, "subcommand can not be NULL");
+
+  // Once we are done. We call the subcommand callback.
+  FlagArgs args = {
+    .flags = subcmd->flags.list,
+    .num_flags = (int)subcmd->flags.count,
+    .ctx = ctx,
+    .positionals = ctx->positionals.items,
+    .num_positionals = ctx->positionals.count,
+    .subcmd = subcmd,
+  };
+  subcmd->callback(args);
+}
+
+// Bounds of each integer flag type. The negative bound of a signed type is max + 1.
+#define FLAG_SIGNED_RANGE(ctype, max)                                                              \
+  {(uintmax_t)(max), (uintmax_t)(max) + 1, false, true, sizeof(ctype), true, "out of range"}
+#define FLAG_UNSIGNED_RANGE(ctype, max)                                                            \
+  {(uintmax_t)(max), 0, false, false, sizeof(ctype), false, "out of range"}
+
+static const flag_int_range int_ranges[FLAG_UINTPTR + 1] = {
+  [FLAG_INT] = FLAG_SIGNED_RANGE(int, INT_MAX),
+  [FLAG_SIZE_T] = FLAG_UNSIGNED_RANGE(size_t, SIZE_MAX),
+  [FLAG_INT8] = FLAG_SIGNED_RANGE(int8_t, INT8_MAX),
+  [FLAG_INT16] = FLAG_SIGNED_RANGE(int16_t, INT16_MAX),
+  [FLAG_INT32] = FLAG_SIGNED_RANGE(int32_t, INT32_MAX),
+  [FLAG_INT64] = FLAG_SIGNED_RANGE(int64_t, INT64_MAX),
+  [FLAG_UINT] = FLAG_UNSIGNED_RANGE(unsigned int, UINT_MAX),
+  [FLAG_UINT8] = FLAG_UNSIGNED_RANGE(uint8_t, UINT8_MAX),
+  [FLAG_UINT16] = FLAG_UNSIGNED_RANGE(uint16_t, UINT16_MAX),
+  [FLAG_UINT32] = FLAG_UNSIGNED_RANGE(uint32_t, UINT32_MAX),
+  [FLAG_UINT64] = FLAG_UNSIGNED_RANGE(uint64_t, UINT64_MAX),
+  [FLAG_UINTPTR] = FLAG_UNSIGNED_RANGE(uintptr_t, UINTPTR_MAX),
+};
+
+// Parse a decimal integer that ends at sep or the end of arg, and store it at the width of
+// range. Validation and the check of the upper bound on the magnitude happen in the same
+// pass over the digits, which stops at the first digit past it; the other bound costs one
+// compare at the end. Nothing depends on the locale. On success *pos is the offset of the
+// terminator.
+static const char* scan_integer(const char* arg, char sep, void* value,
+                                const flag_int_range* range, size_t* pos) {
+  const char* p = arg;
+  bool negative = *p == '-';
+  if (*p == '-' || *p == '+') {
+    p++;
+  }
+
+  if (negative && !range->is_signed) {
+    *pos = 0;
+    return "negative value for an unsigned type";
+  }
+  if (*p == '\0' || *p == sep) {
+    *pos = (size_t)(p - arg);
+    return "missing digits";
+  }
+
+  // Largest magnitude accepted in the direction of the sign, 0 if only 0 could be.
+  uintmax_t limit = negative ? (range->min_negative ? range->min : 0)
+                             : (range->max_negative ? 0 : range->max);
+  uintmax_t n = 0;
+  for (; *p != '\0' && *p != sep; p++) {
+    unsigned digit = (unsigned)(unsigned char)*p - '0';
+    if (digit > 9) {
+      *pos = (size_t)(p - arg);
+      return "invalid integer";
+    }
+    if (digit > limit || n > (limit - digit) / 10) {
+      *pos = SIZE_MAX;
+      return range->reason;
+    }
+    n = n * 10 + digit;
+  }
+  *pos = (size_t)(p - arg);
+
+  // The bound on the other side of 0 from the limit. A "-0" is 0, so it also fails a
+  // minimum above 0.
+  if (negative ? (range->max_negative && n < range->max) || (!range->min_negative && range->min > 0)
+               : range->max_negative || (!range->min_negative && n < range->min)) {
+    *pos = SIZE_MAX;
+    return range->reason;
+  }
+
+  // Unsigned negation gives the two's complement bits, which the narrowing stores keep.
+  if (negative) {
+    n = 0 - n;
+  }
+  switch (range->size) {
+    case 1:
+      *(uint8_t*)value = (uint8_t)n;
+      break;
+    case 2:
+      *(uint16_t*)value = (uint16_t)n;
+      break;
+    case 4:
+      *(uint32_t*)value = (uint32_t)n;
+      break;
+    default:
+      *(uint64_t*)value = (uint64_t)n;
+      break;
+  }
+  return NULL;
+}
+
+// Parse a decimal integer of the type whose flag_int_range is data.
+static const char* parse_integer(const char* arg, void* value, const void* data, size_t* err_pos) {
+  size_t pos;
+  const char* reason = scan_integer(arg, '\0', value, data, &pos);
+  if (reason != NULL) {
+    *err_pos = pos;
+  }
+  return reason;
+}
+
+static int format_integer(const void* value, char* buf, size_t len, const void* data) {
+  const flag_int_range* range = data;
+  switch (range->size) {
+    case 1:
+      return range->is_signed ? snprintf(buf, len, "%" PRId8, *(const int8_t*)value)
+                              : snprintf(buf, len, "%" PRIu8, *(const uint8_t*)value);
+    case 2:
+      return range->is_signed ? snprintf(buf, len, "%" PRId16, *(const int16_t*)value)
+                              : snprintf(buf, len, "%" PRIu16, *(const uint16_t*)value);
+    case 4:
+      return range->is_signed ? snprintf(buf, len, "%" PRId32, *(const int32_t*)value)
+                              : snprintf(buf, len, "%" PRIu32, *(const uint32_t*)value);
+    default:
+      return range->is_signed ? snprintf(buf, len, "%" PRId64, *(const int64_t*)value)
+                              : snprintf(buf, len, "%" PRIu64, *(const uint64_t*)value);
+  }
+}
+
+// Powers of ten that are exact in double and float respectively.
+static const double exact_pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                     1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                     1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+static const float exact_pow10f[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                     1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+
+// Parse a float (is_double false) or double value that ends at sep or the end of arg.
+// Decimal values whose digits fit the target's mantissa and whose exponent has an exact
+// power of ten are computed with a single multiply or divide, which IEEE arithmetic rounds
+// correctly (Clinger's fast path). Everything else, including hex floats, inf and nan, goes
+// to strtod/strtof under the C locale. On success *pos is the offset of the terminator.
+static const char* scan_real(bool is_double, const char* arg, char sep, void* value,
+                             size_t* pos) {
+  const char* p = arg;
+  bool negative = *p == '-';
+  if (*p == '-' || *p == '+') {
+    p++;
+  }
+
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    goto slow;
+  }
+
+  // Gather up to 19 significant digits, which always fit in 64 bits.
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool any_digit = false;
+  bool truncated = false;
+  for (; (unsigned)(*p - '0') <= 9; p++) {
+    any_digit = true;
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (unsigned)(*p - '0');
+      digits += mantissa != 0;
+    } else {
+      truncated = true;
+      exponent++;
+    }
+  }
+  if (*p == '.') {
+    for (p++; (unsigned)(*p - '0') <= 9; p++) {
+      any_digit = true;
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (unsigned)(*p - '0');
+        digits += mantissa != 0;
+        exponent--;
+      } else {
+        truncated = true;
+      }
+    }
+  }
+  if (!any_digit) {
+    // Not a decimal number, but may still be inf or nan.
+    if ((*p | 0x20) == 'i' || (*p | 0x20) == 'n') {
+      goto slow;
+    }
+    *pos = (size_t)(p - arg);
+    return "invalid number";
+  }
+
+  if (*p == 'e' || *p == 'E') {
+    const char* e = p + 1;
+    bool negative_exp = *e == '-';
+    if (*e == '-' || *e == '+') {
+      e++;
+    }
+    if ((unsigned)(*e - '0') > 9) {
+      *pos = (size_t)(e - arg);
+      return "missing exponent digits";
+    }
+    int exp_value = 0;
+    for (; (unsigned)(*e - '0') <= 9; e++) {
+      if (exp_value < 100000) {
+        exp_value = exp_value * 10 + (*e - '0');
+      }
+    }
+    exponent += negative_exp ? -exp_value : exp_value;
+    p = e;
+  }
+  if (*p != '\0' && *p != sep) {
+    *pos = (size_t)(p - arg);
+    return "trailing characters";
+  }
+  *pos = (size_t)(p - arg);
+
+#if FLT_EVAL_METHOD == 0
+  if (!truncated) {
+    if (is_double && mantissa <= (UINT64_C(1) << 53) && exponent >= -22 && exponent <= 22) {
+      double d = (double)mantissa;
+      d = exponent < 0 ? d / exact_pow10[-exponent] : d * exact_pow10[exponent];
+      *(double*)value = negative ? -d : d;
+      return NULL;
+    }
+    if (!is_double && mantissa <= (UINT64_C(1) << 24) && exponent >= -10 && exponent <= 10) {
+      float f = (float)mantissa;
+      f = exponent < 0 ? f / exact_pow10f[-exponent] : f * exact_pow10f[exponent];
+      *(float*)value = negative ? -f : f;
+      return NULL;
+    }
+  }
+#endif
+
+slow:;
+  // The fallback is correctly rounded too, and the C locale keeps '.' the radix character.
+  locale_t previous = c_locale != (locale_t)0 ? uselocale(c_locale) : (locale_t)0;
+  char* end;
+  double d = 0;
+  float f = 0;
+  bool overflow;
+  errno = 0;
+  if (is_double) {
+    d = strtod(arg, &end);
+    overflow = errno == ERANGE && (d > DBL_MAX || d < -DBL_MAX);
+  } else {
+    f = strtof(arg, &end);
+    overflow = errno == ERANGE && (f > FLT_MAX || f < -FLT_MAX);
+  }
+  if (previous != (locale_t)0) {
+    uselocale(previous);
+  }
+
+  if (end == arg) {
+    *pos = 0;
+    return "invalid number";
+  }
+  if (*end != '\0' && *end != sep) {
+    *pos = (size_t)(end - arg);
+    return "trailing characters";
+  }
+  if (overflow) {
+    *pos = SIZE_MAX;
+    return "out of range";
+  }
+  *pos = (size_t)(end - arg);
+  if (is_double) {
+    *(double*)value = d;
+  } else {
+    *(float*)value = f;
+  }
+  return NULL;
+}
+
+// Parse a float (is_double false) or double value.
+static const char* parse_real(bool is_double, const char* arg, void* value, size_t* err_pos) {
+  size_t pos;
+  const char* reason = scan_real(is_double, arg, '\0', value, &pos);
+  if (reason != NULL) {
+    *err_pos = pos;
+  }
+  return reason;
+}
+
+static const char* parse_float(const char* arg, void* value, const void* data, size_t* err_pos) {
+  (void)data;
+  return parse_real(false, arg, value, err_pos);
+}
+
+static const char* parse_double(const char* arg, void* value, const void* data, size_t* err_pos) {
+  (void)data;
+  return parse_real(true, arg, value, err_pos);
+}
+
+static int format_float(const void* value, char* buf, size_t len, const void* data) {
+  (void)data;
+  return snprintf(buf, len, "%g", (double)*(const float*)value);
+}
+
+static int format_double(const void* value, char* buf, size_t len, const void* data) {
+  (void)data;
+  return snprintf(buf, len, "%g", *(const double*)value);
+}
+
+static const char* parse_bool(const char* arg, void* value, const void* data, size_t* err_pos) {
+  (void)data;
+  (void)err_pos;
+  if (strcasecmp(arg, "true") == 0) {
+    *(bool*)value = true;
+  } else if (strcasecmp(arg, "false") == 0) {
+    *(bool*)value = false;
+  } else {
+    return "expected true or false";
+  }
+  return NULL;
+}
+
+static int format_bool(const void* value, char* buf, size_t len, const void* data) {
+  (void)data;
+  return snprintf(buf, len, "%s", *(const bool*)value ? "true" : "false");
+}
+
+// Strings point into argv, which outlives the context. apply_flag copies them for .copy.
+static const char* parse_string(const char* arg, void* value, const void* data, size_t* err_pos) {
+  (void)data;
+  (void)err_pos;
+  *(const char**)value = arg;
+  return NULL;
+}
+
+static int format_string(const void* value, char* buf, size_t len, const void* data) {
+  (void)data;
+  const char* str = *(const char* const*)value;
+  return str ? snprintf(buf, len, "%s", str) : 0;
+}
+
+// Unit of a quantity flag: a suffix and what one of it is worth in the stored unit.
+typedef struct flag_unit {
+  const char* name;
+  uint64_t scale;
+} flag_unit;
+
+// Units of each quantity type, ending with a NULL name. The scale is in the unit stored:
+// nanoseconds for durations, bytes for sizes.
+static const flag_unit duration_units[] = {
+  {"ns", 1},
+  {"us", 1000},
+  {"\xC2\xB5s", 1000},  // µs
+  {"ms", 1000000},
+  {"s", 1000000000},
+  {"m", UINT64_C(60000000000)},
+  {"h", UINT64_C(3600000000000)},
+  {NULL, 0},
+};
+
+// K, M, G... without B are short for KiB, MiB, GiB... like in dd and the JVM; kB, MB,
+// GB... are decimal. The help hint of FLAG_BYTES lists them all.
+static const flag_unit byte_units[] = {
+  {"B", 1},
+  {"kB", UINT64_C(1000)},
+  {"MB", UINT64_C(1000000)},
+  {"GB", UINT64_C(1000000000)},
+  {"TB", UINT64_C(1000000000000)},
+  {"PB", UINT64_C(1000000000000000)},
+  {"EB", UINT64_C(1000000000000000000)},
+  {"K", UINT64_C(1) << 10},
+  {"KiB", UINT64_C(1) << 10},
+  {"M", UINT64_C(1) << 20},
+  {"MiB", UINT64_C(1) << 20},
+  {"G", UINT64_C(1) << 30},
+  {"GiB", UINT64_C(1) << 30},
+  {"T", UINT64_C(1) << 40},
+  {"TiB", UINT64_C(1) << 40},
+  {"P", UINT64_C(1) << 50},
+  {"PiB", UINT64_C(1) << 50},
+  {"E", UINT64_C(1) << 60},
+  {"EiB", UINT64_C(1) << 60},
+  {NULL, 0},
+};
+
+// Multipliers of a rate, before the time unit it is per: 10k/s.
+static const flag_unit rate_units[] = {
+  {"k", UINT64_C(1000)},
+  {"K", UINT64_C(1000)},
+  {"M", UINT64_C(1000000)},
+  {"G", UINT64_C(1000000000)},
+  {NULL, 0},
+};
+
+// Read the unit at *p, the longest run of letters, and advance *p past it. Returns NULL
+// for no unit at all, or a unit with a scale of 0 if the run is not in units.
+static const flag_unit* scan_unit(const char** p, const flag_unit* units) {
+  static const flag_unit unknown = {NULL, 0};
+  const char* s = *p;
+  size_t len = 0;
+  while (isalpha((unsigned char)s[len]) || (unsigned char)s[len] >= 0x80) {
+    len++;
+  }
+  if (len == 0) {
+    return NULL;
+  }
+  *p = s + len;
+  for (const flag_unit* u = units; u->name != NULL; u++) {
+    if (strncmp(u->name, s, len) == 0 && u->name[len] == '\0') {
+      return u;
+    }
+  }
+  return &unknown;
+}
+
+// A decimal amount such as "12" or "1.5": whole, and the digits after the point as the
+// integer frac with their count.
+typedef struct flag_amount {
+  uint64_t whole;
+  uint64_t frac;
+  size_t digits;
+} flag_amount;
+
+#define FLAG_MAX_FRACTION_DIGITS 19  // Digits after the point that always fit in frac.
+
+// Read a decimal amount at *p in arg and advance *p past it. Both parts go through
+// scan_integer, stopping at what follows their digits, so the overflow checks are its own.
+static const char* scan_amount(const char* arg, const char** p, flag_amount* a,
+                               size_t* err_pos) {
+  const flag_int_range* range = &int_ranges[FLAG_UINT64];
+  const char* s = *p;
+  size_t len = strspn(s, "0123456789");
+  size_t pos;
+  *a = (flag_amount){0};
+  if (len > 0 && scan_integer(s, s[len], &a->whole, range, &pos) != NULL) {
+    *err_pos = SIZE_MAX;
+    return "out of range";
+  }
+  s += len;
+
+  if (*s == '.') {
+    a->digits = strspn(++s, "0123456789");
+    if (a->digits > FLAG_MAX_FRACTION_DIGITS) {
+      *err_pos = (size_t)(s - arg) + FLAG_MAX_FRACTION_DIGITS;
+      return "too many digits after the point";
+    }
+    if (a->digits > 0) {
+      scan_integer(s, s[a->digits], &a->frac, range, &pos);
+    }
+    s += a->digits;
+  }
+  if (len == 0 && a->digits == 0) {
+    *err_pos = (size_t)(s - arg);
+    return "missing digits";
+  }
+  *p = s;
+  return NULL;
+}
+
+// a units of scale, rounded to the nearest unit and at most limit. Returns false on
+// overflow. *exact tells whether a was a whole number of units. The fraction is scaled one
+// digit at a time from the last, which keeps it exact in 64 bits for scales up to 2^60.
+static bool scale_amount(const flag_amount* a, uint64_t scale, uint64_t limit, uint64_t* out,
+                         bool* exact) {
+  uint64_t part = 0;
+  uint64_t frac = a->frac;
+  *exact = true;
+  for (size_t i = 0; i < a->digits; i++, frac /= 10) {
+    uint64_t n = (frac % 10) * scale + part;
+    *exact &= n % 10 == 0;
+    part = (n + (i + 1 == a->digits ? 5 : 0)) / 10;
+  }
+
+  if (a->whole > limit / scale || part > limit - a->whole * scale) {
+    return false;
+  }
+  *out = a->whole * scale + part;
+  return true;
+}
+
+// A duration such as 250ms, 1.5h or 1h30m, stored as int64_t nanoseconds. Every number
+// needs a unit, except 0. Each term is read in the same pass as its unit.
+static const char* parse_duration(const char* arg, void* value, const void* data,
+                                  size_t* err_pos) {
+  const flag_unit* units = data;
+  const char* p = arg;
+  bool negative = *p == '-';
+  if (*p == '-' || *p == '+') {
+    p++;
+  }
+  if (strcmp(p, "0") == 0) {
+    *(int64_t*)value = 0;
+    return NULL;
+  }
+
+  uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+  uint64_t total = 0;
+  do {
+    const char* start = p;
+    flag_amount amount;
+    const char* reason = scan_amount(arg, &p, &amount, err_pos);
+    if (reason != NULL) {
+      return reason;
+    }
+
+    const char* at = p;
+    const flag_unit* unit = scan_unit(&p, units);
+    if (unit == NULL || unit->scale == 0) {
+      *err_pos = (size_t)(at - arg);
+      return unit == NULL ? "missing unit" : "unknown unit";
+    }
+
+    // Fractions of a nanosecond are rounded away.
+    uint64_t term;
+    bool exact;
+    if (!scale_amount(&amount, unit->scale, limit - total, &term, &exact)) {
+      *err_pos = (size_t)(start - arg);
+      return "out of range";
+    }
+    total += term;
+  } while (*p != '\0');
+
+  *(int64_t*)value = negative ? (int64_t)(0 - total) : (int64_t)total;
+  return NULL;
+}
+
+// Write n / scale with its fraction, without trailing zeros, then unit: 1.5ms.
+static int format_fraction(char* buf, size_t len, uint64_t n, uint64_t scale, const char* unit) {
+  char frac[24] = "";
+  size_t digits = 0;
+  uint64_t rest = n % scale;
+  for (uint64_t place = scale / 10; place > 0 && rest > 0; place /= 10) {
+    frac[0] = '.';
+    frac[++digits] = (char)('0' + rest / place);
+    frac[digits + 1] = '\0';
+    rest %= place;
+  }
+  return snprintf(buf, len, "%" PRIu64 "%s%s", n / scale, frac, unit);
+}
+
+// Durations are shown the way they are written: 250ms, 1h30m, 1h0m0.5s.
+static int format_duration(const void* value, char* buf, size_t len, const void* data) {
+  (void)data;
+  int64_t d = *(const int64_t*)value;
+  uint64_t n = d < 0 ? 0 - (uint64_t)d : (uint64_t)d;
+  const uint64_t second = UINT64_C(1000000000);
+  char text[64];
+
+  if (n < second) {
+    uint64_t scale = n < 1000 ? 1 : n < 1000000 ? 1000 : 1000000;
+    const char* unit = n == 0 ? "s" : n < 1000 ? "ns" : n < 1000000 ? "us" : "ms";
+    format_fraction(text, sizeof(text), n, scale, unit);
+  } else {
+    uint64_t hours = n / (3600 * second);
+    uint64_t minutes = n / (60 * second) % 60;
+    uint64_t rest = n % (60 * second);
+    size_t used = 0;
+    if (hours > 0) {
+      used += (size_t)snprintf(text, sizeof(text), "%" PRIu64 "h", hours);
+    }
+    if (minutes > 0 || (hours > 0 && rest > 0)) {
+      used += (size_t)snprintf(text + used, sizeof(text) - used, "%" PRIu64 "m", minutes);
+    }
+    if (rest > 0 || used == 0) {
+      format_fraction(text + used, sizeof(text) - used, rest, second, "s");
+    }
+  }
+  return snprintf(buf, len, "%s%s", d < 0 ? "-" : "", text);
+}
+
+// A size such as 512, 64KiB, 1.5GB or 4G, stored as int64_t bytes. A number without a
+// unit is in bytes, and a fraction must come to whole bytes.
+static const char* parse_bytes(const char* arg, void* value, const void* data, size_t* err_pos) {
+  const flag_unit* units = data;
+  const char* p = arg;
+  if (*p == '-') {
+    *err_pos = 0;
+    return "negative size";
+  }
+  p += *p == '+';
+
+  flag_amount amount;
+  const char* reason = scan_amount(arg, &p, &amount, err_pos);
+  if (reason != NULL) {
+    return reason;
+  }
+
+  const char* at = p;
+  const flag_unit* unit = scan_unit(&p, units);
+  if (unit != NULL && unit->scale == 0) {
+    *err_pos = (size_t)(at - arg);
+    return "unknown unit";
+  }
+  if (*p != '\0') {
+    *err_pos = (size_t)(p - arg);
+    return "trailing characters";
+  }
+
+  uint64_t bytes;
+  bool exact;
+  if (!scale_amount(&amount, unit ? unit->scale : 1, INT64_MAX, &bytes, &exact)) {
+    *err_pos = SIZE_MAX;
+    return "out of range";
+  }
+  if (!exact) {
+    *err_pos = SIZE_MAX;
+    return "not a whole number of bytes";
+  }
+  *(int64_t*)value = (int64_t)bytes;
+  return NULL;
+}
+
+// Sizes are shown in the largest unit that divides them, binary units first: 4GiB, 1500B.
+static int format_bytes(const void* value, char* buf, size_t len, const void* data) {
+  (void)data;
+  uint64_t n = (uint64_t)*(const int64_t*)value;
+  static const char* const binary[] = {"EiB", "PiB", "TiB", "GiB", "MiB", "KiB"};
+  static const char* const decimal[] = {"EB", "PB", "TB", "GB", "MB", "kB"};
+  for (int i = 0; i < 6 && n > 0; i++) {
+    uint64_t scale = UINT64_C(1) << (10 * (6 - i));
+    if (n % scale == 0) {
+      return snprintf(buf, len, "%" PRIu64 "%s", n / scale, binary[i]);
+    }
+  }
+  uint64_t scale = UINT64_C(1000000000000000000);
+  for (int i = 0; i < 6 && n > 0; i++, scale /= 1000) {
+    if (n % scale == 0) {
+      return snprintf(buf, len, "%" PRIu64 "%s", n / scale, decimal[i]);
+    }
+  }
+  return snprintf(buf, len, "%" PRIu64 "B", n);
+}
+
+// A rate such as 100, 10k/s, 2.5M/h or 5/ms, stored as a double of events per second. The
+// multiplier and the time unit are optional; a rate without one is per second.
+static const char* parse_rate(const char* arg, void* value, const void* data, size_t* err_pos) {
+  const flag_unit* units = data;
+  const char* p = arg;
+  if (*p == '-') {
+    *err_pos = 0;
+    return "negative rate";
+  }
+  p += *p == '+';
+
+  if ((unsigned)(*p - '0') > 9 && *p != '.') {
+    *err_pos = (size_t)(p - arg);
+    return "missing digits";
+  }
+
+  // The number ends where the multiplier or the time unit starts.
+  double rate;
+  size_t pos;
+  size_t len = strspn(p, "0123456789.eE+-");
+  const char* reason = scan_real(true, p, p[len], &rate, &pos);
+  if (reason != NULL) {
+    *err_pos = pos == SIZE_MAX ? pos : (size_t)(p - arg) + pos;
+    return reason;
+  }
+  p += pos;
+
+  const char* at = p;
+  const flag_unit* multiplier = scan_unit(&p, units);
+  if (multiplier != NULL && multiplier->scale == 0) {
+    *err_pos = (size_t)(at - arg);
+    return "unknown multiplier";
+  }
+  if (multiplier != NULL) {
+    rate *= (double)multiplier->scale;
+  }
+
+  if (*p == '/') {
+    at = ++p;
+    const flag_unit* per = scan_unit(&p, duration_units);
+    if (per == NULL || per->scale == 0) {
+      *err_pos = (size_t)(at - arg);
+      return "unknown time unit";
+    }
+    rate *= 1e9 / (double)per->scale;
+  }
+  if (*p != '\0') {
+    *err_pos = (size_t)(p - arg);
+    return "trailing characters";
+  }
+  *(double*)value = rate;
+  return NULL;
+}
+
+static int format_rate(const void* value, char* buf, size_t len, const void* data) {
+  (void)data;
+  return snprintf(buf, len, "%g/s", *(const double*)value);
+}
+
+static bool flag_is_list(flag_type type) {
+  return type == FLAG_INT_LIST || type == FLAG_DOUBLE_LIST || type == FLAG_STRING_LIST;
+}
+
+// Conversion data for f, whose type or element type converts with ops: the bounds of its
+// .range for integers, which the integer parser checks as it reads the digits.
+static const void* parse_data(const flag* f, const flag_type_ops* ops) {
+  return f->checks != NULL && f->checks->ints.size != 0 ? &f->checks->ints : ops->data;
+}
+
+// Check x, just converted for a float or double flag f, against the .range of f.
+static const char* check_real(const flag* f, double x, size_t* err_pos) {
+  const flag_checks* c = f->checks;
+  if (c == NULL || !c->ranged || (x >= c->min && x <= c->max)) {
+    return NULL;
+  }
+  *err_pos = SIZE_MAX;
+  return c->range_reason;
+}
+
+// Append the elements of arg to the list of f stored in list. Number lists are split on
+// commas, and their elements are parsed in place with the scanners above; string lists
+// take arg whole. The first append in a parse replaces the default list. The buffer doubles
+// in values when it fills, so appending n elements copies O(n) in total. Nothing is
+// stored unless every element parses.
+static const char* list_append(const flag* f, flag_list* list, const char* arg,
+                               flag_arena* values, size_t* err_pos) {
+  const flag_type_ops* elem = flag_types[f->type].data;
+  size_t count = list->capacity > 0 ? list->count : 0;
+  size_t added = 1;
+  if (f->type != FLAG_STRING_LIST) {
+    for (const char* c = arg; (c = strchr(c, ',')) != NULL; c++) {
+      added++;
+    }
+  }
+
+  void* items = list->items;
+  size_t capacity = list->capacity;
+  if (count + added > capacity) {
+    capacity = capacity > 0 ? capacity * 2 : FLAG_LIST_MIN_CAPACITY;
+    while (capacity < count + added) {
+      capacity *= 2;
+    }
+    items = arena_alloc(values, capacity * elem->size);
+    if (count > 0) {
+      memcpy(items, list->items, count * elem->size);
+    }
+  }
+
+  unsigned char* out = (unsigned char*)items + count * elem->size;
+  if (f->type == FLAG_STRING_LIST) {
+    *(const char**)out = f->copy ? arena_strndup(values, arg, strlen(arg)) : arg;
+  } else {
+    const char* p = arg;
+    for (size_t i = 0; i < added; i++, out += elem->size) {
+      size_t pos;
+      const char* reason = f->type == FLAG_INT_LIST
+                             ? scan_integer(p, ',', out, parse_data(f, elem), &pos)
+                             : scan_real(true, p, ',', out, &pos);
+      if (reason == NULL && f->type == FLAG_DOUBLE_LIST) {
+        reason = check_real(f, *(const double*)out, &pos);
+      }
+      if (reason != NULL) {
+        *err_pos = pos == SIZE_MAX ? SIZE_MAX : (size_t)(p - arg) + pos;
+        return reason;
+      }
+      p += pos + 1;
+    }
+  }
+
+  list->items = items;
+  list->count = count + added;
+  list->capacity = capacity;
+  return NULL;
+}
+
+// Mark the list of f as a default, so the next parse replaces it instead of appending.
+static void seal_list(const flag* f) {
+  if (flag_is_list(f->type)) {
+    ((flag_list*)f->value)->capacity = 0;
+  }
+}
+
+// Lists are shown comma separated in help.
+static int format_list(const void* value, char* buf, size_t len, const void* data) {
+  const flag_type_ops* elem = data;
+  const flag_list* list = value;
+  size_t n = 0;
+  for (size_t i = 0; i < list->count; i++) {
+    if (i > 0) {
+      n += (size_t)snprintf(n < len ? buf + n : NULL, n < len ? len - n : 0, ",");
+    }
+    const void* item = (const unsigned char*)list->items + i * elem->size;
+    int written = elem->format(item, n < len ? buf + n : NULL, n < len ? len - n : 0, elem->data);
+    n += written > 0 ? (size_t)written : 0;
+  }
+  return n > INT_MAX ? INT_MAX : (int)n;
+}
+
+#define FLAG_INTEGER_TYPE(t, type_name, ctype)                                                     \
+  [t] = {.name = type_name,                                                                        \
+         .size = sizeof(ctype),                                                                    \
+         .parse = parse_integer,                                                                   \
+         .format = format_integer,                                                                 \
+         .data = &int_ranges[t]}
+
+// Conversion table for every flag type, indexed by flag_type. Parsing and help output go
+// through it for built-in and registered types alike.
+static flag_type_ops flag_types[FLAG_MAX_TYPES] = {
+  [FLAG_BOOL] = {.name = "bool",
+                 .size = sizeof(bool),
+                 .parse = parse_bool,
+                 .format = format_bool,
+                 .implied_value = "true"},
+  FLAG_INTEGER_TYPE(FLAG_INT, "int", int),
+  FLAG_INTEGER_TYPE(FLAG_SIZE_T, "size_t", size_t),
+  FLAG_INTEGER_TYPE(FLAG_INT8, "int8_t", int8_t),
+  FLAG_INTEGER_TYPE(FLAG_INT16, "int16_t", int16_t),
+  FLAG_INTEGER_TYPE(FLAG_INT32, "int32_t", int32_t),
+  FLAG_INTEGER_TYPE(FLAG_INT64, "int64_t", int64_t),
+  FLAG_INTEGER_TYPE(FLAG_UINT, "unsigned int", unsigned int),
+  FLAG_INTEGER_TYPE(FLAG_UINT8, "uint8_t", uint8_t),
+  FLAG_INTEGER_TYPE(FLAG_UINT16, "uint16_t", uint16_t),
+  FLAG_INTEGER_TYPE(FLAG_UINT32, "uint32_t", uint32_t),
+  FLAG_INTEGER_TYPE(FLAG_UINT64, "uint64_t", uint64_t),
+  FLAG_INTEGER_TYPE(FLAG_UINTPTR, "uintptr_t", uintptr_t),
+  [FLAG_FLOAT] = {.name = "float", .size = sizeof(float), .parse = parse_float,
+                  .format = format_float},
+  [FLAG_DOUBLE] = {.name = "double", .size = sizeof(double), .parse = parse_double,
+                   .format = format_double},
+  [FLAG_STRING] = {.name = "char *", .size = sizeof(char*), .parse = parse_string,
+                   .format = format_string},
+
+  // Lists are parsed by list_append. data is the element type.
+  [FLAG_INT_LIST] = {.name = "[]int", .size = sizeof(flag_list), .format = format_list,
+                     .data = &flag_types[FLAG_INT]},
+  [FLAG_DOUBLE_LIST] = {.name = "[]double", .size = sizeof(flag_list), .format = format_list,
+                        .data = &flag_types[FLAG_DOUBLE]},
+  [FLAG_STRING_LIST] = {.name = "[]char *", .size = sizeof(flag_list), .format = format_list,
+                        .data = &flag_types[FLAG_STRING]},
+
+  [FLAG_DURATION] = {.name = "duration", .size = sizeof(int64_t), .parse = parse_duration,
+                     .format = format_duration, .data = duration_units,
+                     .hint = "ns, us, ms, s, m, h"},
+  [FLAG_BYTES] = {.name = "bytes", .size = sizeof(int64_t), .parse = parse_bytes,
+                  .format = format_bytes, .data = byte_units,
+                  .hint = "B, kB, MB, GB, TB, PB, EB, KiB (K), MiB (M), GiB (G), TiB (T), "
+                          "PiB (P), EiB (E)"},
+  [FLAG_RATE] = {.name = "rate", .size = sizeof(double), .parse = parse_rate,
+                 .format = format_rate, .data = rate_units,
+                 .hint = "per second, like 100, 10k/s or 5/ms"},
+};
+
+// Number of entries in flag_types that are in use.
+static size_t flag_num_types = FLAG_TYPE_CUSTOM;
+
+flag_type RegisterFlagType(const flag_type_ops* ops) {
+  f_assert(ops != NULL && ops->name != NULL && ops->parse != NULL,
+           "[ERROR]: A flag type needs a name and a parse function\n");
+  f_assert(flag_num_types < FLAG_MAX_TYPES, "[ERROR]: Too many flag types. Cannot add %s\n",
+           ops->name);
+
+  flag_types[flag_num_types] = *ops;
+  return (flag_type)flag_num_types++;
+}
+
+static bool flag_type_known(flag_type type) {
+  return (size_t)type < flag_num_types;
+}
+
+// Record a parse failure in err and return its status.
+static flag_status parse_error(flag_error* err, flag_status status, const flag* f, int index,
+                               const char* value, const char* reason, size_t offset) {
+  *err = (flag_error){
+    .status = status,
+    .flag = f ? f->name : NULL,
+    .type = f ? flag_types[f->type].name : NULL,
+    .index = index,
+    .value = value,
+    .reason = reason,
+    .offset = offset,
+  };
+  return status;
+}
+
+// Convert arg and store it into value, the storage for f, checking the .range of f on the
+// way. A NULL arg stands for an omitted value, which only types with an implied value
+// accept. index is reported in errors.
+static flag_status convert_value(const flag* f, void* value, const char* arg,
+                                 flag_arena* values, int index, flag_error* err) {
+  const flag_type_ops* ops = &flag_types[f->type];
+  size_t err_pos = SIZE_MAX;
+  const char* reason;
+
+  if (arg == NULL) {
+    if (ops->implied_value == NULL) {
+      return parse_error(err, FLAG_ERR_MISSING_VALUE, f, index, NULL, "no value specified",
+                         SIZE_MAX);
+    }
+    reason = ops->parse(ops->implied_value, value, ops->data, &err_pos);
+    f_assert(reason == NULL, "[ERROR]: Implied value of type %s does not parse\n", ops->name);
+  } else {
+    reason = flag_is_list(f->type) ? list_append(f, value, arg, values, &err_pos)
+                                   : ops->parse(arg, value, parse_data(f, ops), &err_pos);
+    if (reason == NULL && f->type == FLAG_DOUBLE) {
+      reason = check_real(f, *(const double*)value, &err_pos);
+    } else if (reason == NULL && f->type == FLAG_FLOAT) {
+      reason = check_real(f, *(const float*)value, &err_pos);
+    }
+    if (reason != NULL) {
+      return parse_error(err, FLAG_ERR_INVALID_VALUE, f, index, arg, reason, err_pos);
+    }
+    if (f->copy && f->type == FLAG_STRING) {
+      *(char**)value = arena_strndup(values, arg, strlen(arg));
+    }
+  }
+  return FLAG_OK;
+}
+
+// Whether the choices of f hold s.
+static bool choices_contain(const flag_choices* choices, const char* s) {
+  size_t len;
+  uint32_t hash = flag_hash(s, &len);
+  for (size_t slot = hash & choices->mask; choices->slots[slot] != NULL;
+       slot = (slot + 1) & choices->mask) {
+    if (choices->hashes[slot] == hash && strcmp(choices->slots[slot], s) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether all of s matches pattern. Every character advances all states at once, so the
+// time is linear in the length of s whatever the pattern.
+static bool pattern_match(const flag_pattern* pattern, const char* s) {
+  uint64_t states = pattern->start;
+  for (; *s != '\0' && states != 0; s++) {
+    uint64_t matched = states & pattern->chars[(unsigned char)*s];
+    states = 0;
+    for (; matched != 0; matched &= matched - 1) {
+      states |= pattern->next[bit_first(matched)];
+    }
+  }
+  return *s == '\0' && (states & pattern->accept) != 0;
+}
+
+// Check string s of f against its choices and pattern.
+static flag_status check_string(const flag* f, const char* s, flag_error* err) {
+  const flag_checks* c = f->checks;
+  if (s == NULL) {
+    return FLAG_OK;
+  }
+  if (c->choices != NULL && !choices_contain(c->choices, s)) {
+    return parse_error(err, FLAG_ERR_INVALID_VALUE, f, -1, s, c->choices_reason, SIZE_MAX);
+  }
+  if (c->pattern != NULL && !pattern_match(c->pattern, s)) {
+    return parse_error(err, FLAG_ERR_INVALID_VALUE, f, -1, s, c->pattern_reason, SIZE_MAX);
+  }
+  return FLAG_OK;
+}
+
+// Run the checks of f that need the whole value, stored in value: the choices and the
+// pattern, then the validator set by SetValidator, then those stacked by AddValidator.
+// The first to fail is reported.
+static flag_status validate_value(const flag* f, const void* value, flag_error* err) {
+  const flag_checks* c = f->checks;
+  const char* str = f->type == FLAG_STRING ? *(const char* const*)value : NULL;
+  if (c != NULL && (c->choices != NULL || c->pattern != NULL)) {
+    flag_status status = FLAG_OK;
+    if (f->type == FLAG_STRING) {
+      status = check_string(f, str, err);
+    } else {
+      const flag_list* list = value;
+      for (size_t i = 0; i < list->count && status == FLAG_OK; i++) {
+        status = check_string(f, ((const char* const*)list->items)[i], err);
+      }
+    }
+    if (status != FLAG_OK) {
+      return status;
+    }
+  }
+
+  if (f->flag_validator.validator != NULL && !f->flag_validator.validator(value)) {
+    return parse_error(err, FLAG_ERR_VALIDATION, f, -1, str, f->flag_validator.error_message,
+                       SIZE_MAX);
+  }
+  for (size_t i = 0; c != NULL && i < c->num_validators; i++) {
+    if (!c->validators[i].validator(value)) {
+      return parse_error(err, FLAG_ERR_VALIDATION, f, -1, str, c->validators[i].error_message,
+                         SIZE_MAX);
+    }
+  }
+  return FLAG_OK;
+}
+
+// Convert arg into value like convert_value, then validate it. Used where values are set
+// one at a time: config files, the environment and lazy flags.
+static flag_status store_value(const flag* f, void* value, const char* arg, flag_arena* values,
+                               int index, flag_error* err) {
+  flag_status status = convert_value(f, value, arg, values, index, err);
+  if (status != FLAG_OK) {
+    return status;
+  }
+  STATS_CLOCK(start);
+  status = validate_value(f, value, err);
+  STATS_LAP(validate_ns, start);
+  return status;
+}
+
+#define FLAG_VALUE_COPY_SIZE 64  // Values up to this size are copied on the stack.
+
+flag_status ResolveFlag(flag* f, flag_error* err) {
+  flag_error unused;
+  if (err == NULL) {
+    err = &unused;
+  }
+  *err = (flag_error){.status = FLAG_OK, .index = -1, .offset = SIZE_MAX};
+
+  const char* raw = f->pending;
+  if (raw == NULL) {
+    return FLAG_OK;
+  }
+
+  // Memoize before converting. The value is converted into a copy and stored only once it
+  // is valid, so on failure the flag keeps its default.
+  f->pending = NULL;
+  size_t size = flag_types[f->type].size;
+  union {
+    max_align_t align;
+    unsigned char bytes[FLAG_VALUE_COPY_SIZE];
+  } copy;
+  void* tmp = copy.bytes;
+  if (size > sizeof(copy.bytes)) {
+    tmp = flag_alloc(size, _Alignof(max_align_t));
+    f_assert(tmp != NULL, "[ERROR]: Unable to allocate memory for the value of %s\n", f->name);
+  }
+  memcpy(tmp, f->value, size);
+  flag_status status = store_value(f, tmp, raw, NULL, -1, err);
+  if (status == FLAG_OK) {
+    memcpy(f->value, tmp, size);
+  }
+  if (tmp != copy.bytes) {
+    flag_free(tmp);
+  }
+  return status;
+}
+
+// Value of f for the getters, converting a pending lazy value first. A lazy flag that
+// fails to convert is reported the way ParseFlags would have reported it: the error is
+// printed and the process exits.
+static void* flag_value(flag* f) {
+  if (f->pending != NULL) {
+    flag_error err;
+    if (ResolveFlag(f, &err) != FLAG_OK) {
+      char message[MAX_DESCRIPTION + 2 * MAX_NAME];
+      FlagErrorString(&err, message, sizeof(message));
+      fprintf(stderr, "Error: %s\n", message);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return f->value;
+}
+
+// Map the file at path privately, so that it can be tokenized in place without touching
+// the file. An empty file leaves *map NULL.
+static void file_id(const struct stat* st, flag_file_id* id) {
+  *id = (flag_file_id){
+    .dev = (uint64_t)st->st_dev,
+    .ino = (uint64_t)st->st_ino,
+    .size = (uint64_t)st->st_size,
+    .mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000u + (uint64_t)st->st_mtim.tv_nsec,
+    .ctime_ns = (uint64_t)st->st_ctim.tv_sec * 1000000000u + (uint64_t)st->st_ctim.tv_nsec,
+  };
+}
+
+// Map path privately and writable, so that it can be split in place, and store the
+// identity of the file in *id. An empty file gives a NULL map.
+static flag_status map_file(const char* path, char** map, size_t* len, flag_file_id* id,
+                            flag_error* err) {
+  *map = NULL;
+  *len = 0;
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    int error = errno;
+    if (fd >= 0) {
+      close(fd);
+    }
+    parse_error(err, FLAG_ERR_IO, NULL, -1, NULL, strerror(error), SIZE_MAX);
+    err->file = path;
+    return FLAG_ERR_IO;
+  }
+
+  file_id(&st, id);
+  size_t size = (size_t)st.st_size;
+  void* addr = NULL;
+  if (size > 0) {
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  int error = errno;
+  close(fd);
+  if (addr == MAP_FAILED) {
+    parse_error(err, FLAG_ERR_IO, NULL, -1, NULL, strerror(error), SIZE_MAX);
+    err->file = path;
+    return FLAG_ERR_IO;
+  }
+  if (size > 0) {
+    madvise(addr, size, MADV_SEQUENTIAL);
+  }
+
+  *map = addr;
+  *len = size;
+  return FLAG_OK;
+}
+
+// Unmap every file in *list and empty the list.
+static void unmap_files(flag_mapping** list) {
+  for (flag_mapping* m = *list; m != NULL; m = m->next) {
+    if (m->addr != NULL) {
+      munmap(m->addr, m->len);
+    }
+    flag_free(m->tail);
+  }
+  *list = NULL;
+}
+
+// Cut the next token out of r, removing quotes and backslashes in place, and store the
+// line it starts on in *line. *token is NULL at the end of the file. Returns a reason if
+// the token is malformed.
+static const char* response_token(flag_response* r, flag_arena* values, char** token,
+                                  int* line) {
+  char* p = r->p;
+  while (p < r->end && isspace((unsigned char)*p)) {
+    r->line += *p++ == '\n';
+  }
+  *token = NULL;
+  *line = r->line;
+  if (p == r->end) {
+    r->p = p;
+    return NULL;
+  }
+
+  // Unquoted text is written back over the token, which never outruns the read position.
+  char* start = p;
+  char* w = p;
+  char quote = '\0';
+  for (; p < r->end; p++) {
+    char c = *p;
+    if (quote == '\0' && isspace((unsigned char)c)) {
+      break;
+    }
+    if (quote == '\0' && (c == '"' || c == '\'')) {
+      quote = c;
+      continue;
+    }
+    if (c == quote) {
+      quote = '\0';
+      continue;
+    }
+    if (c == '\\' && quote != '\'' && p + 1 < r->end) {
+      c = *++p;
+    }
+    r->line += c == '\n';
+    *w++ = c;
+  }
+  if (quote != '\0') {
+    r->p = p;
+    return "unterminated quote";
+  }
+
+  // The separator is counted before the terminating NUL may overwrite it. A token that
+  // runs to the end of the mapping has no room for its NUL and is copied.
+  if (p < r->end) {
+    r->line += *p++ == '\n';
+  }
+  r->p = p;
+  if (w < r->end) {
+    *w = '\0';
+    *token = start;
+  } else {
+    *token = arena_strndup(values, start, (size_t)(w - start));
+  }
+  return NULL;
+}
+
+// Map the response file at path, named by the argument at argv position index, and make
+// it the innermost open file.
+static flag_status tokens_open(flag_tokens* t, const char* path, int index, flag_error* err) {
+  if (t->depth == FLAG_RESPONSE_DEPTH) {
+    parse_error(err, FLAG_ERR_IO, NULL, index, NULL, "response files nested too deeply",
+                SIZE_MAX);
+    err->file = path;
+    return FLAG_ERR_IO;
+  }
+
+  char* map;
+  size_t len;
+  flag_file_id id;
+  if (map_file(path, &map, &len, &id, err) != FLAG_OK) {
+    err->index = index;
+    return FLAG_ERR_IO;
+  }
+
+  // Empty files are listed too, as inputs of the parse cache.
+  flag_mapping* mapping = (flag_mapping*)arena_alloc(t->values, sizeof(flag_mapping));
+  *mapping = (flag_mapping){.next = *t->mappings, .addr = map, .len = len, .path = path, .id = id};
+  *t->mappings = mapping;
+  if (map == NULL) {
+    return FLAG_OK;
+  }
+  t->files[t->depth++] = (flag_response){.p = map, .end = map + len, .path = path, .line = 1};
+  return FLAG_OK;
+}
+
+// Read the next token without consuming it, expanding @file arguments on the way.
+// *token is NULL at the end of the command line.
+static flag_status tokens_peek(flag_tokens* t, char** token, flag_error* err) {
+  while (t->peeked == NULL) {
+    char* next;
+    flag_origin at;
+    if (t->depth > 0) {
+      flag_response* r = &t->files[t->depth - 1];
+      at = (flag_origin){.index = t->file_index, .file = r->path};
+      const char* reason = response_token(r, t->values, &next, &at.line);
+      if (reason != NULL) {
+        parse_error(err, FLAG_ERR_IO, NULL, at.index, NULL, reason, SIZE_MAX);
+        err->file = at.file;
+        err->line = at.line;
+        return FLAG_ERR_IO;
+      }
+      if (next == NULL) {
+        t->depth--;
+        continue;
+      }
+    } else if (t->next < t->argc) {
+      at = (flag_origin){.index = t->next};
+      next = t->argv[t->next++];
+    } else {
+      break;
+    }
+
+    if (next[0] == '@' && next[1] != '\0') {
+      if (t->depth == 0) {
+        t->file_index = at.index;
+      }
+      flag_status status = tokens_open(t, next + 1, at.index, err);
+      if (status != FLAG_OK) {
+        return status;
+      }
+      continue;
+    }
+    t->peeked = next;
+    t->peeked_at = at;
+  }
+
+  *token = t->peeked;
+  return FLAG_OK;
+}
+
+// Consume the token returned by the last tokens_peek.
+static void tokens_next(flag_tokens* t) {
+  t->at = t->peeked_at;
+  t->peeked = NULL;
+}
+
+// Consume the value following the flag token just read from t and store it into value,
+// the storage for f. Types with an implied value, like bool, only consume the next token
+// if it parses; otherwise the implied value is used, so "-verbose print" leaves "print" to
+// be read as a subcommand. With defer set, lazy flags only record the token for
+// flag_value to convert.
+static flag_status apply_flag(flag* f, void* value, flag_arena* values, flag_tokens* t,
+                              bool defer, flag_error* err) {
+  const flag_type_ops* ops = &flag_types[f->type];
+  char* arg;
+  flag_status status = tokens_peek(t, &arg, err);
+  if (status != FLAG_OK) {
+    return status;
+  }
+
+  if (defer && f->lazy) {
+    if (arg == NULL) {
+      return parse_error(err, FLAG_ERR_MISSING_VALUE, f, t->at.index, NULL,
+                         "no value specified", SIZE_MAX);
+    }
+    tokens_next(t);
+    f->pending = arg;
+    return FLAG_OK;
+  }
+
+  size_t err_pos;
+  if (arg != NULL && ops->implied_value != NULL &&
+      ops->parse(arg, value, ops->data, &err_pos) != NULL) {
+    arg = NULL;
+  }
+  if (arg != NULL) {
+    tokens_next(t);
+  }
+  return convert_value(f, value, arg, values, t->at.index, err);
+}
+
+// Alignment for a value of size bytes in a flag_result or a defaults snapshot: the largest
+// power of two that divides size, at most that of max_align_t.
+static size_t value_alignment(size_t size) {
+  size_t align = 1;
+  while (align < _Alignof(max_align_t) && size % (align * 2) == 0) {
+    align *= 2;
+  }
+  return align;
+}
+
+// Put every flag of set back to its default value, so that values left by a previous
+// parse do not leak into the next one. The defaults are the values the variables held at
+// the first parse after they were registered; they are saved in one block, each at an
+// offset aligned for its type.
+static void set_restore_defaults(flag_set* set) {
+  // Raw values of lazy flags belong to the previous parse too.
+  for (size_t i = 0; i < set->count; i++) {
+    if (set->list[i]->lazy) {
+      set->list[i]->pending = NULL;
+    }
+  }
+
+  for (size_t i = 0; i < set->num_defaults; i++) {
+    const flag* f = set->list[i];
+    if (f->value != NULL) {
+      memcpy(f->value, set->defaults + set->default_offsets[i], flag_types[f->type].size);
+    }
+  }
+
+  if (set->num_defaults == set->count) {
+    return;
+  }
+
+  // Save the defaults of flags registered since the last parse after the saved ones, whose
+  // offsets stay the same.
+  uint32_t* offsets = (uint32_t*)arena_alloc(set->arena, set->count * sizeof(uint32_t));
+  if (set->num_defaults > 0) {
+    memcpy(offsets, set->default_offsets, set->num_defaults * sizeof(uint32_t));
+  }
+  size_t size = set->defaults_size;
+  for (size_t i = set->num_defaults; i < set->count; i++) {
+    size_t value_size = set->list[i]->value ? flag_types[set->list[i]->type].size : 0;
+    size_t align = value_alignment(value_size);
+    size = (size + align - 1) & ~(align - 1);
+    f_assert(size <= UINT32_MAX, "[ERROR]: Flag defaults do not fit a snapshot\n");
+    offsets[i] = (uint32_t)size;
+    size += value_size;
+  }
+
+  unsigned char* defaults = (unsigned char*)arena_alloc(set->arena, size > 0 ? size : 1);
+  if (set->defaults_size > 0) {
+    memcpy(defaults, set->defaults, set->defaults_size);
+  }
+  for (size_t i = set->num_defaults; i < set->count; i++) {
+    const flag* f = set->list[i];
+    if (f->value != NULL) {
+      memcpy(defaults + offsets[i], f->value, flag_types[f->type].size);
+    }
+  }
+
+  set->defaults = defaults;
+  set->default_offsets = offsets;
+  set->defaults_size = size;
+  set->num_defaults = set->count;
+}
+
+// Append the token t just consumed to p. No string is copied: a run of positionals in argv
+// stays a slice of argv, and only the first one out of line moves the run into an array
+// from values, which doubles as it fills.
+static void positionals_add(flag_positionals* p, const flag_tokens* t, char* token,
+                            flag_arena* values) {
+  if (p->capacity == 0 && t->at.file == NULL) {
+    if (p->count == 0) {
+      p->items = &t->argv[t->at.index];
+    }
+    if (p->items + p->count == &t->argv[t->at.index]) {
+      p->count++;
+      return;
+    }
+  }
+
+  // A slice of argv has capacity 0, so leaving it always allocates.
+  if (p->count >= p->capacity) {
+    size_t capacity = p->capacity > 0 ? p->capacity * 2 : FLAG_LIST_MIN_CAPACITY;
+    while (capacity <= p->count) {
+      capacity *= 2;
+    }
+    char** items = (char**)arena_alloc(values, capacity * sizeof(char*));
+    if (p->count > 0) {
+      memcpy(items, p->items, p->count * sizeof(char*));
+    }
+    p->items = items;
+    p->capacity = capacity;
+  }
+  p->items[p->count++] = token;
+}
+
+// Validate every flag of set given in seen, in one pass over the set once all of argv is
+// read, so a flag given many times is validated once. Values are read like parse_tokens
+// writes them. Lazy flags are validated when they are resolved.
+static flag_status set_validate(const flag_set* set, const uint64_t* seen, const void* out,
+                                flag_error* err) {
+  for (size_t w = 0; w < FLAG_WORDS(set->count); w++) {
+    for (uint64_t given = seen[w]; given != 0; given &= given - 1) {
+      size_t pos = w * FLAG_WORD_BITS + bit_first(given);
+      const flag* f = set->list[pos];
+      if ((f->checks == NULL && f->flag_validator.validator == NULL) || (out == NULL && f->lazy)) {
+        continue;
+      }
+
+      const void* value = out ? (const unsigned char*)out + set->offsets[pos] : f->value;
+      flag_status status = validate_value(f, value, err);
+      if (status != FLAG_OK) {
+        return status;
+      }
+    }
+  }
+  return FLAG_OK;
+}
+
+// Check the required flags and the groups of set against the flags in seen. Each check
+// of a group is a few word-wide operations per 64 flags.
+static flag_status set_check(const flag_set* set, const uint64_t* seen, flag_error* err) {
+  for (size_t w = 0; w < FLAG_WORDS(set->count); w++) {
+    uint64_t missing = set->required[w] & ~(seen[w] | set->configured[w]);
+    if (missing != 0) {
+      const flag* f = set->list[w * FLAG_WORD_BITS + bit_first(missing)];
+      return parse_error(err, FLAG_ERR_REQUIRED, f, -1, NULL, NULL, SIZE_MAX);
+    }
+  }
+
+  for (const flag_group* g = set->groups; g != NULL; g = g->next) {
+    // Conflicts count flags on the command line only, so that it can override a config
+    // file. Everything else is satisfied by a configured value too.
+    bool any = false;
+    size_t firsts[2];
+    size_t found = 0;
+    for (size_t w = 0; w < g->words && found < 2; w++) {
+      uint64_t given = g->mask[w] & seen[w];
+      if (g->kind != FLAG_GROUP_EXCLUSIVE) {
+        given |= g->mask[w] & set->configured[w];
+      }
+      uint64_t missing = g->mask[w] & ~given;
+      any |= given != 0;
+
+      if (g->kind == FLAG_GROUP_EXCLUSIVE) {
+        for (; given != 0 && found < 2; given &= given - 1) {
+          firsts[found++] = w * FLAG_WORD_BITS + bit_first(given);
+        }
+      } else if (g->kind == FLAG_GROUP_REQUIRES && missing != 0 &&
+                 (bit_test(seen, g->first) || bit_test(set->configured, g->first))) {
+        firsts[found++] = w * FLAG_WORD_BITS + bit_first(missing);
+        break;
+      }
+    }
+
+    flag_status status = FLAG_OK;
+    if (g->kind == FLAG_GROUP_EXCLUSIVE && found == 2) {
+      status = parse_error(err, FLAG_ERR_CONFLICT, set->list[firsts[0]], -1, NULL, NULL,
+                           SIZE_MAX);
+      err->other = set->list[firsts[1]]->name;
+    } else if (g->kind == FLAG_GROUP_ONE_OF && !any) {
+      status = parse_error(err, FLAG_ERR_REQUIRED, set->list[g->first], -1, NULL, g->reason,
+                           SIZE_MAX);
+    } else if (g->kind == FLAG_GROUP_REQUIRES && found == 1) {
+      status = parse_error(err, FLAG_ERR_REQUIRED, set->list[firsts[0]], -1, NULL, NULL,
+                           SIZE_MAX);
+      err->other = set->list[g->first]->name;
+    }
+    if (status != FLAG_OK) {
+      return status;
+    }
+  }
+  return FLAG_OK;
+}
+
+// Parse the tokens of t against ctx without modifying it. Values are written through the
+// flag value pointers when out is NULL, and into out at the frozen offsets otherwise.
+static flag_status parse_tokens(const flag_ctx* ctx, flag_tokens* t, void* out,
+                                flag_arena* values, subcommand** selected,
+                                flag_positionals* positionals, flag_error* err) {
+  // Every token is classified once, in a single pass: "--" ends the flags, a word naming a
+  // subcommand of the innermost one so far descends into it, -name and --name are flags of
+  // that subcommand, of a level above it or global, in that order, and anything else is
+  // positional, as is "-" on its own. Inside a subcommand its flags may also be given
+  // without a dash.
+  subcommand* subcmd = NULL;
+  flag_status status;
+  char* token;
+  bool terminated = false;
+  STATS_CLOCK(phase);
+
+  // One bit per flag given, for the global flags and each level of subcommands.
+  uint64_t global_seen[FLAG_WORDS(ctx->flags.count) + 1];
+  uint64_t seen[FLAG_MAX_SUBCMD_DEPTH][ctx->subcmd_words + 1];
+  memset(global_seen, 0, sizeof(global_seen));
+
+  while ((status = tokens_peek(t, &token, err)) == FLAG_OK && token != NULL) {
+    tokens_next(t);
+    if (terminated || (token[0] == '-' && token[1] == '\0')) {
+      positionals_add(positionals, t, token, values);
+      continue;
+    }
+
+    bool dashed = token[0] == '-';
+    const char* name = token;
+    if (dashed) {
+      name = token[1] == '-' ? &token[2] : &token[1];
+      if (name[0] == '\0' && token[1] == '-') {
+        terminated = true;
+        continue;
+      }
+
+      // handle help request.
+      if (strcmp(name, "help") == 0) {
+        return parse_error(err, FLAG_HELP, NULL, t->at.index, NULL, NULL, SIZE_MAX);
+      }
+    } else {
+      const flag_subcmds* level = subcmd ? &subcmd->children : &ctx->children;
+      subcommand* child = find_subcommand(level, token, ctx->subcmd_prefixes);
+      if (child != NULL) {
+        if (subcmd == NULL) {
+          STATS_LAP(global_ns, phase);
+        }
+        subcmd = child;
+        memset(seen[child->depth], 0, sizeof(seen[child->depth]));
+        continue;
+      }
+      if (subcmd == NULL) {
+        positionals_add(positionals, t, token, values);
+        continue;
+      }
+    }
+
+    // find flag matching next flag.
+    const flag_set* set = NULL;
+    uint64_t* bits = global_seen;
+    long pos = -1;
+    for (const subcommand* level = subcmd; level != NULL && pos < 0; level = level->parent) {
+      set = &level->flags;
+      bits = seen[level->depth];
+      pos = index_lookup(set, name);
+    }
+    if (pos < 0 && dashed) {
+      set = &ctx->flags;
+      bits = global_seen;
+      pos = index_lookup(set, name);
+    }
+    if (pos < 0) {
+      // Unknown flags are skipped.
+      if (!dashed) {
+        positionals_add(positionals, t, token, values);
+      }
+      continue;
+    }
+
+    flag* f = set->list[pos];
+    void* value = out ? (unsigned char*)out + set->offsets[pos] : f->value;
+    bit_set(bits, (size_t)pos);
+    if ((status = apply_flag(f, value, values, t, out == NULL, err)) != FLAG_OK) {
+      break;
+    }
+  }
+
+  // Parses into the flag variables tell reloads which flags the command line set.
+  if (out == NULL) {
+    memcpy(ctx->flags.given, global_seen, FLAG_WORDS(ctx->flags.count) * sizeof(uint64_t));
+    for (const subcommand* level = subcmd; level != NULL; level = level->parent) {
+      memcpy(level->flags.given, seen[level->depth],
+             FLAG_WORDS(level->flags.count) * sizeof(uint64_t));
+    }
+  }
+  if (subcmd != NULL) {
+    STATS_LAP(subcmd_ns, phase);
+  } else {
+    STATS_LAP(global_ns, phase);
+  }
+  if (status != FLAG_OK) {
+    return status;
+  }
+
+  // Post processing validation: the values, then the required flags and groups, of the
+  // global flags and then every level of subcommands.
+  status = set_validate(&ctx->flags, global_seen, out, err);
+  for (const subcommand* level = subcmd; level != NULL && status == FLAG_OK;
+       level = level->parent) {
+    status = set_validate(&level->flags, seen[level->depth], out, err);
+  }
+  if (status == FLAG_OK) {
+    status = set_check(&ctx->flags, global_seen, err);
+  }
+  for (const subcommand* level = subcmd; level != NULL && status == FLAG_OK;
+       level = level->parent) {
+    status = set_check(&level->flags, seen[level->depth], err);
+  }
+  STATS_LAP(validate_ns, phase);
+  if (status != FLAG_OK) {
+    return status;
+  }
+
+  if (selected != NULL) {
+    *selected = subcmd;
+  }
+  return FLAG_OK;
+}
+
+// Parse argv against ctx without modifying it, see parse_tokens. .copy strings and
+// tokens of response files that need a copy are allocated from values, and the response
+// files are added to *mappings.
+static flag_status parse_args(const flag_ctx* ctx, int argc, char* argv[], void* out,
+                              flag_arena* values, flag_mapping** mappings,
+                              subcommand** selected, flag_positionals* positionals,
+                              flag_error* err) {
+  flag_tokens t = {
+    .argc = argc,
+    .argv = argv,
+    .next = 1,
+    .values = values,
+    .mappings = mappings,
+    .at = {.index = -1},
+  };
+  *positionals = (flag_positionals){0};
+  flag_status status = parse_tokens(ctx, &t, out, values, selected, positionals, err);
+
+  // Errors about a token from a response file say where in the file it was.
+  if (status != FLAG_OK && err->file == NULL && err->index >= 0) {
+    err->file = t.at.file;
+    err->line = t.at.line;
+  }
+  return status;
+}
+
+// Forget the flags the previous parse took from the command line.
+static void set_clear_given(flag_set* set) {
+  memset(set->given, 0, FLAG_WORDS(set->count) * sizeof(uint64_t));
+}
+
+flag_status ParseFlagsEx(flag_ctx* ctx, int argc, char* argv[], subcommand** selected,
+                         flag_error* err) {
+  flag_error unused;
+  if (err == NULL) {
+    err = &unused;
+  }
+  *err = (flag_error){.status = FLAG_OK, .index = -1, .offset = SIZE_MAX};
+  if (selected != NULL) {
+    *selected = NULL;
+  }
+
+  STATS_ENTER(&ctx->stats);
+  STATS_ADD(parses, 1);
+  if (cache_settle(ctx, err) != FLAG_OK) {
+    STATS_LEAVE();
+    return err->status;
+  }
+
+  // Start every parse from the registered defaults. After that, nothing points at copies
+  // made by the previous parse any more. parse_args expects current indexes.
+  set_restore_defaults(&ctx->flags);
+  set_index(&ctx->flags);
+  set_clear_given(&ctx->flags);
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    set_restore_defaults(&ctx->subcommands[i]->flags);
+    set_index(&ctx->subcommands[i]->flags);
+    set_clear_given(&ctx->subcommands[i]->flags);
+  }
+  index_subcommands(ctx);
+  unmap_files(&ctx->responses);
+  arena_reset(&ctx->values);
+
+  // With a parse cache, the deferred loads only run when the cache misses.
+  uint64_t key = 0;
+  if (ctx->cache_pending) {
+    ctx->cache_pending = false;
+    key = cache_key(ctx, argc, argv);
+    if (key != 0 && cache_load(ctx, key, selected)) {
+      ctx->sources_pending = ctx->sources != NULL;
+      STATS_LEAVE();
+      return FLAG_OK;
+    }
+
+    flag_status status = cache_apply_sources(ctx, err);
+    if (status != FLAG_OK) {
+      STATS_LEAVE();
+      return status;
+    }
+    set_restore_defaults(&ctx->flags);
+    for (size_t i = 0; i < ctx->num_subcommands; i++) {
+      set_restore_defaults(&ctx->subcommands[i]->flags);
+    }
+  }
+
+  subcommand* subcmd = NULL;
+  flag_status status = parse_args(ctx, argc, argv, NULL, &ctx->values, &ctx->responses,
+                                  &subcmd, &ctx->positionals, err);
+  if (status == FLAG_OK && key != 0) {
+    cache_save(ctx, key, subcmd);
+  }
+  if (selected != NULL) {
+    *selected = subcmd;
+  }
+  STATS_LEAVE();
+  return status;
+}
+
+#ifdef FLAG_STATS
+const flag_stats* FlagStats(const flag_ctx* ctx) {
+  return &ctx->stats;
+}
+
+void ResetFlagStats(flag_ctx* ctx) {
+  ctx->stats = (flag_stats){0};
+}
+#endif
+
+// Assign every flag of set an offset in the result layout that ends at *size, and copy
+// its current value into defaults at that offset when defaults is not NULL.
+static void set_layout(flag_set* set, size_t* size, unsigned char* defaults) {
+  if (defaults == NULL) {
+    set->offsets = (uint32_t*)arena_alloc(set->arena, (set->count + 1) * sizeof(uint32_t));
+  }
+
+  for (size_t i = 0; i < set->count; i++) {
+    const flag* f = set->list[i];
+    size_t value_size = f->value ? flag_types[f->type].size : 0;
+    size_t align = value_alignment(value_size);
+    *size = (*size + align - 1) & ~(align - 1);
+    if (defaults == NULL) {
+      f_assert(*size <= UINT32_MAX, "[ERROR]: Flag values do not fit a flag_result\n");
+      set->offsets[i] = (uint32_t)*size;
+    } else if (value_size > 0) {
+      memcpy(defaults + set->offsets[i], f->value, value_size);
+    }
+    *size += value_size;
+  }
+}
+
+void FreezeFlagContext(flag_ctx* ctx) {
+  if (ctx->frozen) {
+    return;
+  }
+  f_assert(!ctx->cache_pending, "[ERROR]: Frozen contexts do not use a parse cache\n");
+  flag_error err;
+  cache_settle(ctx, &err);
+
+  // Lay out the values of all sets back to back, then capture their defaults. Values left by
+  // an earlier ParseFlags are undone first; lists built by it point into ctx->values.
+  size_t size = 0;
+  set_restore_defaults(&ctx->flags);
+  set_index(&ctx->flags);
+  set_layout(&ctx->flags, &size, NULL);
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    set_restore_defaults(&ctx->subcommands[i]->flags);
+    set_index(&ctx->subcommands[i]->flags);
+    set_layout(&ctx->subcommands[i]->flags, &size, NULL);
+  }
+  index_subcommands(ctx);
+
+  ctx->result_size = size;
+  ctx->result_defaults = (unsigned char*)arena_alloc(&ctx->arena, size > 0 ? size : 1);
+  memset(ctx->result_defaults, 0, size);
+
+  size = 0;
+  set_layout(&ctx->flags, &size, ctx->result_defaults);
+  ctx->flags.frozen = true;
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    set_layout(&ctx->subcommands[i]->flags, &size, ctx->result_defaults);
+    ctx->subcommands[i]->flags.frozen = true;
+  }
+  ctx->frozen = true;
+}
+
+flag_result* CreateFlagResult(const flag_ctx* ctx) {
+  f_assert(ctx->frozen, "[ERROR]: Freeze the flag context before creating results\n");
+
+  size_t size = sizeof(flag_result) + ctx->result_size;
+  size = (size + FLAG_CACHE_LINE - 1) & ~(size_t)(FLAG_CACHE_LINE - 1);
+  flag_result* result = (flag_result*)flag_alloc(size, FLAG_CACHE_LINE);
+  f_assert(result != NULL, "[ERROR]: Unable to allocate memory for flag_result");
+
+  result->ctx = ctx;
+  result->subcmd = NULL;
+  result->values = (flag_arena){0};
+  result->responses = NULL;
+  result->positionals = (flag_positionals){0};
+  memcpy(result->data, ctx->result_defaults, ctx->result_size);
+  return result;
+}
+
+void DestroyFlagResult(flag_result* result) {
+  if (result) {
+    unmap_files(&result->responses);
+    arena_free(&result->values);
+    flag_free(result);
+  }
+}
+
+flag_status ParseFlagsInto(const flag_ctx* ctx, int argc, char* argv[], flag_result* result,
+                           flag_error* err) {
+  f_assert(result->ctx == ctx, "[ERROR]: flag_result belongs to another context\n");
+
+  flag_error unused;
+  if (err == NULL) {
+    err = &unused;
+  }
+  *err = (flag_error){.status = FLAG_OK, .index = -1, .offset = SIZE_MAX};
+
+  memcpy(result->data, ctx->result_defaults, ctx->result_size);
+  unmap_files(&result->responses);
+  arena_reset(&result->values);
+  result->subcmd = NULL;
+  return parse_args(ctx, argc, argv, result->data, &result->values, &result->responses,
+                    &result->subcmd, &result->positionals, err);
+}
+
+subcommand* FlagResultSubCmd(const flag_result* result) {
+  return result->subcmd;
+}
+
+// Shared state of a ParseFlagsBatch call. Workers claim FLAG_BATCH_CHUNK items at a time
+// from next, so threads that get cheap items simply claim more chunks.
+typedef struct flag_batch {
+  const flag_ctx* ctx;
+  flag_batch_item* items;
+  size_t count;
+#ifndef FLAG_NO_THREADS
+  atomic_size_t next;
+  atomic_size_t failed;
+#else
+  size_t next;
+  size_t failed;
+#endif
+} flag_batch;
+
+static void* batch_worker(void* arg) {
+  flag_batch* batch = (flag_batch*)arg;
+  flag_result* scratch = NULL;
+  size_t failed = 0;
+
+  for (;;) {
+#ifndef FLAG_NO_THREADS
+    size_t start = atomic_fetch_add_explicit(&batch->next, FLAG_BATCH_CHUNK, memory_order_relaxed);
+#else
+    size_t start = batch->next;
+    batch->next += FLAG_BATCH_CHUNK;
+#endif
+    if (start >= batch->count) {
+      break;
+    }
+
+    size_t end = start + FLAG_BATCH_CHUNK < batch->count ? start + FLAG_BATCH_CHUNK : batch->count;
+    for (size_t i = start; i < end; i++) {
+      flag_batch_item* item = &batch->items[i];
+      flag_result* result = item->result;
+      if (result == NULL) {
+        // Validation only: parse into a result private to this worker.
+        if (scratch == NULL) {
+          scratch = CreateFlagResult(batch->ctx);
+        }
+        result = scratch;
+      }
+      item->status = ParseFlagsInto(batch->ctx, item->argc, item->argv, result, &item->error);
+      failed += item->status != FLAG_OK;
+    }
+  }
+
+  DestroyFlagResult(scratch);
+#ifndef FLAG_NO_THREADS
+  atomic_fetch_add_explicit(&batch->failed, failed, memory_order_relaxed);
+#else
+  batch->failed += failed;
+#endif
+  return NULL;
+}
+
+size_t ParseFlagsBatch(const flag_ctx* ctx, flag_batch_item* items, size_t count,
+                       unsigned num_threads) {
+  f_assert(ctx->frozen, "[ERROR]: Freeze the flag context before parsing a batch\n");
+
+  flag_batch batch = {.ctx = ctx, .items = items, .count = count};
+#ifndef FLAG_NO_THREADS
+  if (num_threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = cpus > 0 ? (unsigned)cpus : 1;
+  }
+
+  // No point in starting threads that would find no chunk left to claim.
+  size_t chunks = (count + FLAG_BATCH_CHUNK - 1) / FLAG_BATCH_CHUNK;
+  if (num_threads > chunks) {
+    num_threads = chunks > 0 ? (unsigned)chunks : 1;
+  }
+
+  // The calling thread is one of the workers.
+  pthread_t threads[num_threads > 1 ? num_threads - 1 : 1];
+  unsigned started = 0;
+  for (; started + 1 < num_threads; started++) {
+    if (pthread_create(&threads[started], NULL, batch_worker, &batch) != 0) {
+      break;  // Run with the threads we have.
+    }
+  }
+  batch_worker(&batch);
+  for (unsigned i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return atomic_load(&batch.failed);
+#else
+  (void)num_threads;
+  batch_worker(&batch);
+  return batch.failed;
+#endif
+}
+
+char** FlagResultPositionals(const flag_result* result, size_t* count) {
+  *count = result->positionals.count;
+  return result->positionals.items;
+}
+
+void* FlagResultValue(const flag_result* result, const subcommand* subcmd, const char* name) {
+  const flag_set* set = subcmd ? &subcmd->flags : &result->ctx->flags;
+  long pos = index_lookup(set, name);
+  if (pos < 0 || set->list[pos]->value == NULL) {
+    return NULL;
+  }
+  return (unsigned char*)result->data + set->offsets[pos];
+}
+
+static bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Value staged by a reload, published once the whole file has been read.
+typedef struct flag_reload_value {
+  flag_set* set;   // Set holding the flag.
+  size_t pos;      // Position of the flag in set.
+  uint64_t value;  // New value, in the first flag_types[type].size bytes.
+  bool given;      // The command line set the flag: only its saved default changes.
+} flag_reload_value;
+
+// Values staged by ReloadFlagConfig for one file.
+typedef struct flag_reload {
+  flag_reload_value* values;
+  size_t count;
+  size_t capacity;
+} flag_reload;
+
+static flag_status reload_stage(flag_reload* reload, flag_set* set, size_t pos,
+                                const char* value, flag_error* err);
+
+// Apply one "key = value" line, already split and NUL-terminated, to the flag it names.
+// During a reload the value is only staged in *reload.
+static flag_status apply_config_line(flag_ctx* ctx, char* key, const char* value,
+                                     flag_reload* reload, flag_error* err) {
+  // Every dotted prefix of the key names a subcommand one level further down.
+  flag_set* set = &ctx->flags;
+  const flag_subcmds* level = &ctx->children;
+  char* name = key;
+  char* dot;
+  while (set != NULL && (dot = strchr(name, '.')) != NULL) {
+    *dot = '\0';
+    subcommand* subcmd = find_subcommand(level, name, false);
+    *dot = '.';
+    set = subcmd ? &subcmd->flags : NULL;
+    level = subcmd ? &subcmd->children : NULL;
+    name = dot + 1;
+  }
+
+  long pos = set ? set_lookup(set, name) : -1;
+  if (pos < 0 || set->list[pos]->value == NULL) {
+    return parse_error(err, FLAG_ERR_UNKNOWN_FLAG, NULL, -1, key, "unknown flag", SIZE_MAX);
+  }
+
+  if (reload != NULL) {
+    return reload_stage(reload, set, (size_t)pos, value, err);
+  }
+
+  // Copies must outlive every parse, so they come from the context arena.
+  flag* f = set->list[pos];
+  flag_status status = store_value(f, f->value, value, &ctx->arena, -1, err);
+  if (status != FLAG_OK) {
+    return status;
+  }
+  seal_list(f);
+
+  bit_set(set->configured, (size_t)pos);
+  return FLAG_OK;
+}
+
+// Split the lines of buf[0, len) in place and apply them. Every line must be followed by a
+// writable byte, which is overwritten with the terminating NUL.
+static flag_status apply_config(flag_ctx* ctx, char* buf, size_t len, int* line,
+                                flag_reload* reload, flag_error* err) {
+  char* p = buf;
+  char* end = buf + len;
+  while (p < end) {
+    ++*line;
+    char* eol = memchr(p, '\n', (size_t)(end - p));
+    if (eol == NULL) {
+      eol = end;
+    }
+    char* next = eol + 1;
+
+    // Trim the line and skip blanks and comments.
+    char* e = eol;
+    while (p < e && is_blank(*p)) {
+      p++;
+    }
+    while (e > p && is_blank(e[-1])) {
+      e--;
+    }
+    if (p == e || *p == '#') {
+      p = next;
+      continue;
+    }
+
+    char* value = NULL;
+    char* key_end = e;
+    char* eq = memchr(p, '=', (size_t)(e - p));
+    if (eq != NULL) {
+      key_end = eq;
+      value = eq + 1;
+      while (value < e && is_blank(*value)) {
+        value++;
+      }
+      if (e - value >= 2 && (*value == '"' || *value == '\'') && e[-1] == *value) {
+        value++;
+        e--;
+      }
+      *e = '\0';
+    }
+    while (key_end > p && is_blank(key_end[-1])) {
+      key_end--;
+    }
+    *key_end = '\0';
+
+    flag_status status = apply_config_line(ctx, p, value, reload, err);
+    if (status != FLAG_OK) {
+      err->line = *line;
+      return status;
+    }
+    p = next;
+  }
+  return FLAG_OK;
+}
+
+// Start changing the flag defaults: put back the defaults, so that values set by earlier
+// parses do not end up in the new ones.
+static void begin_defaults_update(flag_ctx* ctx) {
+  set_restore_defaults(&ctx->flags);
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    set_restore_defaults(&ctx->subcommands[i]->flags);
+  }
+}
+
+// Finish changing the flag defaults: the current values are snapshotted again at the next
+// parse.
+static void end_defaults_update(flag_ctx* ctx) {
+  ctx->defaults_version++;
+  ctx->flags.num_defaults = ctx->flags.defaults_size = 0;
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    ctx->subcommands[i]->flags.num_defaults = ctx->subcommands[i]->flags.defaults_size = 0;
+  }
+}
+
+// Apply the config file mapped in m to ctx, or stage its values in *reload.
+static flag_status apply_mapping(flag_ctx* ctx, flag_mapping* m, flag_reload* reload,
+                                 flag_error* err) {
+  index_subcommands(ctx);
+
+  // Every line but the last ends in a newline that can hold its NUL. The last line, if
+  // unterminated, is copied so that its NUL is not written past the mapping.
+  char* map = m->addr;
+  char* last = map + m->len;
+  while (last > map && last[-1] != '\n') {
+    last--;
+  }
+
+  int line = 0;
+  flag_status status = apply_config(ctx, map, (size_t)(last - map), &line, reload, err);
+  if (status == FLAG_OK && last < map + m->len) {
+    m->tail_len = (size_t)(map + m->len - last);
+    m->tail = (char*)flag_alloc(m->tail_len + 1, 1);
+    f_assert(m->tail != NULL, "[ERROR]: Unable to allocate memory for a config line\n");
+    memcpy(m->tail, last, m->tail_len);
+    m->tail[m->tail_len] = '\0';
+    status = apply_config(ctx, m->tail, m->tail_len, &line, reload, err);
+  }
+  return status;
+}
+
+// Apply the config file at path to ctx, see LoadFlagConfig.
+static flag_status load_config(flag_ctx* ctx, const char* path, flag_error* err) {
+  char* map;
+  size_t len;
+  flag_file_id id;
+  if (map_file(path, &map, &len, &id, err) != FLAG_OK) {
+    return err->status;
+  }
+
+  // Config files are kept in load order, which reloads follow.
+  flag_mapping* mapping = (flag_mapping*)arena_alloc(&ctx->arena, sizeof(flag_mapping));
+  *mapping = (flag_mapping){
+    .addr = map,
+    .len = len,
+    .path = arena_strndup(&ctx->arena, path, strlen(path)),
+    .id = id,
+  };
+  flag_mapping** tail = &ctx->mappings;
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
+  }
+  *tail = mapping;
+  if (map == NULL) {
+    return FLAG_OK;
+  }
+
+  begin_defaults_update(ctx);
+  flag_status status = apply_mapping(ctx, mapping, NULL, err);
+  if (status != FLAG_OK) {
+    err->file = path;
+  }
+  end_defaults_update(ctx);
+  return status;
+}
+
+flag_status LoadFlagConfig(flag_ctx* ctx, const char* path, flag_error* err) {
+  f_assert(!ctx->frozen, "[ERROR]: Load config files before freezing the context\n");
+
+  flag_error unused;
+  if (err == NULL) {
+    err = &unused;
+  }
+  *err = (flag_error){.status = FLAG_OK, .index = -1, .offset = SIZE_MAX};
+
+  // With a parse cache, the file is only read if the first parse misses the cache.
+  if (ctx->cache_pending) {
+    cache_defer(ctx, path);
+    return FLAG_OK;
+  }
+  if (cache_settle(ctx, err) != FLAG_OK) {
+    return err->status;
+  }
+  return load_config(ctx, path, err);
+}
+
+// Saved default of the flag at pos of set, or NULL if its default has not been saved yet.
+static unsigned char* set_saved_default(const flag_set* set, size_t pos) {
+  return pos < set->num_defaults ? set->defaults + set->default_offsets[pos] : NULL;
+}
+
+// Convert and validate value for the flag at pos of set, and stage it unless the flag is
+// not reloadable. A flag the last parse took from the command line keeps its value, and
+// only the default it goes back to at the next parse is staged.
+static flag_status reload_stage(flag_reload* reload, flag_set* set, size_t pos,
+                                const char* value, flag_error* err) {
+  flag* f = set->list[pos];
+  if (!f->reload) {
+    return FLAG_OK;
+  }
+
+  uint64_t staged = 0;
+  flag_status status = store_value(f, &staged, value, NULL, -1, err);
+  if (status != FLAG_OK) {
+    return status;
+  }
+
+  if (reload->count == reload->capacity) {
+    size_t capacity = reload->capacity ? reload->capacity * 2 : 16;
+    flag_reload_value* values = (flag_reload_value*)flag_alloc(
+        capacity * sizeof(flag_reload_value), _Alignof(flag_reload_value));
+    f_assert(values != NULL, "[ERROR]: Unable to allocate memory for reloaded values\n");
+    if (reload->count > 0) {
+      memcpy(values, reload->values, reload->count * sizeof(flag_reload_value));
+    }
+    flag_free(reload->values);
+    reload->values = values;
+    reload->capacity = capacity;
+  }
+  reload->values[reload->count++] = (flag_reload_value){
+    .set = set, .pos = pos, .value = staged, .given = bit_test(set->given, pos)};
+  return FLAG_OK;
+}
+
+// Copy of s owned by ctx. Equal strings share one copy, so the storage grows with the
+// distinct values a program is reloaded with, not with the number of reloads.
+static char* reload_intern(flag_ctx* ctx, const char* s) {
+  if (s == NULL) {
+    return NULL;
+  }
+  if (2 * (ctx->reload_strings_count + 1) > ctx->reload_strings_mask + 1) {
+    size_t capacity = ctx->reload_strings ? 2 * (ctx->reload_strings_mask + 1) : 16;
+    char** slots = (char**)flag_alloc(capacity * sizeof(char*), _Alignof(char*));
+    f_assert(slots != NULL, "[ERROR]: Unable to allocate memory for reloaded strings\n");
+    memset(slots, 0, capacity * sizeof(char*));
+    for (size_t i = 0; ctx->reload_strings != NULL && i <= ctx->reload_strings_mask; i++) {
+      char* old = ctx->reload_strings[i];
+      if (old != NULL) {
+        size_t len;
+        size_t slot = flag_hash(old, &len) & (capacity - 1);
+        while (slots[slot] != NULL) {
+          slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = old;
+      }
+    }
+    flag_free(ctx->reload_strings);
+    ctx->reload_strings = slots;
+    ctx->reload_strings_mask = capacity - 1;
+  }
+
+  size_t len;
+  size_t slot = flag_hash(s, &len) & ctx->reload_strings_mask;
+  for (; ctx->reload_strings[slot] != NULL; slot = (slot + 1) & ctx->reload_strings_mask) {
+    if (strcmp(ctx->reload_strings[slot], s) == 0) {
+      return ctx->reload_strings[slot];
+    }
+  }
+  ctx->reload_strings[slot] = arena_strndup(&ctx->arena, s, len);
+  ctx->reload_strings_count++;
+  return ctx->reload_strings[slot];
+}
+
+// Publish the values staged in reload that differ from the current ones, in file order so
+// that the last line for a flag wins. Flags given on the command line only get a new saved
+// default. Returns how many values or defaults changed.
+static size_t reload_publish(flag_ctx* ctx, const flag_reload* reload) {
+  size_t changed = 0;
+  for (size_t i = 0; i < reload->count; i++) {
+    const flag_reload_value* v = &reload->values[i];
+    flag* f = v->set->list[v->pos];
+    size_t size = flag_types[f->type].size;
+    unsigned char* saved = set_saved_default(v->set, v->pos);
+    const void* current = v->given ? saved : f->value;
+    if (current == NULL) {
+      continue;
+    }
+
+    // Only the reloader writes the value, so it can read it without an atomic load.
+    bool same;
+    if (f->type == FLAG_STRING) {
+      const char* old;
+      const char* next;
+      memcpy(&old, current, sizeof(old));
+      memcpy(&next, &v->value, sizeof(next));
+      same = old == next || (old != NULL && next != NULL && strcmp(old, next) == 0);
+    } else {
+      same = memcmp(current, &v->value, size) == 0;
+    }
+    if (same) {
+      continue;
+    }
+
+    // Strings are published as owned copies, so the file can be unmapped right after.
+    uint64_t value = v->value;
+    if (f->type == FLAG_STRING) {
+      const char* next;
+      memcpy(&next, &value, sizeof(next));
+      next = reload_intern(ctx, next);
+      memcpy(&value, &next, sizeof(next));
+    }
+    if (!v->given) {
+      flag_atomic_store(f->value, &value, size);
+    }
+    if (saved != NULL) {
+      memcpy(saved, &value, size);
+    }
+    bit_set(v->set->configured, v->pos);
+    changed++;
+  }
+
+  if (changed > 0) {
+    ctx->defaults_version++;
+  }
+  return changed;
+}
+
+// Reload the config file of mapping m if it changed since it was read or last rejected.
+static flag_status reload_file(flag_ctx* ctx, flag_mapping* m, flag_error* err) {
+  struct stat st;
+  if (stat(m->path, &st) != 0) {
+    parse_error(err, FLAG_ERR_IO, NULL, -1, NULL, strerror(errno), SIZE_MAX);
+    err->file = m->path;
+    return FLAG_ERR_IO;
+  }
+  flag_file_id id;
+  file_id(&st, &id);
+  if (memcmp(&id, &m->id, sizeof(id)) == 0 || memcmp(&id, &m->failed, sizeof(id)) == 0) {
+    return FLAG_OK;
+  }
+
+  char* map;
+  flag_mapping next = {.path = m->path};
+  if (map_file(m->path, &map, &next.len, &id, err) != FLAG_OK) {
+    return err->status;
+  }
+  next.addr = map;
+
+  // Nothing is published unless every line of the file is valid.
+  flag_reload reload = {0};
+  flag_status status = map ? apply_mapping(ctx, &next, &reload, err) : FLAG_OK;
+  if (status == FLAG_OK) {
+    reload_publish(ctx, &reload);
+  }
+  flag_free(reload.values);
+
+  if (status != FLAG_OK) {
+    // The rejected file is released, so the error keeps a copy of the value. The file is
+    // only read again once it changes.
+    if (err->value != NULL) {
+      snprintf(ctx->reload_value, sizeof(ctx->reload_value), "%s", err->value);
+      err->value = ctx->reload_value;
+    }
+    err->file = m->path;
+    m->failed = id;
+  } else {
+    m->id = id;
+    m->failed = (flag_file_id){0};
+  }
+
+  // Published strings are owned copies, so nothing points into the new mapping. The one
+  // made by LoadFlagConfig stays, since flags that are not reloadable may point into it.
+  if (map != NULL) {
+    munmap(map, next.len);
+  }
+  flag_free(next.tail);
+  return status;
+}
+
+flag_status ReloadFlagConfig(flag_ctx* ctx, flag_error* err) {
+  f_assert(!ctx->frozen && ctx->cache_path == NULL,
+           "[ERROR]: Frozen contexts and contexts with a parse cache cannot be reloaded\n");
+
+  flag_error unused;
+  if (err == NULL) {
+    err = &unused;
+  }
+  *err = (flag_error){.status = FLAG_OK, .index = -1, .offset = SIZE_MAX};
+
+  // Config files are listed in load order. Every file is reloaded even if one fails, and
+  // the first error is returned.
+  flag_status status = FLAG_OK;
+  for (flag_mapping* m = ctx->mappings; m != NULL; m = m->next) {
+    if (m->path == NULL) {
+      continue;
+    }
+    flag_error file_err = {.status = FLAG_OK, .index = -1, .offset = SIZE_MAX};
+    if (reload_file(ctx, m, &file_err) != FLAG_OK && status == FLAG_OK) {
+      *err = file_err;
+      status = file_err.status;
+    }
+  }
+  return status;
+}
+
+#if !defined(FLAG_NO_THREADS) && defined(__linux__)
+// Thread started by WatchFlagConfig.
+typedef struct flag_watcher {
+  flag_ctx* ctx;
+  flag_reload_handler handler;
+  int inotify_fd;
+  int stop_fd[2];  // Pipe written by stop_watcher to end the thread.
+  pthread_t thread;
+} flag_watcher;
+
+// Whether the inotify event names one of the config files of ctx.
+static bool watcher_matches(const flag_ctx* ctx, const struct inotify_event* ev) {
+  if (ev->mask & IN_Q_OVERFLOW) {
+    return true;  // Events were lost: check every file.
+  }
+  for (const flag_mapping* m = ctx->mappings; m != NULL && ev->len > 0; m = m->next) {
+    if (m->path != NULL) {
+      const char* base = strrchr(m->path, '/');
+      if (strcmp(base ? base + 1 : m->path, ev->name) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void* watcher_main(void* arg) {
+  flag_watcher* w = arg;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2] = {
+    {.fd = w->inotify_fd, .events = POLLIN},
+    {.fd = w->stop_fd[0], .events = POLLIN},
+  };
+
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return NULL;
+    }
+    if (fds[1].revents != 0) {
+      return NULL;
+    }
+
+    ssize_t n = read(w->inotify_fd, buf, sizeof(buf));
+    if (n <= 0) {
+      continue;
+    }
+    bool matched = false;
+    for (char* p = buf; p < buf + n;) {
+      const struct inotify_event* ev = (const struct inotify_event*)p;
+      matched |= watcher_matches(w->ctx, ev);
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+    if (matched) {
+      flag_error err;
+      ReloadFlagConfig(w->ctx, &err);
+      if (w->handler != NULL) {
+        w->handler(w->ctx, &err);
+      }
+    }
+  }
+}
+
+// Close the descriptors of w and free it.
+static void watcher_free(flag_watcher* w) {
+  const int fds[3] = {w->inotify_fd, w->stop_fd[0], w->stop_fd[1]};
+  for (int i = 0; i < 3; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  flag_free(w);
+}
+
+flag_status WatchFlagConfig(flag_ctx* ctx, flag_reload_handler handler, flag_error* err) {
+  f_assert(ctx->watcher == NULL, "[ERROR]: The config files are already watched\n");
+
+  flag_error unused;
+  if (err == NULL) {
+    err = &unused;
+  }
+  *err = (flag_error){.status = FLAG_OK, .index = -1, .offset = SIZE_MAX};
+
+  flag_watcher* w = (flag_watcher*)flag_alloc(sizeof(flag_watcher), _Alignof(flag_watcher));
+  f_assert(w != NULL, "[ERROR]: Unable to allocate memory for the config watcher\n");
+  *w = (flag_watcher){.ctx = ctx, .handler = handler, .stop_fd = {-1, -1}};
+  w->inotify_fd = inotify_init1(IN_CLOEXEC);
+  int error = w->inotify_fd < 0 || pipe(w->stop_fd) != 0 ? errno : 0;
+
+  // Watch the directories rather than the files, whose inodes change when editors save
+  // them by renaming a new file over the old one.
+  for (const flag_mapping* m = ctx->mappings; m != NULL && error == 0; m = m->next) {
+    if (m->path == NULL) {
+      continue;
+    }
+    char dir[PATH_MAX];
+    const char* slash = strrchr(m->path, '/');
+    size_t len = slash == NULL ? 1 : slash == m->path ? 1 : (size_t)(slash - m->path);
+    if (len >= sizeof(dir)) {
+      error = ENAMETOOLONG;
+    } else {
+      memcpy(dir, slash == NULL ? "." : m->path, len);
+      dir[len] = '\0';
+      if (inotify_add_watch(w->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        error = errno;
+      }
+    }
+    if (error != 0) {
+      err->file = m->path;
+    }
+  }
+  if (error == 0) {
+    error = pthread_create(&w->thread, NULL, watcher_main, w);
+  }
+
+  if (error != 0) {
+    const char* file = err->file;
+    watcher_free(w);
+    parse_error(err, FLAG_ERR_IO, NULL, -1, NULL, strerror(error), SIZE_MAX);
+    err->file = file;
+    return FLAG_ERR_IO;
+  }
+  ctx->watcher = w;
+  return FLAG_OK;
+}
+
+// Stop the thread started by WatchFlagConfig, waiting for a reload in progress to finish.
+static void stop_watcher(flag_ctx* ctx) {
+  flag_watcher* w = ctx->watcher;
+  if (w == NULL) {
+    return;
+  }
+  while (write(w->stop_fd[1], "", 1) < 0 && errno == EINTR) {
+  }
+  pthread_join(w->thread, NULL);
+  watcher_free(w);
+  ctx->watcher = NULL;
+}
+#else
+flag_status WatchFlagConfig(flag_ctx* ctx, flag_reload_handler handler, flag_error* err) {
+  (void)ctx;
+  (void)handler;
+  flag_error unused;
+  if (err == NULL) {
+    err = &unused;
+  }
+  *err = (flag_error){.status = FLAG_OK, .index = -1, .offset = SIZE_MAX};
+  return parse_error(err, FLAG_ERR_IO, NULL, -1, NULL, "watching files needs Linux and threads",
+                     SIZE_MAX);
+}
+
+static void stop_watcher(flag_ctx* ctx) {
+  (void)ctx;
+}
+#endif
+
+// Apply the variables bound to flags of ctx, see LoadFlagEnv.
+static flag_status load_env(flag_ctx* ctx, flag_error* err) {
+  // Index the bound flags by the hash of their variable name, so that a single pass over
+  // environ finds them all.
+  size_t num_bound = 0;
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    const flag_set* set = i == 0 ? &ctx->flags : &ctx->subcommands[i - 1]->flags;
+    for (size_t j = 0; j < set->count; j++) {
+      num_bound += set->info[j].env != NULL;
+    }
+  }
+  if (num_bound == 0) {
+    return FLAG_OK;
+  }
+
+  unsigned bits = 3;
+  while (((size_t)1 << bits) < num_bound * 2) {
+    bits++;
+  }
+  size_t mask = ((size_t)1 << bits) - 1;
+  env_slot* slots = (env_slot*)flag_alloc((mask + 1) * sizeof(env_slot), _Alignof(env_slot));
+  f_assert(slots != NULL, "[ERROR]: Unable to allocate the environment index");
+  memset(slots, 0, (mask + 1) * sizeof(env_slot));
+
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    flag_set* set = i == 0 ? &ctx->flags : &ctx->subcommands[i - 1]->flags;
+    for (size_t j = 0; j < set->count; j++) {
+      if (set->info[j].env == NULL) {
+        continue;
+      }
+      size_t len;
+      uint32_t hash = flag_hash(set->info[j].env, &len);
+      size_t slot = FLAG_HASH_SLOT(hash, FLAG_SCHEMA_SEED, bits);
+      while (slots[slot].set != NULL) {
+        slot = (slot + 1) & mask;
+      }
+      slots[slot] = (env_slot){.hash = hash, .len = (uint32_t)len, .set = set, .pos = j};
+    }
+  }
+
+  begin_defaults_update(ctx);
+
+  flag_status status = FLAG_OK;
+  for (char** entry = environ; *entry != NULL && status == FLAG_OK; entry++) {
+    // Hash the name up to '=' the same way flag_hash does.
+    const char* p = *entry;
+    uint32_t hash = 0;
+    uint32_t pow = FLAG_HASH_MULT;
+    while (*p != '\0' && *p != '=') {
+      hash += (unsigned char)*p++ * pow;
+      pow *= FLAG_HASH_MULT;
+    }
+    if (*p != '=') {
+      continue;
+    }
+    size_t len = (size_t)(p - *entry);
+
+    size_t slot = FLAG_HASH_SLOT(hash, FLAG_SCHEMA_SEED, bits);
+    for (; slots[slot].set != NULL; slot = (slot + 1) & mask) {
+      const env_slot* e = &slots[slot];
+      if (e->hash != hash || e->len != len || memcmp(e->set->info[e->pos].env, *entry, len)) {
+        continue;
+      }
+
+      // environ outlives the context, so strings can point into it like they do into argv.
+      flag* f = e->set->list[e->pos];
+      status = store_value(f, f->value, p + 1, &ctx->arena, -1, err);
+      if (status != FLAG_OK) {
+        err->env = e->set->info[e->pos].env;
+        break;
+      }
+      seal_list(f);
+      bit_set(e->set->configured, e->pos);
+      break;
+    }
+  }
+
+  end_defaults_update(ctx);
+  flag_free(slots);
+  return status;
+}
+
+flag_status LoadFlagEnv(flag_ctx* ctx, flag_error* err) {
+  f_assert(!ctx->frozen, "[ERROR]: Load the environment before freezing the context\n");
+
+  flag_error unused;
+  if (err == NULL) {
+    err = &unused;
+  }
+  *err = (flag_error){.status = FLAG_OK, .index = -1, .offset = SIZE_MAX};
+
+  if (ctx->cache_pending) {
+    cache_defer(ctx, NULL);
+    return FLAG_OK;
+  }
+  if (cache_settle(ctx, err) != FLAG_OK) {
+    return err->status;
+  }
+  return load_env(ctx, err);
+}
+
+// Parse cache, see SetFlagCache.
+//
+// A blob holds the values of every flag after a parse, for the inputs that produced it.
+// Its parts, each 8-byte aligned:
+//
+//   flag_cache_header
+//   num_deps flag_cache_dep, each followed by the path of the file and a NUL
+//   num_values flag_cache_value: the flags with a variable, globals first, then those of
+//     each subcommand in the order of ctx->subcommands
+//   num_positionals offsets of the positional arguments
+//   strings and list items, referenced by offset from the start of the blob
+//
+// The blob is written for this build and machine only, so everything is stored as is.
+
+#define FLAG_CACHE_MAGIC 0x43474C46u  // "FLGC"
+#define FLAG_CACHE_FORMAT 1           // Bumped whenever the layout changes.
+#define FLAG_CACHE_NULL UINT64_MAX    // Offset standing for a NULL string.
+
+typedef struct flag_cache_header {
+  uint32_t magic;
+  uint32_t format;
+  uint64_t key;              // cache_key of the parse that wrote the blob.
+  uint64_t size;             // Bytes in the blob.
+  uint32_t num_deps;         // Files that parse read.
+  uint32_t num_values;       // Entries in the values part.
+  int64_t subcmd;            // Position of the selected subcommand, or -1.
+  uint64_t num_positionals;  // Positional arguments.
+} flag_cache_header;
+
+typedef struct flag_cache_dep {
+  flag_file_id id;    // The file as it was read.
+  uint64_t path_len;  // Length of the path that follows.
+} flag_cache_dep;
+
+// Value of one flag. Strings and lists are stored by offset, everything else as is.
+typedef struct flag_cache_value {
+  uint64_t data;     // The value, or the offset of the string or the list items.
+  uint64_t count;    // Items of a list.
+  uint64_t pending;  // Raw value of an unresolved lazy flag, or FLAG_CACHE_NULL.
+} flag_cache_value;
+
+// A blob being written. Parts are appended 8-byte aligned and zero-filled.
+typedef struct flag_blob {
+  unsigned char* data;
+  size_t len;
+  size_t capacity;
+} flag_blob;
+
+static size_t blob_reserve(flag_blob* b, size_t size) {
+  size = (size + 7) & ~(size_t)7;
+  if (b->len + size > b->capacity) {
+    size_t capacity = b->capacity > 0 ? b->capacity * 2 : 4096;
+    while (capacity < b->len + size) {
+      capacity *= 2;
+    }
+    unsigned char* data = (unsigned char*)flag_alloc(capacity, 8);
+    f_assert(data != NULL, "[ERROR]: Unable to allocate %zu bytes for the parse cache\n",
+             capacity);
+    if (b->len > 0) {
+      memcpy(data, b->data, b->len);
+    }
+    flag_free(b->data);
+    b->data = data;
+    b->capacity = capacity;
+  }
+
+  size_t offset = b->len;
+  memset(b->data + offset, 0, size);
+  b->len += size;
+  return offset;
+}
+
+static uint64_t blob_string(flag_blob* b, const char* s) {
+  if (s == NULL) {
+    return FLAG_CACHE_NULL;
+  }
+  size_t len = strlen(s);
+  size_t offset = blob_reserve(b, len + 1);
+  memcpy(b->data + offset, s, len);
+  return offset;
+}
+
+static uint64_t hash_bytes(uint64_t h, const void* data, size_t len) {
+  const unsigned char* p = (const unsigned char*)data;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 0x100000001B3u;  // FNV-1a
+  }
+  return h;
+}
+
+static uint64_t hash_string(uint64_t h, const char* s) {
+  bool present = s != NULL;
+  h = hash_bytes(h, &present, 1);
+  return present ? hash_bytes(h, s, strlen(s) + 1) : h;
+}
+
+
+// Hash the value of f, with the strings it points to.
+static uint64_t hash_value(uint64_t h, const flag* f) {
+  const flag_type_ops* ops = &flag_types[f->type];
+  if (f->type == FLAG_STRING) {
+    return hash_string(h, *(char* const*)f->value);
+  }
+  if (!flag_is_list(f->type)) {
+    return hash_bytes(h, f->value, ops->size);
+  }
+
+  const flag_list* list = (const flag_list*)f->value;
+  h = hash_bytes(h, &list->count, sizeof(list->count));
+  if (f->type == FLAG_STRING_LIST) {
+    for (size_t i = 0; i < list->count; i++) {
+      h = hash_string(h, ((char* const*)list->items)[i]);
+    }
+    return h;
+  }
+  return hash_bytes(h, list->items, list->count * ((const flag_type_ops*)ops->data)->size);
+}
+
+// Hash everything a parse of argv depends on, apart from the files, which the blob lists:
+// the version, every flag with its type, default and variable, the deferred sources
+// with the variables they would read, and argv. Returns 0 when the flags cannot be cached.
+static uint64_t cache_key(const flag_ctx* ctx, int argc, char* argv[]) {
+  uint64_t h = 0xCBF29CE484222325u;
+  uint32_t format[2] = {FLAG_CACHE_FORMAT, ctx->cache_version};
+  h = hash_bytes(h, format, sizeof(format));
+
+  bool env = false;
+  for (const flag_source* source = ctx->sources; source != NULL; source = source->next) {
+    h = hash_string(h, source->path);
+    env |= source->path == NULL;
+  }
+
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    const flag_set* set = i == 0 ? &ctx->flags : &ctx->subcommands[i - 1]->flags;
+    h = hash_string(h, i == 0 ? "" : ctx->subcommands[i - 1]->path);
+    h = hash_bytes(h, &set->count, sizeof(set->count));
+    for (size_t j = 0; j < set->count; j++) {
+      const flag* f = set->list[j];
+      if (f->type >= FLAG_TYPE_CUSTOM) {
+        return 0;  // Values of custom types may point anywhere.
+      }
+      h = hash_string(h, f->name);
+      h = hash_bytes(h, &f->type, sizeof(f->type));
+      bool traits[2] = {f->value != NULL, f->lazy};
+      h = hash_bytes(h, traits, sizeof(traits));
+      if (f->value != NULL) {
+        h = hash_value(h, f);
+      }
+      if (env && set->info[j].env != NULL) {
+        h = hash_string(h, getenv(set->info[j].env));
+      }
+    }
+  }
+
+  for (int i = 1; i < argc; i++) {
+    h = hash_string(h, argv[i]);
+  }
+  return h != 0 ? h : 1;
+}
+
+static void cache_defer(flag_ctx* ctx, const char* path) {
+  flag_source* source = (flag_source*)arena_alloc(&ctx->arena, sizeof(flag_source));
+  *source = (flag_source){.path = path ? arena_strndup(&ctx->arena, path, strlen(path)) : NULL};
+  flag_source** tail = &ctx->sources;
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
+  }
+  *tail = source;
+}
+
+// Apply the config files and the environment deferred by SetFlagCache, in order.
+static flag_status cache_apply_sources(flag_ctx* ctx, flag_error* err) {
+  for (const flag_source* source = ctx->sources; source != NULL; source = source->next) {
+    flag_status status = source->path ? load_config(ctx, source->path, err) : load_env(ctx, err);
+    if (status != FLAG_OK) {
+      return status;
+    }
+  }
+  return FLAG_OK;
+}
+
+// After a hit, the sources are still unapplied, so the saved defaults and the configured
+// bits do not have their values. Apply them before anything reads those: the next parse,
+// another load, the help text or freezing. The values restored from the cache are kept.
+static flag_status cache_settle(flag_ctx* ctx, flag_error* err) {
+  if (!ctx->sources_pending) {
+    return FLAG_OK;
+  }
+  ctx->sources_pending = false;
+
+  // Contexts with custom types are never cached, so every value fits a saved slot.
+  typedef struct saved_value {
+    union {
+      max_align_t align;
+      unsigned char bytes[FLAG_VALUE_COPY_SIZE];
+    } value;
+    const char* pending;
+  } saved_value;
+  size_t count = 0;
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    count += i == 0 ? ctx->flags.count : ctx->subcommands[i - 1]->flags.count;
+  }
+  saved_value* saved =
+    (saved_value*)flag_alloc((count > 0 ? count : 1) * sizeof(saved_value), _Alignof(saved_value));
+  f_assert(saved != NULL, "[ERROR]: Unable to allocate memory for the cached values\n");
+
+  saved_value* v = saved;
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    const flag_set* set = i == 0 ? &ctx->flags : &ctx->subcommands[i - 1]->flags;
+    for (size_t j = 0; j < set->count; j++, v++) {
+      const flag* f = set->list[j];
+      if (f->value != NULL) {
+        memcpy(v->value.bytes, f->value, flag_types[f->type].size);
+      }
+      v->pending = f->pending;
+    }
+  }
+
+  // The loads leave the new defaults in the variables, to be snapshotted before the cached
+  // values go back.
+  flag_status status = cache_apply_sources(ctx, err);
+  v = saved;
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    flag_set* set = i == 0 ? &ctx->flags : &ctx->subcommands[i - 1]->flags;
+    set_restore_defaults(set);
+    for (size_t j = 0; j < set->count; j++, v++) {
+      flag* f = set->list[j];
+      if (f->value != NULL) {
+        memcpy(f->value, v->value.bytes, flag_types[f->type].size);
+      }
+      f->pending = v->pending;
+    }
+  }
+  flag_free(saved);
+  return status;
+}
+
+// Whether the NUL-terminated string at offset lies inside the blob of len bytes.
+static bool blob_has_string(const char* blob, size_t len, uint64_t offset) {
+  return offset == FLAG_CACHE_NULL || (offset < len && memchr(blob + offset, '\0', len - offset));
+}
+
+static const char* blob_str(char* blob, uint64_t offset) {
+  return offset == FLAG_CACHE_NULL ? NULL : blob + offset;
+}
+
+// Rewrite count string offsets at items into char pointers, in place. Pointers are never
+// wider than the offsets, so each is written over offsets already read.
+static char** blob_relocate(char* blob, uint64_t items, size_t count) {
+  const uint64_t* offsets = (const uint64_t*)(blob + items);
+  char** strings = (char**)(blob + items);
+  for (size_t i = 0; i < count; i++) {
+    strings[i] = (char*)blob_str(blob, offsets[i]);
+  }
+  return strings;
+}
+
+// Check every offset of the value v of f against the blob of len bytes.
+static bool cache_value_valid(const flag* f, const flag_cache_value* v, const char* blob,
+                              size_t len) {
+  if (!blob_has_string(blob, len, v->pending)) {
+    return false;
+  }
+  if (f->type == FLAG_STRING) {
+    return blob_has_string(blob, len, v->data);
+  }
+  if (!flag_is_list(f->type)) {
+    return true;
+  }
+
+  size_t item = f->type == FLAG_STRING_LIST
+                  ? sizeof(uint64_t)
+                  : ((const flag_type_ops*)flag_types[f->type].data)->size;
+  if (v->data > len || v->count > (len - v->data) / item) {
+    return false;
+  }
+  for (size_t i = 0; f->type == FLAG_STRING_LIST && i < v->count; i++) {
+    if (!blob_has_string(blob, len, ((const uint64_t*)(blob + v->data))[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void cache_restore_value(flag* f, const flag_cache_value* v, char* blob) {
+  if (f->lazy) {
+    f->pending = blob_str(blob, v->pending);
+  }
+  if (f->type == FLAG_STRING) {
+    *(const char**)f->value = blob_str(blob, v->data);
+  } else if (flag_is_list(f->type)) {
+    void* items = f->type == FLAG_STRING_LIST ? (void*)blob_relocate(blob, v->data, v->count)
+                                              : (void*)(blob + v->data);
+    *(flag_list*)f->value = (flag_list){.items = items, .count = v->count};
+  } else {
+    memcpy(f->value, &v->data, flag_types[f->type].size);
+  }
+}
+
+// Check that the blob of len bytes was written for key and that the files it was made
+// from are unchanged.
+static bool cache_valid(const flag_ctx* ctx, const char* blob, size_t len, uint64_t key) {
+  const flag_cache_header* header = (const flag_cache_header*)blob;
+  if (len < sizeof(flag_cache_header) || header->magic != FLAG_CACHE_MAGIC ||
+      header->format != FLAG_CACHE_FORMAT || header->key != key || header->size != len ||
+      header->subcmd >= (int64_t)ctx->num_subcommands) {
+    return false;
+  }
+
+  size_t offset = sizeof(flag_cache_header);
+  for (uint32_t i = 0; i < header->num_deps; i++) {
+    const flag_cache_dep* dep = (const flag_cache_dep*)(blob + offset);
+    if (len - offset < sizeof(flag_cache_dep) ||
+        dep->path_len >= len - offset - sizeof(flag_cache_dep)) {
+      return false;
+    }
+
+    const char* path = (const char*)(dep + 1);
+    struct stat st;
+    flag_file_id id;
+    if (path[dep->path_len] != '\0' || stat(path, &st) != 0) {
+      return false;
+    }
+    file_id(&st, &id);
+    if (memcmp(&id, &dep->id, sizeof(id)) != 0) {
+      return false;
+    }
+    offset += (sizeof(flag_cache_dep) + dep->path_len + 1 + 7) & ~(size_t)7;
+  }
+
+  uint32_t num_values = 0;
+  const flag_cache_value* v = (const flag_cache_value*)(blob + offset);
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    const flag_set* set = i == 0 ? &ctx->flags : &ctx->subcommands[i - 1]->flags;
+    for (size_t j = 0; j < set->count; j++) {
+      if (set->list[j]->value == NULL) {
+        continue;
+      }
+      if (num_values == header->num_values ||
+          (size_t)((const char*)(v + 1) - blob) > len ||
+          !cache_value_valid(set->list[j], v, blob, len)) {
+        return false;
+      }
+      num_values++;
+      v++;
+    }
+  }
+
+  const uint64_t* positionals = (const uint64_t*)v;
+  if (num_values != header->num_values ||
+      header->num_positionals > (len - (size_t)((const char*)v - blob)) / sizeof(uint64_t)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < header->num_positionals; i++) {
+    if (positionals[i] == FLAG_CACHE_NULL || !blob_has_string(blob, len, positionals[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Restore the values, subcommand and positionals saved for key into ctx, and keep the
+// blob mapped until ctx is destroyed. Returns false if there is no current blob for key.
+static bool cache_load(flag_ctx* ctx, uint64_t key, subcommand** selected) {
+  char* blob;
+  size_t len;
+  flag_file_id id;
+  flag_error err;
+  if (map_file(ctx->cache_path, &blob, &len, &id, &err) != FLAG_OK || blob == NULL) {
+    return false;
+  }
+  if (!cache_valid(ctx, blob, len, key)) {
+    munmap(blob, len);
+    return false;
+  }
+
+  flag_mapping* mapping = (flag_mapping*)arena_alloc(&ctx->arena, sizeof(flag_mapping));
+  *mapping = (flag_mapping){.next = ctx->mappings, .addr = blob, .len = len, .id = id};
+  ctx->mappings = mapping;
+
+  const flag_cache_header* header = (const flag_cache_header*)blob;
+  size_t offset = sizeof(flag_cache_header);
+  for (uint32_t i = 0; i < header->num_deps; i++) {
+    const flag_cache_dep* dep = (const flag_cache_dep*)(blob + offset);
+    offset += (sizeof(flag_cache_dep) + dep->path_len + 1 + 7) & ~(size_t)7;
+  }
+
+  const flag_cache_value* v = (const flag_cache_value*)(blob + offset);
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    flag_set* set = i == 0 ? &ctx->flags : &ctx->subcommands[i - 1]->flags;
+    for (size_t j = 0; j < set->count; j++) {
+      if (set->list[j]->value != NULL) {
+        cache_restore_value(set->list[j], v++, blob);
+      }
+    }
+  }
+
+  ctx->positionals = (flag_positionals){
+    .items = blob_relocate(blob, (uint64_t)((const char*)v - blob), header->num_positionals),
+    .count = header->num_positionals,
+    .capacity = header->num_positionals,
+  };
+  if (selected != NULL) {
+    *selected = header->subcmd >= 0 ? ctx->subcommands[header->subcmd] : NULL;
+  }
+  return true;
+}
+
+// Append a dependency entry for every file in list.
+static void cache_save_deps(flag_blob* b, const flag_mapping* list, uint32_t* num_deps) {
+  for (const flag_mapping* m = list; m != NULL; m = m->next) {
+    size_t path_len = strlen(m->path);
+    size_t offset = blob_reserve(b, sizeof(flag_cache_dep) + path_len + 1);
+    flag_cache_dep* dep = (flag_cache_dep*)(b->data + offset);
+    *dep = (flag_cache_dep){.id = m->id, .path_len = path_len};
+    memcpy(dep + 1, m->path, path_len);
+    (*num_deps)++;
+  }
+}
+
+static void cache_save_value(flag_blob* b, size_t offset, const flag* f) {
+  flag_cache_value v = {.pending = blob_string(b, f->pending)};
+  if (f->type == FLAG_STRING) {
+    v.data = blob_string(b, *(char* const*)f->value);
+  } else if (flag_is_list(f->type)) {
+    const flag_list* list = (const flag_list*)f->value;
+    v.count = list->count;
+    if (f->type == FLAG_STRING_LIST) {
+      v.data = blob_reserve(b, list->count * sizeof(uint64_t));
+      for (size_t i = 0; i < list->count; i++) {
+        uint64_t item = blob_string(b, ((char* const*)list->items)[i]);
+        ((uint64_t*)(b->data + v.data))[i] = item;
+      }
+    } else {
+      size_t size = list->count * ((const flag_type_ops*)flag_types[f->type].data)->size;
+      v.data = blob_reserve(b, size);
+      if (size > 0) {
+        memcpy(b->data + v.data, list->items, size);
+      }
+    }
+  } else {
+    memcpy(&v.data, f->value, flag_types[f->type].size);
+  }
+  memcpy(b->data + offset, &v, sizeof(v));
+}
+
+// Save the result of the parse that just succeeded for key. The blob is written to a
+// temporary file and renamed over the cache, so readers never see a partial one. Errors
+// only cost the next run its cache hit, so they are ignored.
+static void cache_save(const flag_ctx* ctx, uint64_t key, const subcommand* selected) {
+  flag_blob b = {0};
+  size_t header = blob_reserve(&b, sizeof(flag_cache_header));
+  uint32_t num_deps = 0;
+  cache_save_deps(&b, ctx->mappings, &num_deps);
+  cache_save_deps(&b, ctx->responses, &num_deps);
+
+  uint32_t num_values = 0;
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    const flag_set* set = i == 0 ? &ctx->flags : &ctx->subcommands[i - 1]->flags;
+    for (size_t j = 0; j < set->count; j++) {
+      num_values += set->list[j]->value != NULL;
+    }
+  }
+  size_t values = blob_reserve(&b, num_values * sizeof(flag_cache_value));
+  size_t positionals = blob_reserve(&b, ctx->positionals.count * sizeof(uint64_t));
+
+  size_t offset = values;
+  for (size_t i = 0; i <= ctx->num_subcommands; i++) {
+    const flag_set* set = i == 0 ? &ctx->flags : &ctx->subcommands[i - 1]->flags;
+    for (size_t j = 0; j < set->count; j++) {
+      if (set->list[j]->value != NULL) {
+        cache_save_value(&b, offset, set->list[j]);
+        offset += sizeof(flag_cache_value);
+      }
+    }
+  }
+  for (size_t i = 0; i < ctx->positionals.count; i++) {
+    uint64_t item = blob_string(&b, ctx->positionals.items[i]);
+    ((uint64_t*)(b.data + positionals))[i] = item;
+  }
+
+  int64_t subcmd = -1;
+  for (size_t i = 0; i < ctx->num_subcommands && selected != NULL; i++) {
+    subcmd = ctx->subcommands[i] == selected ? (int64_t)i : subcmd;
+  }
+  *(flag_cache_header*)(b.data + header) = (flag_cache_header){
+    .magic = FLAG_CACHE_MAGIC,
+    .format = FLAG_CACHE_FORMAT,
+    .key = key,
+    .size = b.len,
+    .num_deps = num_deps,
+    .num_values = num_values,
+    .subcmd = subcmd,
+    .num_positionals = ctx->positionals.count,
+  };
+
+  size_t path_len = strlen(ctx->cache_path);
+  char tmp[path_len + 8];
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", ctx->cache_path);
+  int fd = mkstemp(tmp);
+  if (fd >= 0) {
+    size_t written = 0;
+    while (written < b.len) {
+      ssize_t n = write(fd, b.data + written, b.len - written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      written += (size_t)n;
+    }
+    if (close(fd) != 0 || written < b.len || rename(tmp, ctx->cache_path) != 0) {
+      unlink(tmp);
+    }
+  }
+  flag_free(b.data);
+}
+
+void EnableFlagCompletion(flag_ctx* ctx) {
+  ctx->completion = true;
+}
+
+void SetFlagCache(flag_ctx* ctx, const char* path, uint32_t version) {
+  f_assert(!ctx->frozen, "[ERROR]: Frozen contexts do not use a parse cache\n");
+  f_assert(ctx->defaults_version == 0 && ctx->sources == NULL,
+           "[ERROR]: Call SetFlagCache before LoadFlagConfig and LoadFlagEnv\n");
+  ctx->cache_path = arena_strndup(&ctx->arena, path, strlen(path));
+  ctx->cache_version = version;
+  ctx->cache_pending = true;
+}
+
+static int flag_error_message(const flag_error* err, char* buf, size_t len) {
+  switch (err->status) {
+    case FLAG_OK:
+      return snprintf(buf, len, "No error");
+    case FLAG_HELP:
+      return snprintf(buf, len, "Help requested");
+    case FLAG_ERR_MISSING_VALUE:
+      return snprintf(buf, len, "No value specified for flag %s", err->flag);
+    case FLAG_ERR_INVALID_VALUE:
+      if (err->offset != SIZE_MAX) {
+        return snprintf(buf, len, "Invalid value \"%s\" for flag %s (%s): %s at position %zu",
+                        err->value, err->flag, err->type, err->reason, err->offset + 1);
+      }
+      return snprintf(buf, len, "Invalid value \"%s\" for flag %s (%s): %s", err->value,
+                      err->flag, err->type, err->reason);
+    case FLAG_ERR_VALIDATION:
+      if (err->reason != NULL) {
+        return snprintf(buf, len, "%s", err->reason);
+      }
+      return snprintf(buf, len, "Invalid value for flag %s", err->flag);
+    case FLAG_ERR_REQUIRED:
+      if (err->reason != NULL) {
+        return snprintf(buf, len, "%s", err->reason);
+      }
+      if (err->other != NULL) {
+        return snprintf(buf, len, "Flag %s is required by %s", err->flag, err->other);
+      }
+      return snprintf(buf, len, "Flag %s is required", err->flag);
+    case FLAG_ERR_CONFLICT:
+      return snprintf(buf, len, "Flags %s and %s cannot be used together", err->flag,
+                      err->other);
+    case FLAG_ERR_UNKNOWN_FLAG:
+      return snprintf(buf, len, "Unknown flag %s", err->value);
+    case FLAG_ERR_IO:
+      return snprintf(buf, len, "%s", err->reason);
+  }
+  return snprintf(buf, len, "Unknown error");
+}
+
+int FlagErrorString(const flag_error* err, char* buf, size_t len) {
+  // Prefix errors from a config file or the environment with where the value came from.
+  int n = 0;
+  if (err->env != NULL) {
+    n = snprintf(buf, len, "$%s: ", err->env);
+  } else if (err->file != NULL) {
+    n = err->line > 0 ? snprintf(buf, len, "%s:%d: ", err->file, err->line)
+                      : snprintf(buf, len, "%s: ", err->file);
+  }
+  if (n < 0 || (size_t)n >= len) {
+    return n;
+  }
+  return n + flag_error_message(err, buf + n, len - (size_t)n);
+}
+
+// Parse command line arguments and set flag values
+subcommand* ParseFlags(flag_ctx* ctx, int argc, char* argv[]) {
+  // Completion requests from the shell are answered without parsing anything.
+  if (ctx->completion && argc >= 2 && strcmp(argv[1], "__complete") == 0) {
+    PrintCompletions(ctx, argc - 2, argv + 2);
+    DestroyFlagContext(ctx);
+    exit(EXIT_SUCCESS);
+  }
+  if (ctx->completion && argc >= 3 && strcmp(argv[1], "__completion") == 0) {
+    int status = PrintCompletionScript(ctx, argv[2], argv[0]);
+    if (status != 0) {
+      fprintf(stderr, "Error: Unknown shell %s. Use bash, zsh or fish.\n", argv[2]);
+    }
+    DestroyFlagContext(ctx);
+    exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  subcommand* subcmd;
+  flag_error err;
+  flag_status status = ParseFlagsEx(ctx, argc, argv, &subcmd, &err);
+  if (status == FLAG_OK) {
+    return subcmd;
+  }
+
+  if (status == FLAG_HELP) {
+    PrintHelp(ctx, argv);
+    DestroyFlagContext(ctx);
+    exit(EXIT_SUCCESS);
+  }
+
+  char message[MAX_DESCRIPTION + 2 * MAX_NAME];
+  FlagErrorString(&err, message, sizeof(message));
+  if (status == FLAG_ERR_REQUIRED) {
+    fprintf(stderr, "\n[ERROR]: %s\n\n", message);
+    PrintHelp(ctx, argv);
+  } else {
+    fprintf(stderr, "Error: %s\n", message);
+  }
+  DestroyFlagContext(ctx);
+  exit(EXIT_FAILURE);
+}
+
+static int maxNameLength(const flag_set* set) {
+  int max = 0;
+  for (size_t i = 0; i < set->count; i++) {
+    int len = (int)set->list[i]->name_len;
+    if (len > max) {
+      max = len;
+    }
+  }
+  return max;
+}
+
+// Format the default value of f, stored at value, as " (default: ...)" into buf for help
+// output. Leaves buf empty for flags without a value or formatter, and for values that
+// are all zero bytes.
+static const char* format_default(const flag* f, const void* value, char* buf, size_t len) {
+  const flag_type_ops* ops = &flag_types[f->type];
+  buf[0] = '\0';
+  if (value == NULL || ops->format == NULL) {
+    return buf;
+  }
+
+  const unsigned char* bytes = value;
+  size_t i = 0;
+  while (i < ops->size && bytes[i] == 0) {
+    i++;
+  }
+  if (i == ops->size) {
+    return buf;
+  }
+
+  int prefix = snprintf(buf, len, " (default: ");
+  int n = ops->format(value, buf + prefix, len - (size_t)prefix, ops->data);
+  if (n > 0 && (size_t)(prefix + n) < len - 1) {
+    n += prefix;
+    snprintf(buf + n, len - (size_t)n, ")");
+  } else {
+    buf[0] = '\0';
+  }
+  return buf;
+}
+
+// Growable buffer that help text is rendered into.
+typedef struct flag_text {
+  char* data;
+  size_t len;
+  size_t capacity;
+} flag_text;
+
+// Append formatted text to t.
+static void text_printf(flag_text* t, const char* format, ...) {
+  for (;;) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(t->data ? t->data + t->len : NULL, t->capacity - t->len, format, args);
+    va_end(args);
+    f_assert(n >= 0, "[ERROR]: Unable to format help text\n");
+    if (t->len + (size_t)n < t->capacity) {
+      t->len += (size_t)n;
+      return;
+    }
+
+    size_t capacity = t->capacity > 0 ? t->capacity * 2 : 4096;
+    while (capacity <= t->len + (size_t)n) {
+      capacity *= 2;
+    }
+    char* data = (char*)flag_alloc(capacity, 1);
+    f_assert(data != NULL, "[ERROR]: Unable to allocate %zu bytes for help text\n", capacity);
+    if (t->len > 0) {
+      memcpy(data, t->data, t->len);
+    }
+    flag_free(t->data);
+    t->data = data;
+    t->capacity = capacity;
+  }
+}
+
+// Render the flags of set, one line of format per flag. The defaults are read from the
+// snapshot taken at the first parse, so that values left by a parse are not shown.
+static void render_flags(flag_text* t, const flag_set* set, const char* format) {
+  int width = maxNameLength(set);
+  char def[MAX_DESCRIPTION];
+  char type[MAX_DESCRIPTION];
+  union {
+    max_align_t align;
+    unsigned char bytes[FLAG_VALUE_COPY_SIZE];
+  } saved;
+  for (size_t i = 0; i < set->count; i++) {
+    const flag* f = set->list[i];
+    const void* value = f->value;
+
+    // The formatters read the value as its type, so they get an aligned copy of the saved
+    // default. Larger custom values are read in place, at an offset aligned for them.
+    if (i < set->num_defaults && f->value != NULL) {
+      value = set->defaults + set->default_offsets[i];
+      if (flag_types[f->type].size <= sizeof(saved.bytes)) {
+        memcpy(saved.bytes, value, flag_types[f->type].size);
+        value = saved.bytes;
+      }
+    }
+
+    // Types with units state them: <duration: ns, us, ms, s, m, h>.
+    const char* hint = flag_types[f->type].hint;
+    snprintf(type, sizeof(type), "%s%s%s", flagAsString(f->type), hint ? ": " : "",
+             hint ? hint : "");
+    text_printf(t, format, width, f->name, f->name, set->info[i].required ? "Required" : "Optional",
+                type, set->info[i].description, format_default(f, value, def, sizeof(def)));
+  }
+}
+
+static void render_subcommand(flag_text* t, const subcommand* subcmd) {
+  text_printf(t, "  %s: %s\n", subcmd->path, subcmd->description);
+  render_flags(t, &subcmd->flags, "    -%-*s --%s(%s) <%s>: %s%s\n");
+  text_printf(t, "\n");
+}
+
+// Number of flags and subcommands in ctx. Flags are never removed, so the help text is
+// current as long as this and the defaults version do not change.
+static size_t help_flags(const flag_ctx* ctx) {
+  size_t count = ctx->flags.count + ctx->num_subcommands;
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    count += ctx->subcommands[i]->flags.count;
+  }
+  return count;
+}
+
+static bool help_current(const flag_ctx* ctx) {
+  return ctx->help != NULL && ctx->help_flags == help_flags(ctx) &&
+         ctx->help_version == ctx->defaults_version;
+}
+
+// Write iov to stdout, with a single writev unless the write comes up short. Anything
+// still buffered in stdout is flushed first to keep the output in order.
+static void write_out(struct iovec* iov, int count) {
+  fflush(stdout);
+  struct iovec* next = iov;
+  while (count > 0) {
+    ssize_t n = writev(STDOUT_FILENO, next, count);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    // Skip what was written after a short write.
+    size_t written = (size_t)n;
+    while (count > 0 && written >= next->iov_len) {
+      written -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (char*)next->iov_base + written;
+      next->iov_len -= written;
+    }
+  }
+}
+
+// Write the program name line and text to stdout.
+static void write_help(const char* program, const char* text, size_t len) {
+  struct iovec iov[3] = {
+    {.iov_base = (void*)program, .iov_len = strlen(program)},
+    {.iov_base = "\n", .iov_len = 1},
+    {.iov_base = (void*)text, .iov_len = len},
+  };
+  write_out(iov, 3);
+}
+
+// Print help message for available flags
+void PrintHelp(flag_ctx* ctx, char** argv) {
+  flag_error err;
+  cache_settle(ctx, &err);  // Cannot fail: the parse that wrote the cache read the same files.
+  if (!help_current(ctx)) {
+    flag_text t = {0};
+    text_printf(&t, "Global flags:\n");
+    render_flags(&t, &ctx->flags, "  -%-*s --%s(%s) <%s>: %s%s\n\n");
+
+    // Remember where each subcommand starts, for PrintSubCmdHelp.
+    flag_free(ctx->help_sections);
+    ctx->help_sections =
+      (size_t*)flag_alloc((ctx->num_subcommands + 1) * sizeof(size_t), _Alignof(size_t));
+    f_assert(ctx->help_sections != NULL, "[ERROR]: Unable to allocate help sections\n");
+
+    text_printf(&t, "Subcommands:\n");
+    for (size_t i = 0; i < ctx->num_subcommands; i++) {
+      ctx->help_sections[i] = t.len;
+      render_subcommand(&t, ctx->subcommands[i]);
+    }
+    ctx->help_sections[ctx->num_subcommands] = t.len;
+    text_printf(&t, "\n");
+
+    flag_free(ctx->help);
+    ctx->help = t.data;
+    ctx->help_len = t.len;
+    ctx->help_flags = help_flags(ctx);
+    ctx->help_version = ctx->defaults_version;
+  }
+
+  write_help(argv[0], ctx->help, ctx->help_len);
+}
+
+void PrintSubCmdHelp(flag_ctx* ctx, const subcommand* subcmd, char** argv) {
+  flag_error err;
+  cache_settle(ctx, &err);
+  if (help_current(ctx)) {
+    for (size_t i = 0; i < ctx->num_subcommands; i++) {
+      if (ctx->subcommands[i] == subcmd) {
+        size_t start = ctx->help_sections[i];
+        write_help(argv[0], ctx->help + start, ctx->help_sections[i + 1] - start);
+        return;
+      }
+    }
+  }
+
+  // Without a current cache, only this section is rendered.
+  flag_text t = {0};
+  render_subcommand(&t, subcmd);
+  write_help(argv[0], t.data, t.len);
+  flag_free(t.data);
+}
+
+static int compare_flag_names(const void* a, const void* b) {
+  return strcmp((*(flag* const*)a)->name, (*(flag* const*)b)->name);
+}
+
+static int compare_subcommand_names(const void* a, const void* b) {
+  return strcmp((*(subcommand* const*)a)->name, (*(subcommand* const*)b)->name);
+}
+
+// Sort the flags of set by name, unless sorted is current.
+static void set_sorted(flag_set* set) {
+  if (set->sorted_count == set->count) {
+    return;
+  }
+  set->sorted = (flag**)arena_alloc(set->arena, (set->count + 1) * sizeof(flag*));
+  memcpy(set->sorted, set->list, set->count * sizeof(flag*));
+  qsort(set->sorted, set->count, sizeof(flag*), compare_flag_names);
+  set->sorted_count = set->count;
+}
+
+// Store in out the first of the n items, sorted by name, whose name is not less than
+// prefix. name_of(item) is the name of an item.
+#define LOWER_BOUND(items, n, name_of, prefix, out)                                                \
+  do {                                                                                             \
+    size_t lo = 0, hi = (n);                                                                       \
+    while (lo < hi) {                                                                              \
+      size_t mid = lo + (hi - lo) / 2;                                                             \
+      if (strcmp(name_of((items)[mid]), (prefix)) < 0) {                                           \
+        lo = mid + 1;                                                                              \
+      } else {                                                                                     \
+        hi = mid;                                                                                  \
+      }                                                                                            \
+    }                                                                                              \
+    (out) = lo;                                                                                    \
+  } while (0)
+
+#define FLAG_NAME_OF(f) ((f)->name)
+#define SUBCMD_NAME_OF(s) ((s)->name)
+
+// Append the flags of set whose name starts with prefix, each behind dashes.
+static void complete_flags(flag_text* t, flag_set* set, const char* dashes, const char* prefix) {
+  set_sorted(set);
+  size_t len = strlen(prefix);
+  size_t i;
+  LOWER_BOUND(set->sorted, set->count, FLAG_NAME_OF, prefix, i);
+  for (; i < set->count && strncmp(set->sorted[i]->name, prefix, len) == 0; i++) {
+    text_printf(t, "%s%s\n", dashes, set->sorted[i]->name);
+  }
+}
+
+// Sort the subcommands of level by name, unless sorted is current.
+static void subcmds_sorted(flag_subcmds* level, flag_arena* arena) {
+  if (level->sorted_count == level->count) {
+    return;
+  }
+  level->sorted = (subcommand**)arena_alloc(arena, (level->count + 1) * sizeof(subcommand*));
+  memcpy(level->sorted, level->list, level->count * sizeof(subcommand*));
+  qsort(level->sorted, level->count, sizeof(subcommand*), compare_subcommand_names);
+  level->sorted_count = level->count;
+}
+
+void PrintCompletions(flag_ctx* ctx, int num_words, char** words) {
+  const char* prefix = num_words > 0 ? words[num_words - 1] : "";
+  index_subcommands(ctx);
+
+  // Follow the subcommands named by the words before the one being completed.
+  subcommand* subcmd = NULL;
+  for (int i = 0; i < num_words - 1; i++) {
+    subcommand* next = find_subcommand(subcmd ? &subcmd->children : &ctx->children, words[i],
+                                       ctx->subcmd_prefixes);
+    subcmd = next ? next : subcmd;
+  }
+
+  // Nothing to offer for the value of a flag that takes one. Nested subcommands take the
+  // flags of the levels above them too.
+  if (num_words >= 2 && words[num_words - 2][0] == '-') {
+    const char* name = words[num_words - 2] + 1;
+    name += *name == '-';
+    flag* f = subcmd ? NULL : set_find(&ctx->flags, name);
+    for (subcommand* level = subcmd; level != NULL && f == NULL; level = level->parent) {
+      f = set_find(&level->flags, name);
+    }
+    if (f != NULL && flag_types[f->type].implied_value == NULL) {
+      return;
+    }
+  }
+
+  flag_text t = {0};
+  if (prefix[0] == '-') {
+    const char* dashes = prefix[1] == '-' ? "--" : "-";
+    if (subcmd == NULL) {
+      complete_flags(&t, &ctx->flags, dashes, prefix + strlen(dashes));
+    }
+    for (subcommand* level = subcmd; level != NULL; level = level->parent) {
+      complete_flags(&t, &level->flags, dashes, prefix + strlen(dashes));
+    }
+  } else {
+    flag_subcmds* level = subcmd ? &subcmd->children : &ctx->children;
+    subcmds_sorted(level, &ctx->arena);
+
+    size_t len = strlen(prefix);
+    size_t i;
+    LOWER_BOUND(level->sorted, level->count, SUBCMD_NAME_OF, prefix, i);
+    for (; i < level->count && strncmp(level->sorted[i]->name, prefix, len) == 0; i++) {
+      text_printf(&t, "%s\n", level->sorted[i]->name);
+    }
+  }
+
+  struct iovec iov = {.iov_base = t.data, .iov_len = t.len};
+  write_out(&iov, 1);
+  flag_free(t.data);
+}
+
+// Append s to t quoted for a shell: in single quotes, with embedded quotes closed, escaped
+// and reopened. fish takes \' inside single quotes instead.
+static void text_quote(flag_text* t, const char* s, bool fish) {
+  text_printf(t, "'");
+  for (const char* p = s; *p != '\0'; p++) {
+    if (*p == '\'' || (fish && *p == '\\')) {
+      text_printf(t, fish ? "\\%c" : "'\\''", *p);
+    } else {
+      text_printf(t, "%c", *p);
+    }
+  }
+  text_printf(t, "'");
+}
+
+// Append the names of the flags of set, space separated, each behind a dash.
+static void text_flag_names(flag_text* t, const flag_set* set) {
+  for (size_t i = 0; i < set->count; i++) {
+    text_printf(t, "%s-%s", i > 0 ? " " : "", set->list[i]->name);
+  }
+}
+
+// Append the names of the subcommands of level, separated by sep.
+static void text_subcommand_names(flag_text* t, const flag_subcmds* level, const char* sep) {
+  for (size_t i = 0; i < level->count; i++) {
+    text_printf(t, "%s%s", i > 0 ? sep : "", level->list[i]->name);
+  }
+}
+
+// Append what bash and zsh offer inside subcmd: its flags, those of the levels above it
+// and its own subcommands.
+static void text_subcommand_words(flag_text* t, const subcommand* subcmd) {
+  size_t start = t->len;
+  for (const subcommand* level = subcmd; level != NULL; level = level->parent) {
+    if (level->flags.count > 0) {
+      text_printf(t, "%s", t->len > start ? " " : "");
+      text_flag_names(t, &level->flags);
+    }
+  }
+  if (subcmd->children.count > 0) {
+    text_printf(t, "%s", t->len > start ? " " : "");
+    text_subcommand_names(t, &subcmd->children, " ");
+  }
+}
+
+// bash and zsh find the subcommand the same way: each word that names a subcommand of the
+// one found so far descends into it, so cmd ends up as the path of the innermost one.
+static void render_subcommand_scan(flag_text* t, const flag_ctx* ctx, const char* start,
+                                   const char* end, const char* word) {
+  text_printf(t, "  local cmd=\"\" i\n");
+  text_printf(t, "  for ((i = %s; i < %s; i++)); do\n", start, end);
+  if (ctx->num_subcommands > 0) {
+    text_printf(t, "    case \"$cmd${cmd:+ }%s\" in\n      ", word);
+    for (size_t i = 0; i < ctx->num_subcommands; i++) {
+      text_printf(t, "%s", i > 0 ? "|" : "");
+      text_quote(t, ctx->subcommands[i]->path, false);
+    }
+    text_printf(t, ") cmd=\"$cmd${cmd:+ }%s\" ;;\n    esac\n", word);
+  } else {
+    text_printf(t, "    :\n");
+  }
+  text_printf(t, "  done\n");
+}
+
+static void render_bash(flag_text* t, const flag_ctx* ctx, const char* program,
+                        const char* func) {
+  text_printf(t, "# bash completion for %s. Load it with: source <(%s __completion bash)\n",
+              program, program);
+  text_printf(t, "_%s_complete() {\n", func);
+  text_printf(t, "  local cur=\"${COMP_WORDS[COMP_CWORD]}\" words\n");
+  render_subcommand_scan(t, ctx, "1", "COMP_CWORD", "${COMP_WORDS[i]}");
+  text_printf(t, "  case \"$cmd\" in\n");
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    text_printf(t, "    ");
+    text_quote(t, ctx->subcommands[i]->path, false);
+    text_printf(t, ") words=\"");
+    text_subcommand_words(t, ctx->subcommands[i]);
+    text_printf(t, "\" ;;\n");
+  }
+  text_printf(t, "    *) words=\"");
+  text_flag_names(t, &ctx->flags);
+  text_printf(t, " ");
+  text_subcommand_names(t, &ctx->children, " ");
+  text_printf(t, "\" ;;\n  esac\n");
+  text_printf(t, "  COMPREPLY=($(compgen -W \"$words\" -- \"$cur\"))\n}\n");
+  text_printf(t, "complete -o default -F _%s_complete %s\n", func, program);
+}
+
+static void render_zsh(flag_text* t, const flag_ctx* ctx, const char* program,
+                       const char* func) {
+  text_printf(t, "#compdef %s\n", program);
+  text_printf(t, "# zsh completion for %s. Save it as _%s in a directory of $fpath.\n", program,
+              program);
+  text_printf(t, "_%s() {\n", func);
+  render_subcommand_scan(t, ctx, "2", "CURRENT", "${words[i]}");
+  text_printf(t, "  case \"$cmd\" in\n");
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    text_printf(t, "    ");
+    text_quote(t, ctx->subcommands[i]->path, false);
+    text_printf(t, ") compadd -- ");
+    text_subcommand_words(t, ctx->subcommands[i]);
+    text_printf(t, " ;;\n");
+  }
+  text_printf(t, "    *) compadd -- ");
+  text_flag_names(t, &ctx->flags);
+  text_printf(t, " ");
+  text_subcommand_names(t, &ctx->children, " ");
+  text_printf(t, " ;;\n  esac\n}\n");
+  text_printf(t, "compdef _%s %s\n", func, program);
+}
+
+static void render_fish_flags(flag_text* t, const flag_set* set, const char* program,
+                              const char* condition) {
+  for (size_t i = 0; i < set->count; i++) {
+    text_printf(t, "complete -c %s -n ", program);
+    text_quote(t, condition, true);
+    text_printf(t, " -o %s", set->list[i]->name);
+    if (set->info[i].description[0] != '\0') {
+      text_printf(t, " -d ");
+      text_quote(t, set->info[i].description, true);
+    }
+    text_printf(t, "\n");
+  }
+}
+
+static void render_fish(flag_text* t, flag_ctx* ctx, const char* program, const char* func) {
+  text_printf(t, "# fish completion for %s. Load it with: %s __completion fish | source\n",
+              program, program);
+
+  // __func_cmd prints the path of the subcommand typed so far, found like the bash scan.
+  // __func_at tells whether that is exactly its argument, __func_in whether it is the
+  // argument or a subcommand below it.
+  text_printf(t, "function __%s_cmd\n  set -l cmd\n", func);
+  text_printf(t, "  for word in (commandline -opc)[2..-1]\n");
+  text_printf(t, "    set -l next (string join ' ' -- $cmd $word)\n");
+  text_printf(t, "    if contains -- $next");
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    text_printf(t, " ");
+    text_quote(t, ctx->subcommands[i]->path, true);
+  }
+  text_printf(t, "\n      set cmd $next\n    end\n  end\n  string join ' ' -- $cmd\nend\n");
+  text_printf(t, "function __%s_at\n", func);
+  text_printf(t, "  test (__%s_cmd | string collect) = \"$argv[1]\"\nend\n", func);
+  text_printf(t, "function __%s_in\n  set -l cmd (__%s_cmd | string collect)\n", func, func);
+  text_printf(t, "  test \"$cmd\" = \"$argv[1]\"\n");
+  text_printf(t, "  or string match -q -- \"$argv[1] *\" \"$cmd\"\nend\n");
+
+  // Global flags and top level subcommands are offered before any subcommand. The flags of
+  // a level stay on offer inside the levels below it.
+  char condition[MAX_DESCRIPTION];
+  snprintf(condition, sizeof(condition), "__%s_at ''", func);
+  render_fish_flags(t, &ctx->flags, program, condition);
+  for (size_t i = 0; i < ctx->num_subcommands; i++) {
+    const subcommand* subcmd = ctx->subcommands[i];
+    snprintf(condition, sizeof(condition), "__%s_at '%s'", func,
+             subcmd->parent != NULL ? subcmd->parent->path : "");
+    text_printf(t, "complete -c %s -n ", program);
+    text_quote(t, condition, true);
+    text_printf(t, " -f -a %s", subcmd->name);
+    if (subcmd->description[0] != '\0') {
+      text_printf(t, " -d ");
+      text_quote(t, subcmd->description, true);
+    }
+    text_printf(t, "\n");
+
+    snprintf(condition, sizeof(condition), "__%s_in '%s'", func, subcmd->path);
+    render_fish_flags(t, &subcmd->flags, program, condition);
+  }
+}
+
+int PrintCompletionScript(flag_ctx* ctx, const char* shell, const char* program) {
+  // Shell function names only take identifier characters.
+  const char* base = strrchr(program, '/');
+  base = base ? base + 1 : program;
+  char func[MAX_NAME];
+  size_t n = 0;
+  for (const char* p = base; *p != '\0' && n < sizeof(func) - 1; p++) {
+    func[n++] = isalnum((unsigned char)*p) ? *p : '_';
+  }
+  func[n] = '\0';
+
+  flag_text t = {0};
+  if (strcmp(shell, "bash") == 0) {
+    render_bash(&t, ctx, base, func);
+  } else if (strcmp(shell, "zsh") == 0) {
+    render_zsh(&t, ctx, base, func);
+  } else if (strcmp(shell, "fish") == 0) {
+    render_fish(&t, ctx, base, func);
+  } else {
+    return -1;
+  }
+
+  struct iovec iov = {.iov_base = t.data, .iov_len = t.len};
+  write_out(&iov, 1);
+  flag_free(t.data);
+  return 0;
+}
+
+// Convert flag type to a string for printing
+const char* flagAsString(flag_type type) {
+  return flag_type_known(type) ? flag_types[type].name : "unknown";
 }
@@ -45,11 +45,47 @@
 #endif
 
 #ifndef MAX_GLOBAL_FLAGS
-#define MAX_GLOBAL_FLAGS 24  // Maximum number of global flags
+#define MAX_GLOBAL_FLAGS 24  // Initial capacity for global flags. Grows as needed.
 #endif
 
 #ifndef MAX_SUBCOMMANDS
-#define MAX_SUBCOMMANDS 10  // Maximum number of subcommands
+#define MAX_SUBCOMMANDS 10  // Initial capacity for subcommands. Grows as needed.
+#endif
+
+#ifndef FLAG_MAX_SUBCMD_DEPTH
+#define FLAG_MAX_SUBCMD_DEPTH 8  // Levels of subcommands, top level included.
+#endif
+
+#ifndef FLAG_SET_MIN_CAPACITY
+#define FLAG_SET_MIN_CAPACITY 8  // Initial flag capacity of a subcommand without a capacity hint
+#endif
+
+#ifndef FLAG_ARENA_BLOCK_SIZE
+#define FLAG_ARENA_BLOCK_SIZE 4096  // Size of the first arena block. Later blocks double.
+#endif
+
+#ifndef FLAG_LIST_MIN_CAPACITY
+#define FLAG_LIST_MIN_CAPACITY 16  // Initial element capacity of a list flag. Grows by doubling.
+#endif
+
+#ifndef FLAG_RESPONSE_DEPTH
+#define FLAG_RESPONSE_DEPTH 8  // Maximum nesting of @file response files.
+#endif
+
+#ifndef FLAG_MAX_TYPES
+#define FLAG_MAX_TYPES 32  // Maximum number of flag types, built-in and registered.
+#endif
+
+#ifndef FLAG_CACHE_LINE
+#define FLAG_CACHE_LINE 64  // flag_result blocks are padded to whole cache lines of this size.
+#endif
+
+#ifndef FLAG_BATCH_CHUNK
+#define FLAG_BATCH_CHUNK 64  // Items a ParseFlagsBatch worker claims at a time.
+#endif
+
+#ifndef FLAG_SCHEMA_SEED
+#define FLAG_SCHEMA_SEED 0x9E3779B1u  // Odd multiplier that spreads name hashes over index slots
 #endif
 
 void inline realdbgprintf(const char* SourceFilename, int SourceLineno, const char* CFormatString,
@@ -81,6 +117,56 @@ void inline realdbgprintf(const char* SourceFilename, int SourceLineno, const ch
 #endif
 
 
+// Multiplier of the polynomial name hash: hash = sum(name[k] * FLAG_HASH_MULT^(k + 1)).
+// Unlike FNV, trailing NUL bytes do not change the sum, which lets FLAG_HASH_LITERAL
+// evaluate the same hash as the runtime lookup inside a constant initializer.
+#define FLAG_HASH_MULT 0x01000193u
+
+// Character k of string literal s, or 0 past its end.
+#define FLAG_HASH_CHAR(s, k, pow)                                                                  \
+  ((k) < sizeof(s) - 1 ? (uint32_t)(unsigned char)(s)[(k) < sizeof(s) ? (k) : 0] * (pow) : 0u)
+
+// Compile-time hash of a string literal of up to 63 characters.
+#define FLAG_HASH_LITERAL(s)                                                                       \
+  ((uint32_t)(                                                                                     \
+    FLAG_HASH_CHAR(s, 0, 0x01000193u) + FLAG_HASH_CHAR(s, 1, 0x26027a69u)                          \
+    + FLAG_HASH_CHAR(s, 2, 0x3ee6b34bu) + FLAG_HASH_CHAR(s, 3, 0x502c3f11u)                        \
+    + FLAG_HASH_CHAR(s, 4, 0x46a747c3u) + FLAG_HASH_CHAR(s, 5, 0xfc55f7f9u)                        \
+    + FLAG_HASH_CHAR(s, 6, 0x34555cfbu) + FLAG_HASH_CHAR(s, 7, 0x5d615f21u)                        \
+    + FLAG_HASH_CHAR(s, 8, 0x2148c0f3u) + FLAG_HASH_CHAR(s, 9, 0x5887be89u)                        \
+    + FLAG_HASH_CHAR(s, 10, 0xe6b0f1abu) + FLAG_HASH_CHAR(s, 11, 0xd38c7031u)                      \
+    + FLAG_HASH_CHAR(s, 12, 0x37149d23u) + FLAG_HASH_CHAR(s, 13, 0xd8735e19u)                      \
+    + FLAG_HASH_CHAR(s, 14, 0xd69d215bu) + FLAG_HASH_CHAR(s, 15, 0x345b8241u)                      \
+    + FLAG_HASH_CHAR(s, 16, 0xad0e0c53u) + FLAG_HASH_CHAR(s, 17, 0xc01d66a9u)                      \
+    + FLAG_HASH_CHAR(s, 18, 0x17489c0bu) + FLAG_HASH_CHAR(s, 19, 0xb24da551u)                      \
+    + FLAG_HASH_CHAR(s, 20, 0x013b3e83u) + FLAG_HASH_CHAR(s, 21, 0x73436839u)                      \
+    + FLAG_HASH_CHAR(s, 22, 0xac1d11bbu) + FLAG_HASH_CHAR(s, 23, 0xacc2e961u)                      \
+    + FLAG_HASH_CHAR(s, 24, 0x57d563b3u) + FLAG_HASH_CHAR(s, 25, 0xf7ebf2c9u)                      \
+    + FLAG_HASH_CHAR(s, 26, 0x116f326bu) + FLAG_HASH_CHAR(s, 27, 0xdd0c5e71u)                      \
+    + FLAG_HASH_CHAR(s, 28, 0x6b78abe3u) + FLAG_HASH_CHAR(s, 29, 0x11f69659u)                      \
+    + FLAG_HASH_CHAR(s, 30, 0xa02eae1bu) + FLAG_HASH_CHAR(s, 31, 0x447c1481u)                      \
+    + FLAG_HASH_CHAR(s, 32, 0x50544713u) + FLAG_HASH_CHAR(s, 33, 0x87abe2e9u)                      \
+    + FLAG_HASH_CHAR(s, 34, 0x7c9634cbu) + FLAG_HASH_CHAR(s, 35, 0xeb751b91u)                      \
+    + FLAG_HASH_CHAR(s, 36, 0x3a5a6543u) + FLAG_HASH_CHAR(s, 37, 0x1f4d6879u)                      \
+    + FLAG_HASH_CHAR(s, 38, 0xbfdb767bu) + FLAG_HASH_CHAR(s, 39, 0x817b83a1u)                      \
+    + FLAG_HASH_CHAR(s, 40, 0x76703673u) + FLAG_HASH_CHAR(s, 41, 0xe5a5b709u)                      \
+    + FLAG_HASH_CHAR(s, 42, 0x8cdf232bu) + FLAG_HASH_CHAR(s, 43, 0xee445cb1u)                      \
+    + FLAG_HASH_CHAR(s, 44, 0xc69deaa3u) + FLAG_HASH_CHAR(s, 45, 0x4d985e99u)                      \
+    + FLAG_HASH_CHAR(s, 46, 0xbfdceadbu) + FLAG_HASH_CHAR(s, 47, 0xe3c5b6c1u)                      \
+    + FLAG_HASH_CHAR(s, 48, 0x513eb1d3u) + FLAG_HASH_CHAR(s, 49, 0xb8b1ef29u)                      \
+    + FLAG_HASH_CHAR(s, 50, 0xe91b7d8bu) + FLAG_HASH_CHAR(s, 51, 0x8146a1d1u)                      \
+    + FLAG_HASH_CHAR(s, 52, 0x5330bc03u) + FLAG_HASH_CHAR(s, 53, 0xf8b7f8b9u)                      \
+    + FLAG_HASH_CHAR(s, 54, 0x429c8b3bu) + FLAG_HASH_CHAR(s, 55, 0x176f2de1u)                      \
+    + FLAG_HASH_CHAR(s, 56, 0xc5053933u) + FLAG_HASH_CHAR(s, 57, 0x5a390b49u)                      \
+    + FLAG_HASH_CHAR(s, 58, 0x50ccc3ebu) + FLAG_HASH_CHAR(s, 59, 0x1d586af1u)                      \
+    + FLAG_HASH_CHAR(s, 60, 0x23305963u) + FLAG_HASH_CHAR(s, 61, 0xc81cb6d9u)                      \
+    + FLAG_HASH_CHAR(s, 62, 0xde33d79bu)                                                           \
+  ))
+
+// Slot of a hash in an index of 2^bits entries (Fibonacci hashing with an odd seed).
+#define FLAG_HASH_SLOT(hash, seed, bits) ((uint32_t)((uint32_t)(hash) * (seed)) >> (32 - (bits)))
+
+
 // Supported flag types
 typedef enum {
   FLAG_BOOL,     // bool
@@ -99,15 +185,62 @@ typedef enum {
   FLAG_FLOAT,    // float
   FLAG_DOUBLE,   // double
   FLAG_STRING,   // char *
+
+  // Lists, stored in a flag_list. Every occurrence of the flag appends to the list. Number
+  // lists also split each value on commas: -ids 1,2,3 -ids 4.
+  FLAG_INT_LIST,     // flag_list of int
+  FLAG_DOUBLE_LIST,  // flag_list of double
+  FLAG_STRING_LIST,  // flag_list of char *
+
+  // Quantities with a unit suffix, converted in the same pass as their digits.
+  FLAG_DURATION,  // int64_t nanoseconds: 250ms, 1.5h, 1h30m. Every number needs a unit but 0.
+  FLAG_BYTES,     // int64_t bytes: 512, 64KiB, 1.5GB. K, M... are KiB, MiB..., kB, MB... decimal.
+  FLAG_RATE,      // double per second: 100, 10k/s, 2.5M/h, 5/ms.
+
+  FLAG_TYPE_CUSTOM,  // First type handed out by RegisterFlagType.
 } flag_type;
 
+// Conversion functions of a flag type.
+typedef struct flag_type_ops {
+  const char* name;  // Type name shown in help, e.g. "duration".
+  size_t size;       // Size of the variable that a flag of this type points to.
+
+  // Convert arg and store it in *value. Return NULL on success, or a short reason on
+  // failure, in which case *value must be left untouched. *err_pos may be set to the
+  // offset of the offending character in arg.
+  const char* (*parse)(const char* arg, void* value, const void* data, size_t* err_pos);
+
+  // Write *value as text into buf like snprintf. Used to show defaults in help. Optional.
+  int (*format)(const void* value, char* buf, size_t len, const void* data);
+
+  const void* data;           // Passed through to parse and format. Optional.
+  const char* implied_value;  // Parsed when the value is omitted, e.g. "true" for bool.
+  const char* hint;           // Shown in help after the type name, e.g. the units. Optional.
+} flag_type_ops;
+
+// Value of a list flag: count elements of the list's element type, back to back in items.
+// The parser builds lists in an arena that is reset by the next parse. The first
+// occurrence of a flag in a parse replaces the default list, which should have capacity 0.
+typedef struct flag_list {
+  void* items;      // Elements. int*, double* or char** depending on the flag type.
+  size_t count;     // Number of elements.
+  size_t capacity;  // Elements that fit in items. 0 for lists the parser did not build.
+} flag_list;
+
+// Register a new flag type. ops is copied. Returns the type to pass as .type to AddFlag.
+// Register types before creating flags that use them.
+flag_type RegisterFlagType(const flag_type_ops* ops);
+
 // subcommand handler arguments passed to the subcommand handler.
 // Get the value of a flag by name using flag_value.
 // Get the value of a global flag by name using flag_value_ctx.
 typedef struct FlagArgs {
-  struct flag* flags;    // subcommand flags
-  int num_flags;         // number of flags for subcommand
-  struct flag_ctx* ctx;  // global ctx(to access other global flags)
+  struct flag** flags;        // subcommand flags
+  int num_flags;              // number of flags for subcommand
+  struct flag_ctx* ctx;       // global ctx(to access other global flags)
+  char** positionals;         // Positional arguments, see FlagPositionals.
+  size_t num_positionals;     // Number of positional arguments.
+  struct subcommand* subcmd;  // The subcommand being run, whose index FlagValueArgs uses.
 } FlagArgs;
 
 
@@ -115,9 +248,16 @@ typedef struct flag_validator flag_validator;
 typedef struct flag flag;
 typedef struct subcommand subcommand;
 typedef struct flag_ctx flag_ctx;
+typedef struct flag_result flag_result;
 typedef bool (*validator)(const void* value);
 typedef void (*flag_handler)(FlagArgs args);
 
+// Inclusive bounds of a number flag, see flag_params.range.
+typedef struct flag_range {
+  double min;
+  double max;
+} flag_range;
+
 // Parameter struct for flag creation.
 typedef struct flag_params {
   const char* name;  // Name of flag
@@ -125,6 +265,24 @@ typedef struct flag_params {
   flag_type type;    // Type of flag
   const char* desc;  // Description
   bool req;          // Required
+  bool copy;         // FLAG_STRING(_LIST) only: copy the value instead of pointing into argv.
+  const char* env;   // Environment variable read by LoadFlagEnv. Optional.
+  bool lazy;         // Convert and validate on first access. Getters exit on a bad value.
+  bool reload;       // May be changed by ReloadFlagConfig while the program runs.
+
+  // Declarative checks, compiled when the flag is added. Optional.
+  //
+  //   .range = &(flag_range){1, 65535}               number flags and number lists
+  //   .choices = (const char*[]){"a", "b", NULL}     string flags and string lists
+  //   .pattern = "[a-z][a-z0-9-]*"                   string flags and string lists
+  //
+  // Ranges are checked while the digits are converted and reported as invalid values.
+  // Choices are a hash set. Patterns support characters, ., [classes], \d \w \s and their
+  // negations, and the quantifiers ? * + {m} {m,} {m,n}, but no groups or alternation;
+  // they must match the whole value and run in time linear in its length.
+  const flag_range* range;
+  const char* const* choices;
+  const char* pattern;
 } flag_params;
 
 // Parameter struct for subcommand creation.
@@ -132,7 +290,7 @@ typedef struct subcmd_params {
   const char* name;      // Name of subcommand
   const char* desc;      // Description
   flag_handler handler;  // Subcommand handler
-  size_t capacity;       // Maximum number of flags(capacity)
+  size_t capacity;       // Expected number of flags. Optional, the flag list grows as needed.
 } subcmd_params;
 
 // Create a global flag context. Must be freed with DestroyFlagContext.
@@ -141,14 +299,61 @@ flag_ctx* CreateFlagContext(void);
 // Free memory used by flag_ctx flags.
 void DestroyFlagContext(flag_ctx* ctx);
 
+// Allocator for all memory the library allocates: contexts, their arenas and results.
+// alloc returns size bytes aligned to alignment, a power of two, or NULL. data is passed
+// through to both functions.
+typedef struct flag_allocator {
+  void* (*alloc)(size_t size, size_t alignment, void* data);
+  void (*free)(void* ptr, void* data);
+  void* data;
+} flag_allocator;
+
+// Route every allocation of the library through allocator, which is copied. NULL goes back
+// to malloc and free. Only change the allocator while no context or result exists.
+void SetFlagAllocator(const flag_allocator* allocator);
+
+#ifdef FLAG_STATS
+// Counters kept for every context when the library is built with -DFLAG_STATS. They cover
+// creating the context, adding flags and subcommands, and ParseFlags/ParseFlagsEx, and add
+// up until ResetFlagStats. Times are in nanoseconds. Parses of frozen contexts
+// (ParseFlagsInto, ParseFlagsBatch) are not counted.
+typedef struct flag_stats {
+  uint64_t register_ns;   // Adding flags and subcommands.
+  uint64_t global_ns;     // Parsing global flags, up to the subcommand.
+  uint64_t subcmd_ns;     // Parsing the flags of the subcommand, up to the required check.
+  uint64_t validate_ns;   // Validators, the required check and the flag groups, after the
+                          // flags are read. Ranges are checked inside the passes.
+  uint64_t parses;        // Calls to ParseFlags and ParseFlagsEx.
+  uint64_t lookups;       // Flag name lookups.
+  uint64_t compares;      // Name comparisons made by lookups, beyond the hash check.
+  uint64_t allocs;        // Allocations from the flag_allocator.
+  uint64_t alloc_bytes;   // Bytes requested by those allocations.
+  uint64_t strdups;       // Strings copied into the context: names, descriptions, .copy.
+  uint64_t strdup_bytes;  // Bytes of those copies.
+} flag_stats;
+
+// Counters of ctx, updated in place until ctx is destroyed.
+const flag_stats* FlagStats(const flag_ctx* ctx);
+
+// Set all counters of ctx to zero.
+void ResetFlagStats(flag_ctx* ctx);
+#endif
+
 // Implementation files.
+#ifndef FLAG_SCHEMA
 extern flag* _flag_add(flag_ctx* ctx, flag_params* params);
+#endif
 extern subcommand* _flag_add_subcommand(flag_ctx* ctx, subcmd_params* params);
 extern flag* _subcommand_add_flag(subcommand* subcmd, flag_params* params);
+extern subcommand* _subcommand_add_subcommand(subcommand* parent, subcmd_params* params);
 
-// Add a flag to the flag context
+#ifndef FLAG_SCHEMA
+// Add a flag to the flag context.
+// The returned flag stays valid until the context is destroyed. The context and each
+// subcommand hold at most 65535 flags; adding more prints an error and exits.
 #define AddFlag(ctx, ...)                                                                          \
   _flag_add(ctx, &(flag_params){.req = false, .type = FLAG_INT, __VA_ARGS__})
+#endif
 
 // Add subcommand to the flag context
 #define AddSubCmd(ctx, ...) _flag_add_subcommand(ctx, &(subcmd_params){.capacity = 0, __VA_ARGS__})
@@ -156,23 +361,318 @@ extern flag* _subcommand_add_flag(subcommand* subcmd, flag_params* params);
 #define AddSubCmdFlag(subcmd, ...)                                                                 \
   _subcommand_add_flag(subcmd, &(flag_params){.req = false, .type = FLAG_INT, __VA_ARGS__})
 
+// Add a subcommand nested in parent, as "node" in "prog cluster node drain". A nested
+// subcommand also accepts the flags of every level above it, and is written as
+// "cluster.node.flag" in config files. ParseFlags selects the innermost subcommand given.
+#define AddNestedSubCmd(parent, ...)                                                               \
+  _subcommand_add_subcommand(parent, &(subcmd_params){.capacity = 0, __VA_ARGS__})
+
+// Let a unique prefix of a subcommand name select it, so "st" runs "status" unless another
+// subcommand at that level starts with "st" too. An exact name always wins. Off by default.
+void AllowSubCmdPrefixes(flag_ctx* ctx, bool allow);
+
+// Static flag schema.
+//
+// Tools with a fixed set of global flags can declare them at build time instead of calling
+// AddFlag. Describe the flags with an X-macro table in a header, one entry per line
+// (continued with a backslash):
+//
+//   extern int port;
+//   extern char* host;
+//
+//   #define FLAG_SCHEMA_TABLE(X)
+//     X("port", port, FLAG_INT, "Port to listen on", false)
+//     X("host", host, FLAG_STRING, "Address to bind", true)
+//
+// The second column is the variable (with external linkage) that receives the value.
+// Generate the perfect-hash index for the table with flaggen.c, then compile flag.c with
+// -DFLAG_SCHEMA='"app_flags.h"' -DFLAG_SCHEMA_INDEX='"app_flags_index.h"'.
+//
+// flag.c turns the table into constant flag records and uses the generated index as is,
+// so CreateFlagContext registers nothing. AddFlag and AddValidator, which would write to
+// those records, are not declared in this mode. Subcommands are still added at runtime.
+
+// Validators get a pointer to the value of the flag: a flag_list for list flags. A
+// validator that returns false fails the parse with FLAG_ERR_VALIDATION and err_msg.
+//
+// Validators, choices and patterns all run in one pass after argv is read, once per
+// parse for every flag that was given, in this order: choices, pattern, the validator set
+// by SetValidator, then those added by AddValidator. Values from config files and the
+// environment are validated as they are loaded, lazy flags when they are resolved.
+
+// Set the validator of flag, replacing the previous one.
 void SetValidator(flag* flag, validator val, const char* err_msg);
 
+// Stack another validator on f, a global flag of ctx or a flag of subcmd.
+#ifndef FLAG_SCHEMA
+void AddValidator(flag_ctx* ctx, flag* f, validator val, const char* err_msg);
+#endif
+void AddSubCmdValidator(subcommand* subcmd, flag* f, validator val, const char* err_msg);
+
+// Constraints between flags of one set: the global flags, or the flags of one subcommand.
+// They are checked after parsing, together with the required flags. A value from a config
+// file or the environment counts as given, except for FLAG_GROUP_EXCLUSIVE, so that the
+// command line can still pick another flag of the group.
+typedef enum flag_group_kind {
+  FLAG_GROUP_EXCLUSIVE,  // At most one of the flags may be given.
+  FLAG_GROUP_ONE_OF,     // At least one of the flags must be given.
+  FLAG_GROUP_REQUIRES,   // When the first flag is given, all the others must be given too.
+} flag_group_kind;
+
+extern void _flag_add_group(flag_ctx* ctx, flag_group_kind kind, flag** flags);
+extern void _subcommand_add_group(subcommand* subcmd, flag_group_kind kind, flag** flags);
+
+// Add a group of two or more global flags, as returned by AddFlag:
+//
+//   AddFlagGroup(ctx, FLAG_GROUP_EXCLUSIVE, json_flag, yaml_flag);
+#define AddFlagGroup(ctx, kind, ...) _flag_add_group(ctx, kind, (flag*[]){__VA_ARGS__, NULL})
+
+// Add a group of two or more flags of subcmd.
+#define AddSubCmdFlagGroup(subcmd, kind, ...)                                                      \
+  _subcommand_add_group(subcmd, kind, (flag*[]){__VA_ARGS__, NULL})
+
+// Result of ParseFlagsEx.
+typedef enum {
+  FLAG_OK,                 // Parsed successfully.
+  FLAG_HELP,               // -help was given. Nothing after it was parsed.
+  FLAG_ERR_MISSING_VALUE,  // A flag that takes a value was the last argument.
+  FLAG_ERR_INVALID_VALUE,  // A value could not be converted to the flag type.
+  FLAG_ERR_VALIDATION,     // A validator rejected a value.
+  FLAG_ERR_REQUIRED,       // A required flag was not given.
+  FLAG_ERR_UNKNOWN_FLAG,   // A config file names a flag that does not exist.
+  FLAG_ERR_IO,             // A config or response file could not be read.
+  FLAG_ERR_CONFLICT,       // Two flags of a FLAG_GROUP_EXCLUSIVE group were given.
+} flag_status;
+
+// Details of a failed parse. Strings point into the context or argv.
+typedef struct flag_error {
+  flag_status status;
+  const char* flag;    // Name of the offending flag, or NULL.
+  const char* type;    // Type name of the offending flag, or NULL.
+  int index;           // argv index of the offending argument, or -1.
+  const char* value;   // The rejected value, or NULL.
+  const char* reason;  // Why the value was rejected, or NULL.
+  size_t offset;       // Offset of the offending character in value, or SIZE_MAX.
+  const char* file;    // Config or response file the value came from, or NULL for argv.
+  int line;            // Line in file, or 0.
+  const char* env;     // Environment variable being applied, or NULL.
+  const char* other;   // The other flag of a conflict, or the flag that requires flag.
+} flag_error;
+
 // Parses global flags subcommands and their flags and performs validation.
+// Prints an error and exits on failure, and prints help and exits on -help.
+//
+// An argument of the form @path is replaced by the arguments in the file at path, which
+// are separated by whitespace and may be quoted with '...' or "..." or escaped with a
+// backslash. Response files may name other response files, up to FLAG_RESPONSE_DEPTH deep.
+// String values from a response file stay valid until the next parse.
 subcommand* ParseFlags(flag_ctx* ctx, int argc, char* argv[]);
 
+// Like ParseFlags, but never prints or exits. Stores the selected subcommand (or NULL) in
+// *subcmd and the details of a failure in *err. Either may be NULL.
+// Safe to call repeatedly on the same context.
+flag_status ParseFlagsEx(flag_ctx* ctx, int argc, char* argv[], subcommand** subcmd,
+                         flag_error* err);
+
+// Load flag values from a config file of "name = value" lines. Subcommand flags are
+// written "subcmd.name = value". Blank lines and lines starting with '#' are skipped,
+// values may be quoted, and a flag with an implied value (bool) may be given without one.
+//
+// The values become the flag defaults, so for every later parse argv overrides the file
+// and the file overrides the defaults set in code. The file is mapped and tokenized in
+// place, and string values point into the mapping, which stays valid until the context
+// is destroyed. Must be called before FreezeFlagContext. Never prints or exits.
+flag_status LoadFlagConfig(flag_ctx* ctx, const char* path, flag_error* err);
+
+// Set the flags declared with .env from the environment, in a single pass over environ.
+// Like a config file, the values become the flag defaults, so argv still takes precedence.
+// When combined with LoadFlagConfig, the source loaded last wins. Must be called before
+// FreezeFlagContext. Never prints or exits.
+flag_status LoadFlagEnv(flag_ctx* ctx, flag_error* err);
+
+// Cache the result of the next ParseFlags/ParseFlagsEx in the file at path. When the
+// cache holds a result for the same argv, flags, defaults, environment and unchanged config
+// and response files, the parse restores it instead of reading the files and converting
+// the arguments. Otherwise the parse runs as usual and a successful result replaces the
+// cache. Bump version whenever the program changes how it validates flags.
+//
+// Must be called before LoadFlagConfig and LoadFlagEnv, which are then deferred until
+// the parse and skipped on a hit; their errors are returned by the parse. After a hit,
+// they are applied when a later parse, load, PrintHelp or FreezeFlagContext needs the
+// defaults, without changing the restored values. Only contexts without custom flag types
+// are cached. Not for frozen contexts.
+void SetFlagCache(flag_ctx* ctx, const char* path, uint32_t version);
+
+// Re-read the config files loaded with LoadFlagConfig that changed since they were read,
+// and publish the new values of their .reload flags. Only flags declared with .reload
+// change; the other lines of a file take effect at the next start. Flags the last parse
+// took from the command line keep their values, and the reload only replaces the default
+// a later parse without them goes back to. Flags whose lines were removed keep their last
+// values. A file with an unknown key or an invalid value changes nothing and the
+// error names it, so a typo never leaves the program half reloaded; it is only read again
+// once it changes. Lazy, copied, list and custom flags cannot be reloadable.
+//
+// Each value is published with a single atomic store, so other threads may keep reading
+// reloadable flags while a reload runs, without a lock: read them with the typed getters
+// (FlagInt and so on), which load them atomically, rather than through the pointers of
+// FlagValue and FlagValueCtx. Reloaded strings are copied into storage owned by ctx, one
+// copy per distinct value, and stay valid until the context is destroyed, so a reader may
+// keep any string it loaded. The files loaded by LoadFlagConfig stay mapped until then
+// too. Reloads must not run concurrently with each other, with parsing or with adding
+// flags to ctx. Not for frozen contexts or contexts with a parse cache. Never prints or
+// exits.
+flag_status ReloadFlagConfig(flag_ctx* ctx, flag_error* err);
+
+// Called by the watcher of WatchFlagConfig after every reload, with err->status set to
+// FLAG_OK if it succeeded.
+typedef void (*flag_reload_handler)(flag_ctx* ctx, const flag_error* err);
+
+// Start a thread that calls ReloadFlagConfig whenever one of the config files of ctx is
+// written or replaced, then handler (which may be NULL). The directories of the files are
+// watched with inotify, so files replaced by a rename are followed. The thread is stopped
+// by DestroyFlagContext. Start it after the last parse. Needs Linux and threads; other
+// builds return FLAG_ERR_IO.
+flag_status WatchFlagConfig(flag_ctx* ctx, flag_reload_handler handler, flag_error* err);
+
+// Convert the value recorded for a .lazy flag by the last ParseFlags/ParseFlagsEx, then run
+// its validator. On failure the flag keeps its default. Does nothing for flags without a
+// pending value.
+//
+// WARNING: FlagValue, FlagValueCtx and the typed getters resolve lazy flags themselves on
+// first access, and when the value is invalid they print the error and call exit(). Call
+// ResolveFlag on every lazy flag before reading it to handle the error instead.
+// ParseFlagsInto and config files always convert eagerly.
+flag_status ResolveFlag(flag* flag, flag_error* err);
+
+// Describe err in buf like snprintf, without a trailing newline.
+int FlagErrorString(const flag_error* err, char* buf, size_t len);
+
+// Concurrent parsing.
+//
+// A frozen context is read-only: no flags or subcommands can be added, and ParseFlagsInto
+// never writes to it, so any number of threads can parse against it at the same time.
+// Each thread parses into its own flag_result, which holds a copy of every flag value
+// (starting from the defaults at freeze time) instead of writing through the flag value
+// pointers. Results are cache-line aligned and padded.
+
+// Freeze ctx after all flags, subcommands and validators are registered.
+void FreezeFlagContext(flag_ctx* ctx);
+
+// Allocate a result block for a frozen context. Free it with DestroyFlagResult.
+flag_result* CreateFlagResult(const flag_ctx* ctx);
+void DestroyFlagResult(flag_result* result);
+
+// Parse argv into result, which is reset to the defaults first. Never prints or exits.
+flag_status ParseFlagsInto(const flag_ctx* ctx, int argc, char* argv[], flag_result* result,
+                           flag_error* err);
+
+// Subcommand selected by the last parse into result, or NULL.
+subcommand* FlagResultSubCmd(const flag_result* result);
+
+// Positional arguments of the last parse into result, see FlagPositionals.
+char** FlagResultPositionals(const flag_result* result, size_t* count);
+
+// Value of the flag called name in result. Pass the subcommand for subcommand flags and
+// NULL for global flags. Returns NULL if there is no such flag.
+void* FlagResultValue(const flag_result* result, const subcommand* subcmd, const char* name);
+
+// One command line of a batch.
+typedef struct flag_batch_item {
+  int argc;
+  char** argv;
+  flag_result* result;  // Receives the values. If NULL, the line is only validated.
+  flag_status status;   // Set by ParseFlagsBatch.
+  flag_error error;     // Set by ParseFlagsBatch.
+} flag_batch_item;
+
+// Parse count command lines against a frozen context, spread over num_threads threads
+// (0 uses one per online CPU), and return how many failed. Items with a result must not
+// share it. Build with -DFLAG_NO_THREADS to parse the batch on the calling thread only.
+size_t ParseFlagsBatch(const flag_ctx* ctx, flag_batch_item* items, size_t count,
+                       unsigned num_threads);
+
 // Extract value of the flag by name given an array of flags.
-// Return a pointer to the value or NULL if not found.
-void* FlagValue(flag* flags, int num_flags, const char* name);
+// Return a pointer to the value or NULL if not found. Exits on an invalid lazy value, see
+// ResolveFlag. The array is searched from the start; in a handler, FlagValueArgs is faster.
+void* FlagValue(flag** flags, int num_flags, const char* name);
+
+// Like FlagValue on args->flags, but looked up through the index of the subcommand, in
+// constant time: FlagValueArgs(&args, "name").
+void* FlagValueArgs(const FlagArgs* args, const char* name);
 
-// Get value from global flag context.
+// Get value from global flag context. Exits on an invalid lazy value, see ResolveFlag.
 void* FlagValueCtx(flag_ctx* ctx, const char* name);
 
+// Positional arguments of the last parse of ctx, in order, with their number in *count:
+// the words that are neither flags, flag values nor subcommands, "-", and everything after
+// "--". Nothing is copied. When the positionals follow each other in argv, the returned
+// array is argv itself from the first of them; otherwise it is an array of pointers owned
+// by ctx. It stays valid until the next parse.
+char** FlagPositionals(const flag_ctx* ctx, size_t* count);
+
+// Typed getters, one per built-in type, taking the flag returned by AddFlag or
+// AddSubCmdFlag: int count = FlagInt(count_flag). Reading through the handle skips the name
+// lookup. Debug builds assert that the flag has the getter's type. Flags declared with
+// .reload are loaded atomically, see ReloadFlagConfig. Like FlagValue they exit on an
+// invalid lazy value, see ResolveFlag.
+#define FLAG_GETTERS(X)                                                                            \
+  X(FlagBool, bool, FLAG_BOOL)                                                                     \
+  X(FlagInt, int, FLAG_INT)                                                                        \
+  X(FlagSizeT, size_t, FLAG_SIZE_T)                                                                \
+  X(FlagInt8, int8_t, FLAG_INT8)                                                                   \
+  X(FlagInt16, int16_t, FLAG_INT16)                                                                \
+  X(FlagInt32, int32_t, FLAG_INT32)                                                                \
+  X(FlagInt64, int64_t, FLAG_INT64)                                                                \
+  X(FlagUint, unsigned int, FLAG_UINT)                                                             \
+  X(FlagUint8, uint8_t, FLAG_UINT8)                                                                \
+  X(FlagUint16, uint16_t, FLAG_UINT16)                                                             \
+  X(FlagUint32, uint32_t, FLAG_UINT32)                                                             \
+  X(FlagUint64, uint64_t, FLAG_UINT64)                                                             \
+  X(FlagUintptr, uintptr_t, FLAG_UINTPTR)                                                          \
+  X(FlagFloat, float, FLAG_FLOAT)                                                                  \
+  X(FlagDouble, double, FLAG_DOUBLE)                                                               \
+  X(FlagString, char*, FLAG_STRING)                                                                \
+  X(FlagIntList, flag_list, FLAG_INT_LIST)                                                         \
+  X(FlagDoubleList, flag_list, FLAG_DOUBLE_LIST)                                                   \
+  X(FlagStringList, flag_list, FLAG_STRING_LIST)                                                   \
+  X(FlagDuration, int64_t, FLAG_DURATION)                                                          \
+  X(FlagBytes, int64_t, FLAG_BYTES)                                                                \
+  X(FlagRate, double, FLAG_RATE)
+
+#define FLAG_DECLARE_GETTER(fn, ctype, type) ctype fn(flag* flag);
+FLAG_GETTERS(FLAG_DECLARE_GETTER)
+#undef FLAG_DECLARE_GETTER
+
 // Invoke the subcommand callback.
 void InvokeSubCmd(subcommand* subcmd, flag_ctx* ctx);
 
 // Print help message for flags in flag context.
 // Does not exit the program automatically.
+// The text is rendered once and kept on ctx until flags or subcommands are added or a
+// config file or the environment changes the defaults. Defaults are shown as they were
+// before the last parse, not as the parsed values.
 void PrintHelp(flag_ctx* ctx, char** argv);
 
+// Print the help of subcmd only: its name, description and flags.
+void PrintSubCmdHelp(flag_ctx* ctx, const subcommand* subcmd, char** argv);
+
+// Print the candidates for the last of words, one per line. words are the arguments typed
+// so far after the program name. Flags are offered for a word starting with '-' (those of
+// the subcommand, once one is typed), subcommand names otherwise, and nothing for the value
+// of a flag that takes one. Names are found by binary search over sorted name arrays; no
+// validators or handlers run. ParseFlags answers "prog __complete words..." with this once
+// EnableFlagCompletion was called.
+void PrintCompletions(flag_ctx* ctx, int num_words, char** words);
+
+// Print a completion script for shell ("bash", "zsh" or "fish") with the flags and
+// subcommands of ctx built in. program is the command name completed. Returns -1 for an
+// unknown shell. ParseFlags answers "prog __completion shell" with this once
+// EnableFlagCompletion was called.
+int PrintCompletionScript(flag_ctx* ctx, const char* shell, const char* program);
+
+// Let ParseFlags answer the shell: when argv[1] is "__complete" or "__completion" it prints
+// the completions or the script, destroys ctx and exits instead of parsing. Off by default,
+// so those words are otherwise ordinary arguments.
+void EnableFlagCompletion(flag_ctx* ctx);
+
 #endif /* __FLAG_H__ */
@@ -0,0 +1,78 @@
+// flaggen generates the perfect-hash index for a FLAG_SCHEMA table. Build it with the same
+// schema header that flag.c is compiled with and save its output:
+//
+//   gcc -DFLAG_SCHEMA='"app_flags.h"' flaggen.c -o flaggen && ./flaggen > app_flags_index.h
+//
+// Re-run it whenever flags are added, removed or renamed.
+
+#ifndef FLAG_SCHEMA
+#error "Compile flaggen with -DFLAG_SCHEMA='\"your_schema.h\"'"
+#endif
+
+#include FLAG_SCHEMA
+#include "flag.h"
+
+#define FLAGGEN_NAME(n, var, t, d, r) n,
+#define FLAGGEN_HASH(n, var, t, d, r) FLAG_HASH_LITERAL(n),
+
+static const char* names[] = {"help", FLAG_SCHEMA_TABLE(FLAGGEN_NAME)};
+static const uint32_t hashes[] = {FLAG_HASH_LITERAL("help"), FLAG_SCHEMA_TABLE(FLAGGEN_HASH)};
+
+#define NUM_NAMES (sizeof(hashes) / sizeof(hashes[0]))
+
+// Fill slots for a 2^bits table under seed. Returns false if two names share a slot.
+static bool place_names(uint32_t seed, unsigned bits, uint16_t* slots) {
+  memset(slots, 0, sizeof(uint16_t) << bits);
+  for (size_t i = 0; i < NUM_NAMES; i++) {
+    uint32_t slot = FLAG_HASH_SLOT(hashes[i], seed, bits);
+    if (slots[slot] != 0) {
+      return false;
+    }
+    slots[slot] = (uint16_t)(i + 1);
+  }
+  return true;
+}
+
+int main(void) {
+  for (size_t i = 0; i < NUM_NAMES; i++) {
+    for (size_t j = i + 1; j < NUM_NAMES; j++) {
+      if (hashes[i] == hashes[j]) {
+        fprintf(stderr, "Flags %s and %s have the same hash. Rename one of them.\n", names[i],
+                names[j]);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  // Start from the table size flag.c would pick (load factor <= 1/2) and double it if
+  // no seed can be found at that size.
+  unsigned bits = 3;
+  while ((1u << bits) < NUM_NAMES * 2) {
+    bits++;
+  }
+
+  static uint16_t slots[1 << 16];
+  for (; bits <= 16; bits++) {
+    // Walk odd multipliers with a Weyl sequence, starting from the default seed.
+    uint32_t seed = FLAG_SCHEMA_SEED | 1u;
+    for (int attempt = 0; attempt < (1 << 20); attempt++, seed += 0x9E3779B8u) {
+      if (!place_names(seed, bits, slots)) {
+        continue;
+      }
+
+      printf("// Generated by flaggen from %s. Do not edit.\n", FLAG_SCHEMA);
+      printf("#define FLAG_SCHEMA_SEED 0x%08" PRIX32 "u\n", seed);
+      printf("#define FLAG_SCHEMA_INDEX_COUNT %zu\n", NUM_NAMES);
+      printf("#define FLAG_SCHEMA_INDEX_BITS %u\n", bits);
+      printf("#define FLAG_SCHEMA_INDEX_SLOTS {");
+      for (size_t i = 0; i < ((size_t)1 << bits); i++) {
+        printf("%s%s%u", i ? "," : "", i % 16 ? " " : " \\\n  ", slots[i]);
+      }
+      printf("}\n");
+      return EXIT_SUCCESS;
+    }
+  }
+
+  fprintf(stderr, "No perfect seed found for %zu flags\n", NUM_NAMES);
+  return EXIT_FAILURE;
+}
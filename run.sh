@@ -1,9 +1,22 @@
 #!/bin/bash
 
+# ./run.sh bench builds and runs the micro-benchmarks in bench.c instead of the example.
+if [ "$1" = "bench" ]; then
+  gcc -O2 -pthread bench.c flag.c -o bench
+  exec ./bench
+fi
+
+# ./run.sh test builds and runs the tests in test.c under AddressSanitizer and
+# UndefinedBehaviorSanitizer.
+if [ "$1" = "test" ]; then
+  gcc -g -fsanitize=address,undefined -fno-sanitize-recover=undefined -pthread test.c flag.c -o test
+  exec ./test
+fi
+
 rm -f ./flag
 
-gcc -ggdb example.c flag.c -o flag
+gcc -ggdb -pthread example.c flag.c -o flag
 
 # ./flag greet -name "John Doe"
 
-./flag -int 5 -size_t 100 -int8 127 -int16 16 -int32 32 -int64 64 -uint 4294967295 -uint8 255 -uint16 65535 -uint32 4294967295 -uint64 18446744073709551615 -uintptr 1234567890 -float32 3.14 -float64 2.718 -string "Hello, World!" print -verbose true -count 30
\ No newline at end of file
+./flag -int 5 -size_t 100 -int8 127 -int16 16 -int32 32 -int64 64 -uint 4294967295 -uint8 255 -uint16 65535 -uint32 4294967295 -uint64 18446744073709551615 -uintptr 1234567890 -float32 3.14 -float64 2.718 -string "Hello, World!" print -verbose true -count 5
\ No newline at end of file
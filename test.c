@@ -0,0 +1,723 @@
+// Behavioural tests for the library. Build and run them under AddressSanitizer and
+// UndefinedBehaviorSanitizer with:
+//
+//   ./run.sh test
+//
+// Every test builds its own contexts. A failed check prints its line, the remaining checks
+// still run, and the program exits with status 1.
+
+#include "flag.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static int num_checks;
+static int num_failures;
+
+#define CHECK(cond)                                                                                \
+  do {                                                                                             \
+    num_checks++;                                                                                  \
+    if (!(cond)) {                                                                                 \
+      num_failures++;                                                                              \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                     \
+    }                                                                                              \
+  } while (0)
+
+// Directory holding the files written by the tests. Created by main.
+static char tmp_dir[] = "/tmp/flag_test.XXXXXX";
+
+// Path of name in tmp_dir, in one of a few rotating buffers.
+static const char* tmp_path(const char* name) {
+  static char paths[4][256];
+  static int next;
+  char* path = paths[next++ % 4];
+  snprintf(path, sizeof(paths[0]), "%s/%s", tmp_dir, name);
+  return path;
+}
+
+// Replace the file at path with text. The new file is renamed over the old one, so it
+// always gets a new identity.
+static void write_file(const char* path, const char* text) {
+  char tmp[300];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE* f = fopen(tmp, "w");
+  if (f == NULL || fputs(text, f) < 0 || fclose(f) != 0 || rename(tmp, path) != 0) {
+    fprintf(stderr, "Unable to write %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Send stdout to the file at path until stdout_restore is called with the returned descriptor.
+static int stdout_to(const char* path) {
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+  return saved;
+}
+
+static void stdout_restore(int saved) {
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+}
+
+// Contents of the file at path, NUL-terminated, in a buffer shared by all calls.
+static const char* read_file(const char* path) {
+  static char text[1 << 16];
+  FILE* f = fopen(path, "r");
+  size_t len = f != NULL ? fread(text, 1, sizeof(text) - 1, f) : 0;
+  if (f != NULL) {
+    fclose(f);
+  }
+  text[len] = '\0';
+  return text;
+}
+
+// Parse the NULL-terminated arguments after err against ctx, with "test" as argv[0].
+// The argv array is static, so positionals may point into it after the call.
+static flag_status parse(flag_ctx* ctx, subcommand** subcmd, flag_error* err, ...) {
+  static char* argv[64];
+  int argc = 0;
+  argv[argc++] = "test";
+  va_list ap;
+  va_start(ap, err);
+  for (char* arg; (arg = va_arg(ap, char*)) != NULL;) {
+    argv[argc++] = arg;
+  }
+  va_end(ap);
+  argv[argc] = NULL;
+  return ParseFlagsEx(ctx, argc, argv, subcmd, err);
+}
+
+// Parse "-v arg" into value, a flag of type with the optional range, in a fresh context.
+static flag_status parse_value(flag_type type, void* value, const flag_range* range,
+                               const char* arg) {
+  flag_ctx* ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "v", .value = value, .type = type, .desc = "value", .range = range);
+  flag_error err;
+  flag_status status = parse(ctx, NULL, &err, "-v", arg, NULL);
+  DestroyFlagContext(ctx);
+  return status;
+}
+
+static void test_integers(void) {
+  int8_t i8 = 0;
+  CHECK(parse_value(FLAG_INT8, &i8, NULL, "-128") == FLAG_OK && i8 == -128);
+  CHECK(parse_value(FLAG_INT8, &i8, NULL, "127") == FLAG_OK && i8 == 127);
+  CHECK(parse_value(FLAG_INT8, &i8, NULL, "128") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT8, &i8, NULL, "-129") == FLAG_ERR_INVALID_VALUE);
+
+  uint8_t u8 = 0;
+  CHECK(parse_value(FLAG_UINT8, &u8, NULL, "255") == FLAG_OK && u8 == 255);
+  CHECK(parse_value(FLAG_UINT8, &u8, NULL, "256") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_UINT8, &u8, NULL, "-1") == FLAG_ERR_INVALID_VALUE);
+
+  int64_t i64 = 0;
+  CHECK(parse_value(FLAG_INT64, &i64, NULL, "-9223372036854775808") == FLAG_OK &&
+        i64 == INT64_MIN);
+  CHECK(parse_value(FLAG_INT64, &i64, NULL, "9223372036854775807") == FLAG_OK &&
+        i64 == INT64_MAX);
+  CHECK(parse_value(FLAG_INT64, &i64, NULL, "9223372036854775808") == FLAG_ERR_INVALID_VALUE);
+
+  uint64_t u64 = 0;
+  CHECK(parse_value(FLAG_UINT64, &u64, NULL, "18446744073709551615") == FLAG_OK &&
+        u64 == UINT64_MAX);
+  CHECK(parse_value(FLAG_UINT64, &u64, NULL, "18446744073709551616") == FLAG_ERR_INVALID_VALUE);
+
+  int n = 7;
+  CHECK(parse_value(FLAG_INT, &n, NULL, "+42") == FLAG_OK && n == 42);
+  CHECK(parse_value(FLAG_INT, &n, NULL, "12x") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT, &n, NULL, "") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT, &n, NULL, "-") == FLAG_ERR_INVALID_VALUE);
+
+  // Ranges are checked while the digits are read, on both sides of 0.
+  const flag_range positive = {1, 10};
+  CHECK(parse_value(FLAG_INT, &n, &positive, "1") == FLAG_OK && n == 1);
+  CHECK(parse_value(FLAG_INT, &n, &positive, "10") == FLAG_OK && n == 10);
+  CHECK(parse_value(FLAG_INT, &n, &positive, "0") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT, &n, &positive, "11") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT, &n, &positive, "-1") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT, &n, &positive, "-0") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT, &n, &(flag_range){0, 10}, "-0") == FLAG_OK && n == 0);
+
+  const flag_range negative = {-10, -5};
+  CHECK(parse_value(FLAG_INT, &n, &negative, "-5") == FLAG_OK && n == -5);
+  CHECK(parse_value(FLAG_INT, &n, &negative, "-10") == FLAG_OK && n == -10);
+  CHECK(parse_value(FLAG_INT, &n, &negative, "-4") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT, &n, &negative, "-11") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT, &n, &negative, "0") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_INT, &n, &negative, "5") == FLAG_ERR_INVALID_VALUE);
+
+  const flag_range around = {-3, 3};
+  CHECK(parse_value(FLAG_INT, &n, &around, "-0") == FLAG_OK && n == 0);
+  CHECK(parse_value(FLAG_INT, &n, &around, "-3") == FLAG_OK && n == -3);
+  CHECK(parse_value(FLAG_INT, &n, &around, "4") == FLAG_ERR_INVALID_VALUE);
+}
+
+static void test_reals(void) {
+  // Short decimals take the exact fast path, long ones the strtod fallback. Both must give
+  // the correctly rounded double.
+  const char* inputs[] = {"0",      "3.5",   "-2.25", "0.1",  "1e-5",  "6.02214076e23",
+                          "1e22",   "1e23",  "2.2250738585072014e-308",
+                          "3.14159265358979323846264338327950288"};
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    double d = -1;
+    CHECK(parse_value(FLAG_DOUBLE, &d, NULL, inputs[i]) == FLAG_OK);
+    CHECK(d == strtod(inputs[i], NULL));
+  }
+
+  float f = 0;
+  CHECK(parse_value(FLAG_FLOAT, &f, NULL, "0.1") == FLAG_OK && f == 0.1f);
+
+  double d = 0;
+  CHECK(parse_value(FLAG_DOUBLE, &d, NULL, "1.5x") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_DOUBLE, &d, NULL, "") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_DOUBLE, &d, &(flag_range){0, 1}, "1.5") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_DOUBLE, &d, &(flag_range){0, 1}, "0.5") == FLAG_OK && d == 0.5);
+}
+
+static void test_units(void) {
+  int64_t ns = 0;
+  CHECK(parse_value(FLAG_DURATION, &ns, NULL, "1h30m") == FLAG_OK && ns == 5400000000000);
+  CHECK(parse_value(FLAG_DURATION, &ns, NULL, "250ms") == FLAG_OK && ns == 250000000);
+  CHECK(parse_value(FLAG_DURATION, &ns, NULL, "1.5s") == FLAG_OK && ns == 1500000000);
+  CHECK(parse_value(FLAG_DURATION, &ns, NULL, "0") == FLAG_OK && ns == 0);
+  CHECK(parse_value(FLAG_DURATION, &ns, NULL, "10") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_DURATION, &ns, NULL, "10y") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_DURATION, &ns, NULL, "3000000h") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_DURATION, &ns, NULL, "2562047h47m16.854775807s") == FLAG_OK &&
+        ns == INT64_MAX);
+
+  int64_t bytes = 0;
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "4GiB") == FLAG_OK && bytes == 4LL << 30);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "1kB") == FLAG_OK && bytes == 1000);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "1K") == FLAG_OK && bytes == 1024);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "512") == FLAG_OK && bytes == 512);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "-1") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "8EiB") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "1.5GB") == FLAG_OK && bytes == 1500000000);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "0.5KiB") == FLAG_OK && bytes == 512);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "1.5") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "0.3KiB") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "1.0000000000000000001EiB") ==
+        FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "1KB") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_BYTES, &bytes, NULL, "99999999999999999999") == FLAG_ERR_INVALID_VALUE);
+
+  double rate = 0;
+  CHECK(parse_value(FLAG_RATE, &rate, NULL, "10k/s") == FLAG_OK && rate == 10000);
+  CHECK(parse_value(FLAG_RATE, &rate, NULL, "5/ms") == FLAG_OK && rate == 5000);
+  CHECK(parse_value(FLAG_RATE, &rate, NULL, "100") == FLAG_OK && rate == 100);
+  CHECK(parse_value(FLAG_RATE, &rate, NULL, "-1") == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse_value(FLAG_RATE, &rate, NULL, "2.5M/h") == FLAG_OK && rate == 2500000.0 / 3600);
+  CHECK(parse_value(FLAG_RATE, &rate, NULL, "1e3/s") == FLAG_OK && rate == 1000);
+  CHECK(parse_value(FLAG_RATE, &rate, NULL, "+-1") == FLAG_ERR_INVALID_VALUE);
+}
+
+static void test_errors(void) {
+  static int n = 1;
+  static char* name = "default";
+  flag_ctx* ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "n", .value = &n, .type = FLAG_INT, .desc = "n");
+  AddFlag(ctx, .name = "name", .value = &name, .type = FLAG_STRING, .desc = "name", .req = true);
+
+  flag_error err;
+  CHECK(parse(ctx, NULL, &err, "-name", "x", "-n", NULL) == FLAG_ERR_MISSING_VALUE);
+  CHECK(err.flag != NULL && strcmp(err.flag, "n") == 0 && err.index == 3);
+
+  CHECK(parse(ctx, NULL, &err, "-name", "x", "-n", "4x", NULL) == FLAG_ERR_INVALID_VALUE);
+  CHECK(strcmp(err.value, "4x") == 0 && err.offset == 1 && err.index == 4);
+
+  CHECK(parse(ctx, NULL, &err, "-n", "3", NULL) == FLAG_ERR_REQUIRED);
+  CHECK(strcmp(err.flag, "name") == 0);
+
+  char buf[256];
+  CHECK(FlagErrorString(&err, buf, sizeof(buf)) > 0 && strstr(buf, "name") != NULL);
+
+  CHECK(parse(ctx, NULL, &err, "-name", "x", "-help", NULL) == FLAG_HELP);
+  CHECK(parse(ctx, NULL, &err, "-name", "x", "-n", "3", NULL) == FLAG_OK && n == 3);
+  DestroyFlagContext(ctx);
+}
+
+static bool is_even(const void* value) {
+  return *(const int*)value % 2 == 0;
+}
+
+static void test_validators(void) {
+  static int n = 0;
+  static char* color = "red";
+  static char* tag = "";
+  flag_ctx* ctx = CreateFlagContext();
+  flag* nf = AddFlag(ctx, .name = "n", .value = &n, .type = FLAG_INT, .desc = "n");
+  AddValidator(ctx, nf, is_even, "n must be even");
+  AddFlag(ctx, .name = "color", .value = &color, .type = FLAG_STRING, .desc = "color",
+          .choices = (const char*[]){"red", "green", NULL});
+  AddFlag(ctx, .name = "tag", .value = &tag, .type = FLAG_STRING, .desc = "tag",
+          .pattern = "[a-z]+[0-9]*");
+
+  flag_error err;
+  CHECK(parse(ctx, NULL, &err, "-n", "4", "-color", "green", "-tag", "ab12", NULL) == FLAG_OK);
+  CHECK(n == 4 && strcmp(color, "green") == 0 && strcmp(tag, "ab12") == 0);
+  CHECK(parse(ctx, NULL, &err, "-n", "3", NULL) == FLAG_ERR_VALIDATION);
+  CHECK(strcmp(err.reason, "n must be even") == 0);
+  CHECK(parse(ctx, NULL, &err, "-color", "blue", NULL) == FLAG_ERR_INVALID_VALUE);
+  CHECK(parse(ctx, NULL, &err, "-tag", "12ab", NULL) == FLAG_ERR_INVALID_VALUE);
+  DestroyFlagContext(ctx);
+}
+
+static void test_lazy(void) {
+  static int n = 2;
+  static double ratio = 0.5;
+  flag_ctx* ctx = CreateFlagContext();
+  flag* nf = AddFlag(ctx, .name = "n", .value = &n, .type = FLAG_INT, .desc = "n", .lazy = true);
+  AddValidator(ctx, nf, is_even, "n must be even");
+  flag* rf = AddFlag(ctx, .name = "ratio", .value = &ratio, .type = FLAG_DOUBLE, .desc = "r",
+                     .lazy = true, .range = &(flag_range){0, 1});
+
+  // Parsing records the raw values only; they are checked when resolved.
+  flag_error err;
+  CHECK(parse(ctx, NULL, &err, "-n", "3", "-ratio", "0.25", NULL) == FLAG_OK && n == 2);
+  CHECK(ResolveFlag(nf, &err) == FLAG_ERR_VALIDATION && strcmp(err.reason, "n must be even") == 0);
+  CHECK(n == 2 && FlagInt(nf) == 2);  // A value that fails validation is never stored.
+  CHECK(ResolveFlag(nf, &err) == FLAG_OK);
+  CHECK(FlagDouble(rf) == 0.25);
+
+  CHECK(parse(ctx, NULL, &err, "-n", "x", "-ratio", "2", NULL) == FLAG_OK);
+  CHECK(ResolveFlag(nf, &err) == FLAG_ERR_INVALID_VALUE && n == 2);
+  CHECK(ResolveFlag(rf, &err) == FLAG_ERR_INVALID_VALUE && ratio == 0.5);
+
+  CHECK(parse(ctx, NULL, &err, "-n", "8", NULL) == FLAG_OK);
+  CHECK(ResolveFlag(nf, &err) == FLAG_OK && n == 8);
+  DestroyFlagContext(ctx);
+}
+
+static void test_restore(void) {
+  static int n = 1;
+  static char* name = "default";
+  static bool verbose = false;
+  static flag_list ids = {0};
+  flag_ctx* ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "verbose", .value = &verbose, .type = FLAG_BOOL, .desc = "v");
+  AddFlag(ctx, .name = "n", .value = &n, .type = FLAG_INT, .desc = "n");
+  AddFlag(ctx, .name = "name", .value = &name, .type = FLAG_STRING, .desc = "name");
+  flag* ids_flag = AddFlag(ctx, .name = "ids", .value = &ids, .type = FLAG_INT_LIST, .desc = "i");
+
+  flag_error err;
+  CHECK(parse(ctx, NULL, &err, "-verbose", "-n", "5", "-name", "x", "-ids", "1,2", "-ids", "3",
+              NULL) == FLAG_OK);
+  CHECK(verbose && n == 5 && strcmp(name, "x") == 0);
+  flag_list v = FlagIntList(ids_flag);
+  CHECK(v.count == 3 && ((const int*)v.items)[2] == 3);
+
+  // Every parse starts from the defaults, not from the values of the last one.
+  CHECK(parse(ctx, NULL, &err, NULL) == FLAG_OK);
+  CHECK(!verbose && n == 1 && strcmp(name, "default") == 0 && FlagIntList(ids_flag).count == 0);
+
+  // A failed parse is undone by the next one too.
+  CHECK(parse(ctx, NULL, &err, "-n", "9", "-name", NULL) == FLAG_ERR_MISSING_VALUE);
+  CHECK(parse(ctx, NULL, &err, "-name", "y", NULL) == FLAG_OK && n == 1);
+
+  // Help shows the saved defaults, read at their aligned offsets.
+  int saved = stdout_to("/dev/null");
+  PrintHelp(ctx, (char*[]){"test", NULL});
+  stdout_restore(saved);
+  DestroyFlagContext(ctx);
+}
+
+static void ignore_args(FlagArgs args) {
+  (void)args;
+}
+
+static FlagArgs handler_args;
+
+static void capture_args(FlagArgs args) {
+  handler_args = args;
+}
+
+static void test_subcommands(void) {
+  static int port = 80;
+  static int count = 0;
+  static bool force = false;
+  flag_ctx* ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "port", .value = &port, .type = FLAG_INT, .desc = "p");
+  subcommand* serve = AddSubCmd(ctx, .name = "serve", .desc = "serve", .handler = capture_args);
+  subcommand* status_cmd = AddSubCmd(ctx, .name = "status", .desc = "status",
+                                     .handler = ignore_args);
+  AddSubCmdFlag(serve, .name = "count", .value = &count, .type = FLAG_INT, .desc = "c");
+  subcommand* drain = AddNestedSubCmd(serve, .name = "drain", .desc = "drain",
+                                      .handler = ignore_args);
+  AddSubCmdFlag(drain, .name = "force", .value = &force, .type = FLAG_BOOL, .desc = "f");
+
+  subcommand* selected = NULL;
+  flag_error err;
+  CHECK(parse(ctx, &selected, &err, "-port", "1", "serve", "-count", "2", NULL) == FLAG_OK);
+  CHECK(selected == serve && port == 1 && count == 2);
+  InvokeSubCmd(selected, ctx);
+  CHECK(*(int*)FlagValueArgs(&handler_args, "count") == 2);
+  CHECK(FlagValueArgs(&handler_args, "port") == NULL);
+  CHECK(parse(ctx, &selected, &err, "serve", "drain", "-count", "3", "-force", NULL) == FLAG_OK);
+  CHECK(selected == drain && count == 3 && force);
+  CHECK(parse(ctx, &selected, &err, "status", NULL) == FLAG_OK && selected == status_cmd);
+  CHECK(count == 0 && !force);
+  DestroyFlagContext(ctx);
+}
+
+static void test_completion(void) {
+  flag_ctx* ctx = CreateFlagContext();
+  subcommand* serve = AddSubCmd(ctx, .name = "serve", .desc = "serve", .handler = ignore_args);
+  AddNestedSubCmd(serve, .name = "drain", .desc = "drain", .handler = ignore_args);
+  AddSubCmd(ctx, .name = "drain", .desc = "top-level drain", .handler = ignore_args);
+
+  // Without EnableFlagCompletion the words are ordinary positionals.
+  char* argv[] = {"test", "__complete", "se", NULL};
+  CHECK(ParseFlags(ctx, 3, argv) == NULL);
+  size_t count;
+  char** items = FlagPositionals(ctx, &count);
+  CHECK(count == 2 && strcmp(items[0], "__complete") == 0);
+
+  // Nested subcommands are keyed on their whole path, so "serve drain" and the top-level
+  // "drain" get separate conditions.
+  const char* path = tmp_path("complete.fish");
+  int saved = stdout_to(path);
+  CHECK(PrintCompletionScript(ctx, "fish", "test") == 0);
+  stdout_restore(saved);
+  const char* script = read_file(path);
+  CHECK(strstr(script, "contains -- $next 'serve' 'serve drain' 'drain'") != NULL);
+  CHECK(strstr(script, "-n '__test_at \\'serve\\'' -f -a drain") != NULL);
+  CHECK(strstr(script, "-n '__test_at \\'\\'' -f -a drain") != NULL);
+  CHECK(strstr(script, "__fish_seen_subcommand_from") == NULL);
+  CHECK(PrintCompletionScript(ctx, "tcsh", "test") == -1);
+  DestroyFlagContext(ctx);
+}
+
+static void test_positionals(void) {
+  static int n = 0;
+  flag_ctx* ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "n", .value = &n, .type = FLAG_INT, .desc = "n");
+
+  flag_error err;
+  size_t count;
+  CHECK(parse(ctx, NULL, &err, "a", "b", "-n", "1", "c", "--", "-n", "-", NULL) == FLAG_OK);
+  char** items = FlagPositionals(ctx, &count);
+  CHECK(count == 5 && n == 1);
+  CHECK(count == 5 && strcmp(items[0], "a") == 0 && strcmp(items[2], "c") == 0 &&
+        strcmp(items[3], "-n") == 0 && strcmp(items[4], "-") == 0);
+
+  CHECK(parse(ctx, NULL, &err, "-n", "2", NULL) == FLAG_OK);
+  FlagPositionals(ctx, &count);
+  CHECK(count == 0);
+  DestroyFlagContext(ctx);
+}
+
+static void test_groups(void) {
+  static bool json = false, yaml = false;
+  static char* user = NULL;
+  static char* password = NULL;
+  flag_ctx* ctx = CreateFlagContext();
+  flag* json_flag = AddFlag(ctx, .name = "json", .value = &json, .type = FLAG_BOOL, .desc = "j");
+  flag* yaml_flag = AddFlag(ctx, .name = "yaml", .value = &yaml, .type = FLAG_BOOL, .desc = "y");
+  flag* user_flag = AddFlag(ctx, .name = "user", .value = &user, .type = FLAG_STRING, .desc = "u");
+  flag* pass_flag = AddFlag(ctx, .name = "password", .value = &password, .type = FLAG_STRING,
+                            .desc = "p");
+  AddFlagGroup(ctx, FLAG_GROUP_EXCLUSIVE, json_flag, yaml_flag);
+  AddFlagGroup(ctx, FLAG_GROUP_REQUIRES, user_flag, pass_flag);
+
+  flag_error err;
+  CHECK(parse(ctx, NULL, &err, "-json", NULL) == FLAG_OK);
+  CHECK(parse(ctx, NULL, &err, "-json", "-yaml", NULL) == FLAG_ERR_CONFLICT);
+  CHECK(parse(ctx, NULL, &err, "-user", "u", NULL) == FLAG_ERR_REQUIRED);
+  CHECK(parse(ctx, NULL, &err, "-user", "u", "-password", "p", NULL) == FLAG_OK);
+
+  // A user from a config file needs a password just the same.
+  const char* path = tmp_path("groups.conf");
+  write_file(path, "user = u\n");
+  CHECK(LoadFlagConfig(ctx, path, &err) == FLAG_OK);
+  CHECK(parse(ctx, NULL, &err, NULL) == FLAG_ERR_REQUIRED);
+  CHECK(strcmp(err.flag, "password") == 0 && strcmp(err.other, "user") == 0);
+  CHECK(parse(ctx, NULL, &err, "-password", "p", NULL) == FLAG_OK);
+  DestroyFlagContext(ctx);
+}
+
+static void test_frozen(void) {
+  static int n = 1;
+  static char* name = "default";
+  flag_ctx* ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "n", .value = &n, .type = FLAG_INT, .desc = "n",
+          .range = &(flag_range){0, 9});
+  AddFlag(ctx, .name = "name", .value = &name, .type = FLAG_STRING, .desc = "name");
+  subcommand* run = AddSubCmd(ctx, .name = "run", .desc = "run", .handler = ignore_args);
+  FreezeFlagContext(ctx);
+
+  flag_result* result = CreateFlagResult(ctx);
+  flag_error err;
+  char* argv[] = {"test", "-n", "5", "run", "file", NULL};
+  CHECK(ParseFlagsInto(ctx, 5, argv, result, &err) == FLAG_OK);
+  CHECK(*(int*)FlagResultValue(result, NULL, "n") == 5);
+  CHECK(strcmp(*(char**)FlagResultValue(result, NULL, "name"), "default") == 0);
+  CHECK(FlagResultSubCmd(result) == run);
+  size_t count;
+  char** items = FlagResultPositionals(result, &count);
+  CHECK(count == 1 && strcmp(items[0], "file") == 0);
+  CHECK(FlagResultValue(result, NULL, "missing") == NULL);
+  CHECK(n == 1);  // The variables are never written.
+
+  // A batch reports each line on its own.
+  flag_result* results[3] = {CreateFlagResult(ctx), CreateFlagResult(ctx), CreateFlagResult(ctx)};
+  char* lines[3][3] = {{"test", "-n", "1"}, {"test", "-n", "12"}, {"test", "-n", "3"}};
+  flag_batch_item items_batch[3];
+  for (int i = 0; i < 3; i++) {
+    items_batch[i] = (flag_batch_item){.argc = 3, .argv = lines[i], .result = results[i]};
+  }
+  CHECK(ParseFlagsBatch(ctx, items_batch, 3, 2) == 1);
+  CHECK(items_batch[0].status == FLAG_OK && *(int*)FlagResultValue(results[0], NULL, "n") == 1);
+  CHECK(items_batch[1].status == FLAG_ERR_INVALID_VALUE);
+  CHECK(items_batch[2].status == FLAG_OK && *(int*)FlagResultValue(results[2], NULL, "n") == 3);
+  for (int i = 0; i < 3; i++) {
+    DestroyFlagResult(results[i]);
+  }
+  DestroyFlagResult(result);
+  DestroyFlagContext(ctx);
+}
+
+static void test_config(void) {
+  static int port = 80;
+  static char* host = "localhost";
+  static bool verbose = false;
+  static int count = 0;
+  const char* path = tmp_path("server.conf");
+  write_file(path, "# comment\nport = 8080\nhost = \"example.com\"\n\nverbose\nrun.count = 3");
+
+  flag_ctx* ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "port", .value = &port, .type = FLAG_INT, .desc = "p", .req = true);
+  AddFlag(ctx, .name = "host", .value = &host, .type = FLAG_STRING, .desc = "h");
+  AddFlag(ctx, .name = "verbose", .value = &verbose, .type = FLAG_BOOL, .desc = "v");
+  subcommand* run = AddSubCmd(ctx, .name = "run", .desc = "run", .handler = ignore_args);
+  AddSubCmdFlag(run, .name = "count", .value = &count, .type = FLAG_INT, .desc = "c");
+
+  flag_error err;
+  CHECK(LoadFlagConfig(ctx, path, &err) == FLAG_OK);
+  CHECK(port == 8080 && strcmp(host, "example.com") == 0 && verbose && count == 3);
+
+  // The file replaced the defaults: argv overrides it, and a parse without the flag restores
+  // the file's value. It also satisfies the required flag.
+  CHECK(parse(ctx, NULL, &err, "-port", "9", NULL) == FLAG_OK && port == 9);
+  CHECK(parse(ctx, NULL, &err, NULL) == FLAG_OK && port == 8080);
+  DestroyFlagContext(ctx);
+
+  write_file(path, "port = 1\nport = x\n");
+  ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "port", .value = &port, .type = FLAG_INT, .desc = "p");
+  CHECK(LoadFlagConfig(ctx, path, &err) == FLAG_ERR_INVALID_VALUE);
+  CHECK(err.line == 2 && strcmp(err.file, path) == 0);
+  write_file(path, "bogus = 1\n");
+  CHECK(LoadFlagConfig(ctx, path, &err) == FLAG_ERR_UNKNOWN_FLAG && err.line == 1);
+  CHECK(LoadFlagConfig(ctx, tmp_path("missing.conf"), &err) == FLAG_ERR_IO);
+
+  // An empty file sets nothing. A file filling a whole page without a newline ends at the
+  // page boundary, so its last line is read from a copy.
+  port = 80;
+  write_file(path, "");
+  CHECK(LoadFlagConfig(ctx, path, &err) == FLAG_OK && port == 80);
+  static char page[4097];
+  memset(page, '#', 4096);
+  write_file(path, page);
+  CHECK(LoadFlagConfig(ctx, path, &err) == FLAG_OK && port == 80);
+  memcpy(page + 4096 - strlen("\nport = 42"), "\nport = 42", strlen("\nport = 42"));
+  write_file(path, page);
+  CHECK(LoadFlagConfig(ctx, path, &err) == FLAG_OK && port == 42);
+  DestroyFlagContext(ctx);
+}
+
+static void test_env(void) {
+  static int port = 80;
+  static char* host = "localhost";
+  flag_ctx* ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "port", .value = &port, .type = FLAG_INT, .desc = "p", .env = "TEST_PORT");
+  AddFlag(ctx, .name = "host", .value = &host, .type = FLAG_STRING, .desc = "h",
+          .env = "TEST_HOST");
+
+  setenv("TEST_PORT", "8443", 1);
+  unsetenv("TEST_HOST");
+  flag_error err;
+  CHECK(LoadFlagEnv(ctx, &err) == FLAG_OK && port == 8443 && strcmp(host, "localhost") == 0);
+  CHECK(parse(ctx, NULL, &err, "-port", "1", NULL) == FLAG_OK && port == 1);
+  CHECK(parse(ctx, NULL, &err, NULL) == FLAG_OK && port == 8443);
+
+  setenv("TEST_PORT", "bad", 1);
+  CHECK(LoadFlagEnv(ctx, &err) == FLAG_ERR_INVALID_VALUE);
+  CHECK(err.env != NULL && strcmp(err.env, "TEST_PORT") == 0);
+  unsetenv("TEST_PORT");
+  DestroyFlagContext(ctx);
+}
+
+static void test_response_files(void) {
+  static int n = 0;
+  static char* name = "";
+  const char* args = tmp_path("args.rsp");
+  const char* nested = tmp_path("nested.rsp");
+  char text[512];
+  snprintf(text, sizeof(text), "-n 4\n-name 'two words' @%s", nested);
+  write_file(args, text);
+  write_file(nested, "extra\\ file");
+
+  flag_ctx* ctx = CreateFlagContext();
+  AddFlag(ctx, .name = "n", .value = &n, .type = FLAG_INT, .desc = "n");
+  AddFlag(ctx, .name = "name", .value = &name, .type = FLAG_STRING, .desc = "name");
+
+  char at[300];
+  snprintf(at, sizeof(at), "@%s", args);
+  flag_error err;
+  size_t count;
+  CHECK(parse(ctx, NULL, &err, at, NULL) == FLAG_OK && n == 4);
+  CHECK(strcmp(name, "two words") == 0);
+  char** items = FlagPositionals(ctx, &count);
+  CHECK(count == 1 && strcmp(items[0], "extra file") == 0);
+
+  snprintf(at, sizeof(at), "@%s", tmp_path("missing.rsp"));
+  CHECK(parse(ctx, NULL, &err, at, NULL) == FLAG_ERR_IO);
+  DestroyFlagContext(ctx);
+}
+
+// Context for the cache test, with a config file.
+static flag_ctx* cache_context(const char* cache, const char* config, int* port, char** host) {
+  flag_ctx* ctx = CreateFlagContext();
+  SetFlagCache(ctx, cache, 1);
+  AddFlag(ctx, .name = "port", .value = port, .type = FLAG_INT, .desc = "p");
+  AddFlag(ctx, .name = "host", .value = host, .type = FLAG_STRING, .desc = "h",
+          .req = true);
+  flag_error err;
+  CHECK(LoadFlagConfig(ctx, config, &err) == FLAG_OK);
+  return ctx;
+}
+
+static void test_cache(void) {
+  const char* cache = tmp_path("parse.cache");
+  const char* config = tmp_path("cache.conf");
+  write_file(config, "host = example.com\n");
+
+  // The first parse fills the cache, the second one is answered from it and must give the
+  // same values. A changed config file invalidates it.
+  for (int run = 0; run < 3; run++) {
+    if (run == 2) {
+      write_file(config, "host = other.org\n");
+    }
+    static int port;
+    static char* host;
+    port = 80;
+    host = "localhost";
+    flag_ctx* ctx = cache_context(cache, config, &port, &host);
+    flag_error err;
+    CHECK(parse(ctx, NULL, &err, "-port", "8080", "pos", NULL) == FLAG_OK);
+    CHECK(port == 8080);
+    CHECK(strcmp(host, run == 2 ? "other.org" : "example.com") == 0);
+    size_t count;
+    char** items = FlagPositionals(ctx, &count);
+    CHECK(count == 1 && strcmp(items[0], "pos") == 0);
+
+    // After a hit, the config file still provides the defaults of the help text and of
+    // later parses, and satisfies the required host.
+    if (run == 1) {
+      const char* help = tmp_path("help.txt");
+      int saved = stdout_to(help);
+      PrintHelp(ctx, (char*[]){"test", NULL});
+      stdout_restore(saved);
+      CHECK(strstr(read_file(help), "example.com") != NULL);
+      CHECK(port == 8080 && count == 1);
+      CHECK(parse(ctx, NULL, &err, NULL) == FLAG_OK);
+      CHECK(port == 80 && strcmp(host, "example.com") == 0);
+    }
+    DestroyFlagContext(ctx);
+  }
+}
+
+static void test_reload(void) {
+  static char* level = "info";
+  static int rate = 10;
+  static int port = 80;
+  static int from_cli = 1;
+  const char* path = tmp_path("reload.conf");
+  write_file(path, "level = warn\nrate = 20\nport = 8080\ncli = 2\n");
+
+  flag_ctx* ctx = CreateFlagContext();
+  flag* level_flag = AddFlag(ctx, .name = "level", .value = &level, .type = FLAG_STRING,
+                             .desc = "l", .reload = true);
+  flag* rate_flag = AddFlag(ctx, .name = "rate", .value = &rate, .type = FLAG_INT, .desc = "r",
+                            .reload = true, .range = &(flag_range){1, 1000});
+  AddFlag(ctx, .name = "port", .value = &port, .type = FLAG_INT, .desc = "p");
+  AddFlag(ctx, .name = "cli", .value = &from_cli, .type = FLAG_INT, .desc = "c", .reload = true);
+
+  flag_error err;
+  CHECK(LoadFlagConfig(ctx, path, &err) == FLAG_OK);
+  CHECK(parse(ctx, NULL, &err, "-cli", "2", NULL) == FLAG_OK);
+  CHECK(ReloadFlagConfig(ctx, &err) == FLAG_OK && FlagInt(rate_flag) == 20);
+
+  // Only reloadable flags change, and the command line still wins, even with a value equal
+  // to the default it replaced.
+  write_file(path, "level = debug\nrate = 30\nport = 9090\ncli = 7");
+  CHECK(ReloadFlagConfig(ctx, &err) == FLAG_OK);
+  CHECK(strcmp(FlagString(level_flag), "debug") == 0 && FlagInt(rate_flag) == 30);
+  CHECK(port == 8080 && from_cli == 2);
+
+  // Readers may keep a reloaded string however many reloads follow, and equal values share
+  // one copy.
+  const char* held = FlagString(level_flag);
+  const char* levels[] = {"level = a\n", "level = b\n", "level = c\n", "level = d\n",
+                          "level = e\n", "level = f\n", "level = debug\n"};
+  for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+    write_file(path, levels[i]);
+    CHECK(ReloadFlagConfig(ctx, &err) == FLAG_OK);
+  }
+  CHECK(strcmp(held, "debug") == 0 && FlagString(level_flag) == held);
+
+  // A bad file changes nothing.
+  write_file(path, "level = info\nrate = 5000\n");
+  CHECK(ReloadFlagConfig(ctx, &err) == FLAG_ERR_INVALID_VALUE);
+  CHECK(err.line == 2 && strcmp(err.value, "5000") == 0);
+  CHECK(FlagInt(rate_flag) == 30 && strcmp(FlagString(level_flag), "debug") == 0);
+
+  // Later parses start from the reloaded values.
+  write_file(path, "rate = 40\n");
+  CHECK(ReloadFlagConfig(ctx, &err) == FLAG_OK && FlagInt(rate_flag) == 40);
+  // A flag the command line set gets the file's latest value once it is no longer given.
+  CHECK(parse(ctx, NULL, &err, NULL) == FLAG_OK && rate == 40 && from_cli == 7);
+  write_file(path, "cli = 8\n");
+  CHECK(ReloadFlagConfig(ctx, &err) == FLAG_OK && from_cli == 8);
+  DestroyFlagContext(ctx);
+}
+
+int main(void) {
+  if (mkdtemp(tmp_dir) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  test_integers();
+  test_reals();
+  test_units();
+  test_errors();
+  test_validators();
+  test_lazy();
+  test_restore();
+  test_subcommands();
+  test_positionals();
+  test_completion();
+  test_groups();
+  test_frozen();
+  test_config();
+  test_env();
+  test_response_files();
+  test_cache();
+  test_reload();
+
+  const char* names[] = {"server.conf", "args.rsp", "nested.rsp", "parse.cache", "cache.conf",
+                         "reload.conf", "complete.fish", "help.txt", "groups.conf"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    unlink(tmp_path(names[i]));
+  }
+  rmdir(tmp_dir);
+
+  printf("%d checks, %d failed\n", num_checks, num_failures);
+  return num_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}